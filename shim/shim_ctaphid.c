@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "shim_ctaphid.h"
+#include "ccid.h"
+#include "return_codes.h"
+#include "settings.h"
+#include "utils.h"
+#include <string.h>
+#include <sys/param.h>
+
+#define CTAPHID_INIT_HEADER_SIZE 7
+#define CTAPHID_CONT_HEADER_SIZE 5
+
+static const uint32_t BROADCAST_CID = 0xFFFFFFFF;
+static const uint32_t ALLOCATED_CID = 0x00000001;
+static const uint8_t CTAPHID_INIT = 0x86;
+static const uint8_t CTAPHID_KEEPALIVE = 0xBB;
+static const uint8_t CTAPHID_ERROR = 0xBF;
+static const uint8_t CTAPHID_VENDOR_NITROKEY_OTP = 0xF0;
+static const uint8_t ERR_INVALID_CMD = 0x01;
+static const uint8_t KEEPALIVE_STATUS_UPNEEDED = 2;
+
+typedef struct ShimCtaphid {
+    // Request being assembled from the OUT packets
+    uint32_t request_cid;
+    uint8_t request_cmd;
+    uint8_t request[MAX_CCID_BUFFER_SIZE];
+    size_t request_length;
+    size_t request_received;
+    uint8_t next_seq;
+    // Vendor command passed to the CCID emulator, awaiting its response
+    bool ccid_pending;
+    uint8_t ccid_seq;
+    // Response being split into the IN packets
+    uint32_t response_cid;
+    uint8_t response_cmd;
+    uint8_t response[MAX_CCID_BUFFER_SIZE];
+    size_t response_length;
+    size_t response_sent;
+    uint8_t response_seq;
+    bool response_ready;
+} ShimCtaphid;
+
+static ShimCtaphid ctaphid;
+
+static uint32_t read_be32(const uint8_t *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
+
+static void write_be32(uint8_t *p, uint32_t value) {
+    p[0] = (value >> 24) & 0xFF;
+    p[1] = (value >> 16) & 0xFF;
+    p[2] = (value >> 8) & 0xFF;
+    p[3] = value & 0xFF;
+}
+
+static void respond(uint32_t cid, uint8_t cmd, const uint8_t *data, size_t length) {
+    ctaphid.response_cid = cid;
+    ctaphid.response_cmd = cmd;
+    memcpy(ctaphid.response, data, length);
+    ctaphid.response_length = length;
+    ctaphid.response_sent = 0;
+    ctaphid.response_seq = 0;
+    ctaphid.response_ready = true;
+}
+
+static void handle_request(ShimDevice *d) {
+    const uint32_t cid = ctaphid.request_cid;
+    if (ctaphid.request_cmd == CTAPHID_INIT && cid == BROADCAST_CID && ctaphid.request_length == 8) {
+        uint8_t init[17] = {0};
+        memcpy(init, ctaphid.request, 8);
+        write_be32(init + 8, ALLOCATED_CID);
+        init[12] = 2;// CTAPHID protocol version
+        respond(cid, CTAPHID_INIT, init, sizeof init);
+        return;
+    }
+    if (ctaphid.request_cmd == CTAPHID_VENDOR_NITROKEY_OTP && cid == ALLOCATED_CID) {
+        uint8_t frame[MAX_CCID_BUFFER_SIZE] = {0};
+        frame[0] = 0x6F;
+        frame[1] = ctaphid.request_length & 0xFF;
+        frame[2] = (ctaphid.request_length >> 8) & 0xFF;
+        frame[ICC_SEQ_OFFSET] = ++ctaphid.ccid_seq;
+        memcpy(frame + ICC_HEADER_SIZE, ctaphid.request, ctaphid.request_length);
+        if (d->peer.on_send(d->peer.ctx, frame, ICC_HEADER_SIZE + ctaphid.request_length) == RET_NO_ERROR) {
+            ctaphid.ccid_pending = true;
+            return;
+        }
+    }
+    const uint8_t error = ERR_INVALID_CMD;
+    respond(cid, CTAPHID_ERROR, &error, 1);
+}
+
+// Ask the CCID emulator for the response, producing a keepalive while it waits for the touch
+static void poll_ccid(ShimDevice *d) {
+    uint8_t frame[MAX_CCID_BUFFER_SIZE];
+    size_t length = 0;
+    if (d->peer.on_receive(d->peer.ctx, frame, sizeof frame, &length) != RET_NO_ERROR ||
+        length < ICC_HEADER_SIZE) {
+        ctaphid.ccid_pending = false;
+        const uint8_t error = ERR_INVALID_CMD;
+        respond(ALLOCATED_CID, CTAPHID_ERROR, &error, 1);
+        return;
+    }
+    if (frame[7] == AWAITING_FOR_TOUCH_STATUS_CODE) {
+        const uint8_t status = KEEPALIVE_STATUS_UPNEEDED;
+        respond(ALLOCATED_CID, CTAPHID_KEEPALIVE, &status, 1);
+        return;
+    }
+    ctaphid.ccid_pending = false;
+    const size_t apdu_response_length = length - ICC_HEADER_SIZE;
+    if (apdu_response_length < 2) {
+        const uint8_t error = ERR_INVALID_CMD;
+        respond(ALLOCATED_CID, CTAPHID_ERROR, &error, 1);
+        return;
+    }
+    // the vendor command returns the status word first
+    uint8_t response[MAX_CCID_BUFFER_SIZE];
+    memcpy(response, frame + length - 2, 2);
+    memcpy(response + 2, frame + ICC_HEADER_SIZE, apdu_response_length - 2);
+    respond(ALLOCATED_CID, CTAPHID_VENDOR_NITROKEY_OTP, response, apdu_response_length);
+}
+
+bool shim_ctaphid_write(ShimDevice *d, const uint8_t *packet, size_t length) {
+    if (length < CTAPHID_INIT_HEADER_SIZE) {
+        return false;
+    }
+    const uint32_t cid = read_be32(packet);
+    size_t offset;
+    if (packet[4] & 0x80) {
+        ctaphid.request_cid = cid;
+        ctaphid.request_cmd = packet[4];
+        ctaphid.request_length = ((size_t) packet[5] << 8) | packet[6];
+        ctaphid.request_received = 0;
+        ctaphid.next_seq = 0;
+        if (ctaphid.request_length > sizeof ctaphid.request) {
+            return false;
+        }
+        offset = CTAPHID_INIT_HEADER_SIZE;
+    } else {
+        if (cid != ctaphid.request_cid || packet[4] != ctaphid.next_seq++) {
+            return false;
+        }
+        offset = CTAPHID_CONT_HEADER_SIZE;
+    }
+    const size_t chunk = MIN(ctaphid.request_length - ctaphid.request_received, length - offset);
+    memcpy(ctaphid.request + ctaphid.request_received, packet + offset, chunk);
+    ctaphid.request_received += chunk;
+    if (ctaphid.request_received == ctaphid.request_length) {
+        handle_request(d);
+    }
+    return true;
+}
+
+bool shim_ctaphid_read(ShimDevice *d, uint8_t *packet, size_t length) {
+    if (!ctaphid.response_ready && ctaphid.ccid_pending) {
+        poll_ccid(d);
+    }
+    if (!ctaphid.response_ready || length < SHIM_CTAPHID_PACKET_SIZE) {
+        return false;
+    }
+    memset(packet, 0, SHIM_CTAPHID_PACKET_SIZE);
+    write_be32(packet, ctaphid.response_cid);
+    size_t offset;
+    if (ctaphid.response_sent == 0) {
+        packet[4] = ctaphid.response_cmd;
+        packet[5] = (ctaphid.response_length >> 8) & 0xFF;
+        packet[6] = ctaphid.response_length & 0xFF;
+        offset = CTAPHID_INIT_HEADER_SIZE;
+    } else {
+        packet[4] = ctaphid.response_seq++;
+        offset = CTAPHID_CONT_HEADER_SIZE;
+    }
+    const size_t chunk = MIN(ctaphid.response_length - ctaphid.response_sent, SHIM_CTAPHID_PACKET_SIZE - offset);
+    memcpy(packet + offset, ctaphid.response + ctaphid.response_sent, chunk);
+    ctaphid.response_sent += chunk;
+    if (ctaphid.response_sent == ctaphid.response_length) {
+        ctaphid.response_ready = false;
+    }
+    return true;
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#ifndef NITROKEY_HOTP_VERIFICATION_SHIM_CTAPHID_H
+#define NITROKEY_HOTP_VERIFICATION_SHIM_CTAPHID_H
+
+#include "shim_device.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * CTAPHID interface of the emulated Nitrokey 3. Supports the channel allocation and the Nitrokey
+ * vendor command, which is passed to the CCID emulator. The user presence wait of the emulator
+ * is reported with the keepalive packets.
+ */
+
+#define SHIM_CTAPHID_PACKET_SIZE 64
+
+// Handle a packet written to the interrupt OUT endpoint. Returns false on a malformed packet.
+bool shim_ctaphid_write(ShimDevice *d, const uint8_t *packet, size_t length);
+// Produce a packet for the interrupt IN endpoint. Returns false if there is nothing to read.
+bool shim_ctaphid_read(ShimDevice *d, uint8_t *packet, size_t length);
+
+#endif//NITROKEY_HOTP_VERIFICATION_SHIM_CTAPHID_H
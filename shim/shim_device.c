@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "shim_device.h"
+#include "device.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char STATE_MAGIC[8] = "HOTPSIM1";
+
+typedef struct ShimStateFile {
+    char magic[8];
+    uint32_t size;
+    char model;
+    EmulatorHid hid;
+    EmulatorCcid ccid;
+} ShimStateFile;
+
+static ShimDevice shim_device;
+static bool shim_device_loaded = false;
+
+static uint32_t env_u32(const char *name) {
+    const char *value = getenv(name);
+    return value != nullptr ? (uint32_t) strtoul(value, nullptr, 10) : 0;
+}
+
+static char model_from_env(void) {
+    const char *name = getenv("HOTP_SIM_DEVICE");
+    if (name == nullptr || strcmp(name, "pro") == 0) return 'P';
+    if (strcmp(name, "librem") == 0) return 'L';
+    if (strcmp(name, "storage") == 0) return 'S';
+    if (strcmp(name, "nk3") == 0) return '3';
+    if (strcmp(name, "none") != 0) {
+        fprintf(stderr, "Unknown HOTP_SIM_DEVICE value: %s\n", name);
+    }
+    return 0;
+}
+
+static bool load_state(ShimStateFile *state) {
+    const char *path = getenv("HOTP_SIM_STATE");
+    if (path == nullptr) {
+        return false;
+    }
+    FILE *f = fopen(path, "rb");
+    if (f == nullptr) {
+        return false;
+    }
+    const bool ok = fread(state, sizeof *state, 1, f) == 1 &&
+                    memcmp(state->magic, STATE_MAGIC, sizeof STATE_MAGIC) == 0 &&
+                    state->size == sizeof *state;
+    fclose(f);
+    return ok;
+}
+
+ShimDevice *shim_device_get(void) {
+    if (shim_device_loaded) {
+        return &shim_device;
+    }
+    shim_device_loaded = true;
+    ShimDevice *d = &shim_device;
+    memset(d, 0, sizeof *d);
+    d->model = model_from_env();
+    d->arrival_us = micros() + (int64_t) env_u32("HOTP_SIM_ARRIVAL_MS") * 1000;
+    d->ccid_busy = env_u32("HOTP_SIM_CCID_BUSY") == 1;
+
+    EmulatorHidConfig hid_config = {
+            .model = (d->model == 0 || d->model == '3') ? 'P' : d->model,
+            .processing_time_us = env_u32("HOTP_SIM_PROCESSING_US"),
+            .transfer_time_us = env_u32("HOTP_SIM_TRANSFER_US"),
+            .storage_busy_reads = 5,
+    };
+    EmulatorCcidConfig ccid_config = {
+            .processing_time_us = hid_config.processing_time_us,
+            .transfer_time_us = hid_config.transfer_time_us,
+    };
+
+    static ShimStateFile state;
+    if (load_state(&state) && state.model == d->model) {
+        d->hid = state.hid;
+        d->ccid = state.ccid;
+        d->hid.config = hid_config;
+        d->ccid.config = ccid_config;
+    } else {
+        emulator_hid_init(&d->hid, &hid_config);
+        emulator_ccid_init(&d->ccid, &ccid_config);
+    }
+
+    if (d->model == '3') {
+        d->dev_info = devices_ccid[0];
+        d->connection_type = CONNECTION_CCID;
+        d->peer = emulator_ccid_peer(&d->ccid);
+    } else if (d->model != 0) {
+        d->dev_info = emulator_hid_dev_info(&d->hid);
+        d->connection_type = CONNECTION_HID;
+        d->peer = emulator_hid_peer(&d->hid);
+    }
+    return d;
+}
+
+bool shim_device_present(const ShimDevice *d) {
+    return d->model != 0 && micros() >= d->arrival_us;
+}
+
+void shim_device_save(void) {
+    const char *path = getenv("HOTP_SIM_STATE");
+    if (!shim_device_loaded || !shim_device.used || path == nullptr) {
+        return;
+    }
+    static ShimStateFile state;
+    memset(&state, 0, sizeof state);
+    memcpy(state.magic, STATE_MAGIC, sizeof STATE_MAGIC);
+    state.size = sizeof state;
+    state.model = shim_device.model;
+    state.hid = shim_device.hid;
+    state.ccid = shim_device.ccid;
+
+    char temporary_path[4096];
+    snprintf(temporary_path, sizeof temporary_path, "%s.tmp", path);
+    FILE *f = fopen(temporary_path, "wb");
+    if (f == nullptr) {
+        fprintf(stderr, "Cannot write simulated device state to %s\n", temporary_path);
+        return;
+    }
+    const bool ok = fwrite(&state, sizeof state, 1, f) == 1;
+    if (fclose(f) != 0 || !ok || rename(temporary_path, path) != 0) {
+        fprintf(stderr, "Cannot write simulated device state to %s\n", path);
+        remove(temporary_path);
+        return;
+    }
+    shim_device.used = false;
+}
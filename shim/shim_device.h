@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#ifndef NITROKEY_HOTP_VERIFICATION_SHIM_DEVICE_H
+#define NITROKEY_HOTP_VERIFICATION_SHIM_DEVICE_H
+
+#include "emulator_ccid.h"
+#include "emulator_hid.h"
+#include "loopback.h"
+#include <stdbool.h>
+
+/**
+ * Simulated device shared by the preloadable hidapi and libusb shims.
+ * Configured with environment variables:
+ * - HOTP_SIM_DEVICE - emulated model: pro, librem, storage, nk3 or none (default: pro),
+ * - HOTP_SIM_STATE - file keeping the device state between the tool runs (default: not kept),
+ * - HOTP_SIM_PROCESSING_US - emulated command processing time,
+ * - HOTP_SIM_TRANSFER_US - emulated time of a single USB transfer,
+ * - HOTP_SIM_ARRIVAL_MS - time after the start, at which the device gets connected (default: 0),
+ * - HOTP_SIM_CCID_BUSY - when 1, the CCID interface cannot be claimed, as if held by pcscd; the
+ *   Nitrokey 3 is then reachable over its CTAPHID interface only.
+ */
+
+// Exported entry points of the shim libraries
+#define SHIM_EXPORT __attribute__((visibility("default")))
+
+typedef struct ShimDevice {
+    // Emulated model, as in VidPid.name_short, or 0 if no device is connected
+    char model;
+    VidPid dev_info;
+    ConnectionType connection_type;
+    LoopbackPeer peer;
+    EmulatorHid hid;
+    EmulatorCcid ccid;
+    bool used;
+    // Time of the emulated device insertion, as returned by micros()
+    int64_t arrival_us;
+    bool ccid_busy;
+} ShimDevice;
+
+// Load the device state on the first call. Never returns NULL.
+ShimDevice *shim_device_get(void);
+// Check if the emulated device is connected at this moment
+bool shim_device_present(const ShimDevice *d);
+// Store the device state to the HOTP_SIM_STATE file, if it was used by this process
+void shim_device_save(void);
+
+#endif//NITROKEY_HOTP_VERIFICATION_SHIM_DEVICE_H
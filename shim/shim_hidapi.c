@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+/**
+ * Preloadable replacement of the hidapi entry points used by device.c.
+ * Effective only if the tool is linked dynamically against hidapi,
+ * otherwise the libusb shim serves the HID devices through the control transfers.
+ */
+
+#include "device.h"
+#include "return_codes.h"
+#include "shim_device.h"
+#include <hidapi.h>
+#include <string.h>
+
+struct hid_device_ {
+    ShimDevice *device;
+};
+
+static hid_device shim_hid_device;
+
+SHIM_EXPORT int hid_init(void) {
+    return 0;
+}
+
+SHIM_EXPORT int hid_exit(void) {
+    shim_device_save();
+    return 0;
+}
+
+SHIM_EXPORT hid_device *hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number) {
+    (void) serial_number;
+    ShimDevice *d = shim_device_get();
+    if (!shim_device_present(d) || d->connection_type != CONNECTION_HID || d->dev_info.vid != vendor_id || d->dev_info.pid != product_id) {
+        return nullptr;
+    }
+    shim_hid_device.device = d;
+    return &shim_hid_device;
+}
+
+SHIM_EXPORT int hid_send_feature_report(hid_device *dev, const unsigned char *data, size_t length) {
+    if (dev == nullptr || dev->device == nullptr) {
+        return -1;
+    }
+    dev->device->used = true;
+    const LoopbackPeer *peer = &dev->device->peer;
+    if (peer->on_send(peer->ctx, data, length) != RET_NO_ERROR) {
+        return -1;
+    }
+    return (int) length;
+}
+
+SHIM_EXPORT int hid_get_feature_report(hid_device *dev, unsigned char *data, size_t length) {
+    if (dev == nullptr || dev->device == nullptr) {
+        return -1;
+    }
+    dev->device->used = true;
+    const LoopbackPeer *peer = &dev->device->peer;
+    size_t actual_length = 0;
+    if (peer->on_receive(peer->ctx, data, length, &actual_length) != RET_NO_ERROR) {
+        return -1;
+    }
+    return (int) actual_length;
+}
+
+SHIM_EXPORT void hid_close(hid_device *dev) {
+    if (dev == nullptr) {
+        return;
+    }
+    shim_device_save();
+    dev->device = nullptr;
+}
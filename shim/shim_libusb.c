@@ -0,0 +1,553 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+/**
+ * Preloadable replacement of the libusb entry points used by ccid.c, and by the
+ * statically linked hidapi-libusb. Presents a single emulated device on the bus:
+ * the CCID one is served with the bulk transfers, the HID ones with the
+ * SET_REPORT and GET_REPORT control transfers. The Nitrokey 3 has also a CTAPHID interface, served with
+ * the interrupt transfers. Asynchronous transfers are completed
+ * in libusb_handle_events_timeout_completed(), together with the emulated device
+ * insertion reported to the hotplug callback.
+ */
+
+#include "device.h"
+#include "return_codes.h"
+#include "settings.h"
+#include "structs.h"
+#include "utils.h"
+#include "shim_ctaphid.h"
+#include "shim_device.h"
+#include <libusb.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <unistd.h>
+
+static const uint8_t HID_REQUEST_TYPE_SET = 0x21;
+static const uint8_t HID_REQUEST_TYPE_GET = 0xA1;
+static const uint8_t HID_SET_REPORT = 0x09;
+static const uint8_t HID_GET_REPORT = 0x01;
+
+struct libusb_context {
+    int unused;
+};
+
+struct libusb_device {
+    ShimDevice *device;
+};
+
+struct libusb_device_handle {
+    libusb_device *usb_device;
+};
+
+static libusb_context shim_context;
+static libusb_device shim_usb_device;
+static libusb_device_handle shim_handle;
+static libusb_device *shim_device_list[2];
+
+#define SUBMITTED_TRANSFERS_COUNT 8
+static struct libusb_transfer *submitted_transfers[SUBMITTED_TRANSFERS_COUNT];
+static bool cancelled_transfers[SUBMITTED_TRANSFERS_COUNT];
+
+// Hotplug callback registered with libusb_hotplug_register_callback, one at a time
+static libusb_hotplug_callback_fn hotplug_callback;
+static void *hotplug_user_data;
+static bool hotplug_arrival_reported;
+
+#define CTAPHID_INTERFACE_NUMBER 1
+
+static struct libusb_interface_descriptor shim_interface_descriptor = {
+        .bLength = 9,
+        .bDescriptorType = 0x04,
+        .bNumEndpoints = 0,
+};
+static const struct libusb_endpoint_descriptor shim_ctaphid_endpoints[] = {
+        {.bLength = 7, .bDescriptorType = 0x05, .bEndpointAddress = 0x81,
+         .bmAttributes = LIBUSB_TRANSFER_TYPE_INTERRUPT, .wMaxPacketSize = SHIM_CTAPHID_PACKET_SIZE},
+        {.bLength = 7, .bDescriptorType = 0x05, .bEndpointAddress = 0x01,
+         .bmAttributes = LIBUSB_TRANSFER_TYPE_INTERRUPT, .wMaxPacketSize = SHIM_CTAPHID_PACKET_SIZE},
+};
+static const struct libusb_interface_descriptor shim_ctaphid_interface_descriptor = {
+        .bLength = 9,
+        .bDescriptorType = 0x04,
+        .bInterfaceNumber = CTAPHID_INTERFACE_NUMBER,
+        .bNumEndpoints = 2,
+        .bInterfaceClass = LIBUSB_CLASS_HID,
+        .endpoint = shim_ctaphid_endpoints,
+};
+static const struct libusb_interface shim_interfaces[] = {
+        {.altsetting = &shim_interface_descriptor, .num_altsetting = 1},
+        {.altsetting = &shim_ctaphid_interface_descriptor, .num_altsetting = 1},
+};
+static struct libusb_config_descriptor shim_config_descriptor = {
+        .bLength = 9,
+        .bDescriptorType = 0x02,
+        .bNumInterfaces = 1,
+        .bConfigurationValue = 1,
+        .interface = shim_interfaces,
+};
+
+static ShimDevice *device_of(libusb_device_handle *dev_handle) {
+    if (dev_handle != &shim_handle || shim_handle.usb_device == nullptr) {
+        return nullptr;
+    }
+    ShimDevice *d = shim_handle.usb_device->device;
+    d->used = true;
+    return d;
+}
+
+SHIM_EXPORT int LIBUSB_CALL libusb_init(libusb_context **ctx) {
+    if (ctx != nullptr) {
+        *ctx = &shim_context;
+    }
+    return LIBUSB_SUCCESS;
+}
+
+SHIM_EXPORT void LIBUSB_CALL libusb_exit(libusb_context *ctx) {
+    (void) ctx;
+    shim_device_save();
+}
+
+SHIM_EXPORT int LIBUSB_CALL libusb_set_option(libusb_context *ctx, enum libusb_option option, ...) {
+    (void) ctx;
+    (void) option;
+    return LIBUSB_SUCCESS;
+}
+
+SHIM_EXPORT const char *LIBUSB_CALL libusb_strerror(int errcode) {
+    switch (errcode) {
+        case LIBUSB_SUCCESS:
+            return "Success (simulated device)";
+        case LIBUSB_ERROR_NO_DEVICE:
+            return "No such device (simulated device)";
+        case LIBUSB_ERROR_PIPE:
+            return "Pipe error (simulated device)";
+        default:
+            return "I/O error (simulated device)";
+    }
+}
+
+SHIM_EXPORT int LIBUSB_CALL libusb_has_capability(uint32_t capability) {
+    return capability == LIBUSB_CAP_HAS_CAPABILITY || capability == LIBUSB_CAP_HAS_HOTPLUG;
+}
+
+SHIM_EXPORT ssize_t LIBUSB_CALL libusb_get_device_list(libusb_context *ctx, libusb_device ***list) {
+    (void) ctx;
+    ShimDevice *d = shim_device_get();
+    ssize_t count = 0;
+    if (shim_device_present(d)) {
+        shim_usb_device.device = d;
+        shim_interface_descriptor.bInterfaceClass =
+                d->connection_type == CONNECTION_CCID ? LIBUSB_CLASS_SMART_CARD : LIBUSB_CLASS_HID;
+        shim_config_descriptor.bNumInterfaces = d->connection_type == CONNECTION_CCID ? 2 : 1;
+        shim_device_list[count++] = &shim_usb_device;
+    }
+    shim_device_list[count] = nullptr;
+    *list = shim_device_list;
+    return count;
+}
+
+SHIM_EXPORT void LIBUSB_CALL libusb_free_device_list(libusb_device **list, int unref_devices) {
+    (void) list;
+    (void) unref_devices;
+}
+
+SHIM_EXPORT libusb_device *LIBUSB_CALL libusb_ref_device(libusb_device *dev) {
+    return dev;
+}
+
+SHIM_EXPORT void LIBUSB_CALL libusb_unref_device(libusb_device *dev) {
+    (void) dev;
+}
+
+SHIM_EXPORT int LIBUSB_CALL libusb_get_device_descriptor(libusb_device *dev, struct libusb_device_descriptor *desc) {
+    if (dev != &shim_usb_device || dev->device == nullptr) {
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+    memset(desc, 0, sizeof *desc);
+    desc->bLength = 18;
+    desc->bDescriptorType = 0x01;
+    desc->bcdUSB = 0x0200;
+    desc->bMaxPacketSize0 = 64;
+    desc->idVendor = dev->device->dev_info.vid;
+    desc->idProduct = dev->device->dev_info.pid;
+    desc->bNumConfigurations = 1;
+    return LIBUSB_SUCCESS;
+}
+
+SHIM_EXPORT int LIBUSB_CALL libusb_get_active_config_descriptor(libusb_device *dev, struct libusb_config_descriptor **config) {
+    if (dev != &shim_usb_device) {
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+    *config = &shim_config_descriptor;
+    return LIBUSB_SUCCESS;
+}
+
+SHIM_EXPORT int LIBUSB_CALL libusb_get_config_descriptor(libusb_device *dev, uint8_t config_index, struct libusb_config_descriptor **config) {
+    if (config_index != 0) {
+        return LIBUSB_ERROR_NOT_FOUND;
+    }
+    return libusb_get_active_config_descriptor(dev, config);
+}
+
+SHIM_EXPORT void LIBUSB_CALL libusb_free_config_descriptor(struct libusb_config_descriptor *config) {
+    (void) config;
+}
+
+SHIM_EXPORT uint8_t LIBUSB_CALL libusb_get_bus_number(libusb_device *dev) {
+    (void) dev;
+    return 1;
+}
+
+SHIM_EXPORT uint8_t LIBUSB_CALL libusb_get_device_address(libusb_device *dev) {
+    (void) dev;
+    return 2;
+}
+
+SHIM_EXPORT uint8_t LIBUSB_CALL libusb_get_port_number(libusb_device *dev) {
+    (void) dev;
+    return 1;
+}
+
+SHIM_EXPORT int LIBUSB_CALL libusb_get_port_numbers(libusb_device *dev, uint8_t *port_numbers, int port_numbers_len) {
+    (void) dev;
+    if (port_numbers_len < 1) {
+        return LIBUSB_ERROR_OVERFLOW;
+    }
+    port_numbers[0] = 1;
+    return 1;
+}
+
+SHIM_EXPORT int LIBUSB_CALL libusb_open(libusb_device *dev, libusb_device_handle **dev_handle) {
+    if (dev != &shim_usb_device || dev->device == nullptr) {
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+    shim_handle.usb_device = dev;
+    *dev_handle = &shim_handle;
+    return LIBUSB_SUCCESS;
+}
+
+SHIM_EXPORT void LIBUSB_CALL libusb_close(libusb_device_handle *dev_handle) {
+    if (dev_handle != &shim_handle) {
+        return;
+    }
+    shim_device_save();
+    shim_handle.usb_device = nullptr;
+}
+
+SHIM_EXPORT libusb_device *LIBUSB_CALL libusb_get_device(libusb_device_handle *dev_handle) {
+    return dev_handle != nullptr ? dev_handle->usb_device : nullptr;
+}
+
+SHIM_EXPORT int LIBUSB_CALL libusb_claim_interface(libusb_device_handle *dev_handle, int interface_number) {
+    const ShimDevice *d = device_of(dev_handle);
+    if (d == nullptr) {
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+    if (d->connection_type == CONNECTION_CCID && interface_number != CTAPHID_INTERFACE_NUMBER && d->ccid_busy) {
+        return LIBUSB_ERROR_BUSY;
+    }
+    return LIBUSB_SUCCESS;
+}
+
+SHIM_EXPORT int LIBUSB_CALL libusb_release_interface(libusb_device_handle *dev_handle, int interface_number) {
+    (void) interface_number;
+    return device_of(dev_handle) != nullptr ? LIBUSB_SUCCESS : LIBUSB_ERROR_NO_DEVICE;
+}
+
+SHIM_EXPORT int LIBUSB_CALL libusb_set_interface_alt_setting(libusb_device_handle *dev_handle, int interface_number, int alternate_setting) {
+    (void) interface_number;
+    (void) alternate_setting;
+    return device_of(dev_handle) != nullptr ? LIBUSB_SUCCESS : LIBUSB_ERROR_NO_DEVICE;
+}
+
+SHIM_EXPORT int LIBUSB_CALL libusb_set_auto_detach_kernel_driver(libusb_device_handle *dev_handle, int enable) {
+    (void) dev_handle;
+    (void) enable;
+    return LIBUSB_SUCCESS;
+}
+
+SHIM_EXPORT int LIBUSB_CALL libusb_kernel_driver_active(libusb_device_handle *dev_handle, int interface_number) {
+    (void) dev_handle;
+    (void) interface_number;
+    return 0;
+}
+
+SHIM_EXPORT int LIBUSB_CALL libusb_detach_kernel_driver(libusb_device_handle *dev_handle, int interface_number) {
+    (void) dev_handle;
+    (void) interface_number;
+    return LIBUSB_SUCCESS;
+}
+
+SHIM_EXPORT int LIBUSB_CALL libusb_attach_kernel_driver(libusb_device_handle *dev_handle, int interface_number) {
+    (void) dev_handle;
+    (void) interface_number;
+    return LIBUSB_SUCCESS;
+}
+
+SHIM_EXPORT int LIBUSB_CALL libusb_control_transfer(libusb_device_handle *dev_handle, uint8_t request_type, uint8_t bRequest,
+                                                    uint16_t wValue, uint16_t wIndex, unsigned char *data, uint16_t wLength,
+                                                    unsigned int timeout) {
+    (void) wIndex;
+    (void) timeout;
+    ShimDevice *d = device_of(dev_handle);
+    if (d == nullptr) {
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+    if (d->connection_type != CONNECTION_HID) {
+        return LIBUSB_ERROR_PIPE;
+    }
+
+    // The emulator works on the reports prefixed with the report ID, as hidapi does
+    uint8_t report[HID_REPORT_SIZE] = {0};
+    report[0] = wValue & 0xFF;
+    if (request_type == HID_REQUEST_TYPE_SET && bRequest == HID_SET_REPORT) {
+        const size_t length = MIN(wLength, sizeof report - 1);
+        memcpy(report + 1, data, length);
+        if (d->peer.on_send(d->peer.ctx, report, length + 1) != RET_NO_ERROR) {
+            return LIBUSB_ERROR_IO;
+        }
+        return (int) length;
+    }
+    if (request_type == HID_REQUEST_TYPE_GET && bRequest == HID_GET_REPORT) {
+        size_t actual_length = 0;
+        if (d->peer.on_receive(d->peer.ctx, report, sizeof report, &actual_length) != RET_NO_ERROR || actual_length < 1) {
+            return LIBUSB_ERROR_IO;
+        }
+        const size_t length = MIN(wLength, actual_length - 1);
+        memcpy(data, report + 1, length);
+        return (int) length;
+    }
+    return LIBUSB_ERROR_PIPE;
+}
+
+SHIM_EXPORT int LIBUSB_CALL libusb_bulk_transfer(libusb_device_handle *dev_handle, unsigned char endpoint, unsigned char *data,
+                                                 int length, int *actual_length, unsigned int timeout) {
+    (void) timeout;
+    ShimDevice *d = device_of(dev_handle);
+    if (d == nullptr) {
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+    if (d->connection_type != CONNECTION_CCID || length < 0) {
+        return LIBUSB_ERROR_PIPE;
+    }
+    int r;
+    size_t transferred = 0;
+    if (endpoint & LIBUSB_ENDPOINT_IN) {
+        r = d->peer.on_receive(d->peer.ctx, data, (size_t) length, &transferred);
+    } else {
+        r = d->peer.on_send(d->peer.ctx, data, (size_t) length);
+        transferred = (size_t) length;
+    }
+    if (r != RET_NO_ERROR) {
+        return LIBUSB_ERROR_IO;
+    }
+    if (actual_length != nullptr) {
+        *actual_length = (int) transferred;
+    }
+    return LIBUSB_SUCCESS;
+}
+
+SHIM_EXPORT int LIBUSB_CALL libusb_interrupt_transfer(libusb_device_handle *dev_handle, unsigned char endpoint, unsigned char *data,
+                                                      int length, int *actual_length, unsigned int timeout) {
+    (void) timeout;
+    ShimDevice *d = device_of(dev_handle);
+    if (d == nullptr) {
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+    if (actual_length != nullptr) {
+        *actual_length = 0;
+    }
+    // Only the CTAPHID interface of the Nitrokey 3 uses the interrupt endpoints
+    if (d->connection_type != CONNECTION_CCID || length < 0) {
+        return LIBUSB_ERROR_TIMEOUT;
+    }
+    if (endpoint & LIBUSB_ENDPOINT_IN) {
+        if (!shim_ctaphid_read(d, data, (size_t) length)) {
+            return LIBUSB_ERROR_TIMEOUT;
+        }
+        length = SHIM_CTAPHID_PACKET_SIZE;
+    } else if (!shim_ctaphid_write(d, data, (size_t) length)) {
+        return LIBUSB_ERROR_IO;
+    }
+    if (actual_length != nullptr) {
+        *actual_length = length;
+    }
+    return LIBUSB_SUCCESS;
+}
+
+SHIM_EXPORT struct libusb_transfer *LIBUSB_CALL libusb_alloc_transfer(int iso_packets) {
+    const size_t size = sizeof(struct libusb_transfer) + (size_t) iso_packets * sizeof(struct libusb_iso_packet_descriptor);
+    return calloc(1, size);
+}
+
+SHIM_EXPORT void LIBUSB_CALL libusb_free_transfer(struct libusb_transfer *transfer) {
+    free(transfer);
+}
+
+SHIM_EXPORT int LIBUSB_CALL libusb_submit_transfer(struct libusb_transfer *transfer) {
+    if (device_of(transfer->dev_handle) == nullptr) {
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+    for (int i = 0; i < SUBMITTED_TRANSFERS_COUNT; ++i) {
+        if (submitted_transfers[i] == transfer) {
+            return LIBUSB_ERROR_BUSY;
+        }
+    }
+    for (int i = 0; i < SUBMITTED_TRANSFERS_COUNT; ++i) {
+        if (submitted_transfers[i] == nullptr) {
+            submitted_transfers[i] = transfer;
+            cancelled_transfers[i] = false;
+            return LIBUSB_SUCCESS;
+        }
+    }
+    return LIBUSB_ERROR_NO_MEM;
+}
+
+SHIM_EXPORT int LIBUSB_CALL libusb_cancel_transfer(struct libusb_transfer *transfer) {
+    for (int i = 0; i < SUBMITTED_TRANSFERS_COUNT; ++i) {
+        if (submitted_transfers[i] == transfer) {
+            cancelled_transfers[i] = true;
+            return LIBUSB_SUCCESS;
+        }
+    }
+    return LIBUSB_ERROR_NOT_FOUND;
+}
+
+static void complete_transfer(int i, enum libusb_transfer_status status, int actual_length) {
+    struct libusb_transfer *transfer = submitted_transfers[i];
+    // The callback may submit the transfer again
+    submitted_transfers[i] = nullptr;
+    transfer->status = status;
+    transfer->actual_length = actual_length;
+    transfer->callback(transfer);
+}
+
+// Complete the transfers able to proceed. Returns true if any of them completed.
+static bool process_transfers(void) {
+    bool progressed = false;
+    for (int i = 0; i < SUBMITTED_TRANSFERS_COUNT; ++i) {
+        struct libusb_transfer *t = submitted_transfers[i];
+        if (t == nullptr) continue;
+        if (cancelled_transfers[i]) {
+            complete_transfer(i, LIBUSB_TRANSFER_CANCELLED, 0);
+            progressed = true;
+            continue;
+        }
+        if (t->endpoint & LIBUSB_ENDPOINT_IN) continue;
+        ShimDevice *d = device_of(t->dev_handle);
+        const bool ok = d != nullptr && d->connection_type == CONNECTION_CCID &&
+                        d->peer.on_send(d->peer.ctx, t->buffer, (size_t) t->length) == RET_NO_ERROR;
+        complete_transfer(i, ok ? LIBUSB_TRANSFER_COMPLETED : LIBUSB_TRANSFER_ERROR, ok ? t->length : 0);
+        progressed = true;
+    }
+    for (int i = 0; i < SUBMITTED_TRANSFERS_COUNT; ++i) {
+        struct libusb_transfer *t = submitted_transfers[i];
+        if (t == nullptr || !(t->endpoint & LIBUSB_ENDPOINT_IN)) continue;
+        ShimDevice *d = device_of(t->dev_handle);
+        if (d == nullptr) {
+            complete_transfer(i, LIBUSB_TRANSFER_NO_DEVICE, 0);
+            return true;
+        }
+        if (d->connection_type != CONNECTION_CCID || !d->ccid.response_pending) continue;
+        size_t received = 0;
+        const bool ok = d->peer.on_receive(d->peer.ctx, t->buffer, (size_t) t->length, &received) == RET_NO_ERROR;
+        complete_transfer(i, ok ? LIBUSB_TRANSFER_COMPLETED : LIBUSB_TRANSFER_ERROR, (int) received);
+        // A single frame per event
+        return true;
+    }
+    return progressed;
+}
+
+// Report the emulated device insertion to the registered hotplug callback, once it is due
+static bool process_hotplug(void) {
+    if (hotplug_callback == nullptr || hotplug_arrival_reported) {
+        return false;
+    }
+    libusb_device **list;
+    if (libusb_get_device_list(&shim_context, &list) == 0) {
+        return false;
+    }
+    hotplug_arrival_reported = true;
+    hotplug_callback(&shim_context, list[0], LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, hotplug_user_data);
+    return true;
+}
+
+SHIM_EXPORT int LIBUSB_CALL libusb_handle_events_timeout_completed(libusb_context *ctx, struct timeval *tv, int *completed) {
+    (void) ctx;
+    if (completed != nullptr && *completed) {
+        return LIBUSB_SUCCESS;
+    }
+    if (process_transfers() || process_hotplug() || tv == nullptr) {
+        return LIBUSB_SUCCESS;
+    }
+    // Nothing will arrive from the emulated device until the next request, or its insertion
+    int64_t wait_us = tv->tv_sec * 1000 * 1000 + tv->tv_usec;
+    const ShimDevice *d = shim_device_get();
+    if (hotplug_callback != nullptr && !hotplug_arrival_reported && d->model != 0) {
+        wait_us = MIN(wait_us, MAX(d->arrival_us - micros(), 0));
+    }
+    usleep((useconds_t) wait_us);
+    process_hotplug();
+    return LIBUSB_SUCCESS;
+}
+
+SHIM_EXPORT int LIBUSB_CALL libusb_hotplug_register_callback(libusb_context *ctx, int events, int flags, int vendor_id,
+                                                             int product_id, int dev_class, libusb_hotplug_callback_fn cb_fn,
+                                                             void *user_data, libusb_hotplug_callback_handle *callback_handle) {
+    (void) ctx;
+    (void) vendor_id;
+    (void) product_id;
+    (void) dev_class;
+    if ((events & LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) == 0) {
+        // removals are never emulated
+        return LIBUSB_SUCCESS;
+    }
+    hotplug_callback = cb_fn;
+    hotplug_user_data = user_data;
+    hotplug_arrival_reported = false;
+    if (callback_handle != nullptr) {
+        *callback_handle = 1;
+    }
+    libusb_device **list;
+    if (libusb_get_device_list(&shim_context, &list) > 0) {
+        // present at registration - reported only with LIBUSB_HOTPLUG_ENUMERATE
+        hotplug_arrival_reported = true;
+        if (flags & LIBUSB_HOTPLUG_ENUMERATE) {
+            cb_fn(&shim_context, list[0], LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, user_data);
+        }
+    }
+    return LIBUSB_SUCCESS;
+}
+
+SHIM_EXPORT void LIBUSB_CALL libusb_hotplug_deregister_callback(libusb_context *ctx, libusb_hotplug_callback_handle callback_handle) {
+    (void) ctx;
+    (void) callback_handle;
+    hotplug_callback = nullptr;
+    hotplug_user_data = nullptr;
+}
+
+SHIM_EXPORT int LIBUSB_CALL libusb_handle_events_completed(libusb_context *ctx, int *completed) {
+    struct timeval tv = {.tv_sec = 1};
+    return libusb_handle_events_timeout_completed(ctx, &tv, completed);
+}
@@ -0,0 +1,263 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "base32_decoder.h"
+#include "return_codes.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#define BASE32_SIMD_X86
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define BASE32_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+// Lookup table entries: a data character carries its 5-bit value, the padding character only its flag
+#define B32_DATA 0x40
+#define B32_PAD 0x80
+#define B32(c, v) [(unsigned char) (c)] = B32_DATA | (v)
+
+static const uint8_t BASE32_TABLE[256] = {
+        B32('A', 0), B32('B', 1), B32('C', 2), B32('D', 3), B32('E', 4), B32('F', 5), B32('G', 6), B32('H', 7),
+        B32('I', 8), B32('J', 9), B32('K', 10), B32('L', 11), B32('M', 12), B32('N', 13), B32('O', 14), B32('P', 15),
+        B32('Q', 16), B32('R', 17), B32('S', 18), B32('T', 19), B32('U', 20), B32('V', 21), B32('W', 22), B32('X', 23),
+        B32('Y', 24), B32('Z', 25), B32('2', 26), B32('3', 27), B32('4', 28), B32('5', 29), B32('6', 30), B32('7', 31),
+        ['='] = B32_PAD,
+};
+
+// Writes the low 40 bits of group, most significant byte first
+static void store_group(uint8_t *plain, uint64_t group) {
+    for (int i = 4; i >= 0; i--) {
+        plain[i] = (uint8_t) group;
+        group >>= 8;
+    }
+}
+
+/*
+ * The SIMD kernels decode whole chunks of 16 (or 32) data characters, and stop at the first chunk holding anything
+ * else, leaving it to the scalar loop. The characters are mapped to their values with range compares, then the
+ * neighbouring values are merged in 16-, 32- and 64-bit lanes into 10-, 20- and 40-bit groups.
+ * Each kernel returns the number of characters consumed, always a multiple of 8.
+ */
+typedef size_t (*Base32Kernel)(const char *coded, size_t length, uint8_t *plain);
+
+#ifdef BASE32_SIMD_X86
+
+static size_t decode_sse2(const char *coded, size_t length, uint8_t *plain) {
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16, plain += 10) {
+        const __m128i c = _mm_loadu_si128((const __m128i *) (coded + i));
+        const __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('A' - 1)),
+                                            _mm_cmpgt_epi8(_mm_set1_epi8('Z' + 1), c));
+        const __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('2' - 1)),
+                                            _mm_cmpgt_epi8(_mm_set1_epi8('7' + 1), c));
+        if (_mm_movemask_epi8(_mm_or_si128(upper, digit)) != 0xFFFF) {
+            break;
+        }
+        const __m128i offset = _mm_or_si128(_mm_and_si128(upper, _mm_set1_epi8('A')),
+                                            _mm_and_si128(digit, _mm_set1_epi8('2' - 26)));
+        const __m128i v = _mm_sub_epi8(c, offset);
+        const __m128i v10 = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi16(0x00FF)), 5),
+                                         _mm_srli_epi16(v, 8));
+        const __m128i v20 = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(v10, _mm_set1_epi32(0xFFFF)), 10),
+                                         _mm_srli_epi32(v10, 16));
+        const __m128i v40 = _mm_or_si128(_mm_slli_epi64(_mm_and_si128(v20, _mm_set1_epi64x(0xFFFFFFFF)), 20),
+                                         _mm_srli_epi64(v20, 32));
+        uint64_t groups[2];
+        _mm_storeu_si128((__m128i *) groups, v40);
+        store_group(plain, groups[0]);
+        store_group(plain + 5, groups[1]);
+    }
+    return i;
+}
+
+__attribute__((target("avx2"))) static size_t decode_avx2(const char *coded, size_t length, uint8_t *plain) {
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32, plain += 20) {
+        const __m256i c = _mm256_loadu_si256((const __m256i *) (coded + i));
+        const __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('A' - 1)),
+                                               _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), c));
+        const __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('2' - 1)),
+                                               _mm256_cmpgt_epi8(_mm256_set1_epi8('7' + 1), c));
+        if ((uint32_t) _mm256_movemask_epi8(_mm256_or_si256(upper, digit)) != 0xFFFFFFFF) {
+            break;
+        }
+        const __m256i offset = _mm256_or_si256(_mm256_and_si256(upper, _mm256_set1_epi8('A')),
+                                               _mm256_and_si256(digit, _mm256_set1_epi8('2' - 26)));
+        const __m256i v = _mm256_sub_epi8(c, offset);
+        const __m256i v10 = _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(v, _mm256_set1_epi16(0x00FF)), 5),
+                                            _mm256_srli_epi16(v, 8));
+        const __m256i v20 = _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(v10, _mm256_set1_epi32(0xFFFF)), 10),
+                                            _mm256_srli_epi32(v10, 16));
+        const __m256i v40 = _mm256_or_si256(
+                _mm256_slli_epi64(_mm256_and_si256(v20, _mm256_set1_epi64x(0xFFFFFFFF)), 20),
+                _mm256_srli_epi64(v20, 32));
+        uint64_t groups[4];
+        _mm256_storeu_si256((__m256i *) groups, v40);
+        for (int g = 0; g < 4; g++) {
+            store_group(plain + 5 * g, groups[g]);
+        }
+    }
+    return i + decode_sse2(coded + i, length - i, plain);
+}
+
+static Base32Kernel select_kernel(const char **name) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        *name = "avx2";
+        return decode_avx2;
+    }
+    *name = "sse2";
+    return decode_sse2;
+}
+
+#elif defined(BASE32_SIMD_NEON)
+
+static size_t decode_neon(const char *coded, size_t length, uint8_t *plain) {
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16, plain += 10) {
+        const uint8x16_t c = vld1q_u8((const uint8_t *) (coded + i));
+        const uint8x16_t upper = vandq_u8(vcgeq_u8(c, vdupq_n_u8('A')), vcleq_u8(c, vdupq_n_u8('Z')));
+        const uint8x16_t digit = vandq_u8(vcgeq_u8(c, vdupq_n_u8('2')), vcleq_u8(c, vdupq_n_u8('7')));
+        if (vminvq_u8(vorrq_u8(upper, digit)) != 0xFF) {
+            break;
+        }
+        const uint8x16_t offset = vorrq_u8(vandq_u8(upper, vdupq_n_u8('A')), vandq_u8(digit, vdupq_n_u8('2' - 26)));
+        const uint16x8_t v = vreinterpretq_u16_u8(vsubq_u8(c, offset));
+        const uint32x4_t v10 = vreinterpretq_u32_u16(
+                vorrq_u16(vshlq_n_u16(vandq_u16(v, vdupq_n_u16(0x00FF)), 5), vshrq_n_u16(v, 8)));
+        const uint64x2_t v20 = vreinterpretq_u64_u32(
+                vorrq_u32(vshlq_n_u32(vandq_u32(v10, vdupq_n_u32(0xFFFF)), 10), vshrq_n_u32(v10, 16)));
+        const uint64x2_t v40 = vorrq_u64(vshlq_n_u64(vandq_u64(v20, vdupq_n_u64(0xFFFFFFFF)), 20),
+                                         vshrq_n_u64(v20, 32));
+        store_group(plain, vgetq_lane_u64(v40, 0));
+        store_group(plain + 5, vgetq_lane_u64(v40, 1));
+    }
+    return i;
+}
+
+static Base32Kernel select_kernel(const char **name) {
+    *name = "neon";
+    return decode_neon;
+}
+
+#else
+
+static Base32Kernel select_kernel(const char **name) {
+    *name = "scalar";
+    return NULL;
+}
+
+#endif
+
+static const char *kernel_name = NULL;
+static Base32Kernel kernel = NULL;
+
+static Base32Kernel get_kernel(void) {
+    if (kernel_name == NULL) {
+        const char *name;
+        kernel = select_kernel(&name);
+        kernel_name = name;
+    }
+    return kernel;
+}
+
+const char *base32_decoder_implementation(void) {
+    get_kernel();
+    return kernel_name;
+}
+
+/*
+ * Continues the decoding at position i, a multiple of 8, with out bytes written so far.
+ * Data characters are accepted up to data_limit, the count which still fits into the output.
+ */
+static int decode_from(const char *coded, size_t coded_length, size_t data_limit, size_t i, uint8_t *plain,
+                       size_t out, size_t *decoded_length, size_t *error_position) {
+    // Whole groups of 8 data characters
+    for (; i + 8 <= data_limit; i += 8, out += 5) {
+        uint64_t group = 0;
+        uint8_t flags = B32_DATA;
+        for (int k = 0; k < 8; k++) {
+            const uint8_t entry = BASE32_TABLE[(unsigned char) coded[i + k]];
+            flags &= entry;
+            group = (group << 5) | (entry & 0x1F);
+        }
+        if (flags == 0) {
+            break;
+        }
+        store_group(plain + out, group);
+    }
+
+    // The last incomplete group
+    uint32_t bits = 0;
+    int bit_count = 0;
+    for (; i < coded_length; i++) {
+        const uint8_t entry = BASE32_TABLE[(unsigned char) coded[i]];
+        if (!(entry & B32_DATA) || i >= data_limit) {
+            break;
+        }
+        bits = (bits << 5) | (entry & 0x1F);
+        bit_count += 5;
+        if (bit_count >= 8) {
+            bit_count -= 8;
+            plain[out++] = (uint8_t) (bits >> bit_count);
+        }
+    }
+
+    // Only the padding may follow
+    while (i < coded_length && coded[i] == '=') {
+        i++;
+    }
+    if (decoded_length != NULL) {
+        *decoded_length = out;
+    }
+    if (i < coded_length) {
+        if (error_position != NULL) {
+            *error_position = i;
+        }
+        return RET_BADLY_FORMATTED_BASE32_STRING;
+    }
+    return RET_NO_ERROR;
+}
+
+static size_t get_data_limit(size_t coded_length, size_t plain_size) {
+    const size_t fitting = (8 * plain_size + 7) / 5;
+    return fitting < coded_length ? fitting : coded_length;
+}
+
+int base32_decode_checked_scalar(const char *coded, size_t coded_length, uint8_t *plain, size_t plain_size,
+                                 size_t *decoded_length, size_t *error_position) {
+    const size_t data_limit = get_data_limit(coded_length, plain_size);
+    return decode_from(coded, coded_length, data_limit, 0, plain, 0, decoded_length, error_position);
+}
+
+int base32_decode_checked(const char *coded, size_t coded_length, uint8_t *plain, size_t plain_size,
+                          size_t *decoded_length, size_t *error_position) {
+    const size_t data_limit = get_data_limit(coded_length, plain_size);
+    const Base32Kernel simd = get_kernel();
+    const size_t consumed = simd != NULL ? simd(coded, data_limit, plain) : 0;
+    return decode_from(coded, coded_length, data_limit, consumed, plain, consumed / 8 * 5, decoded_length,
+                       error_position);
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#ifndef NITROKEY_HOTP_VERIFICATION_BASE32_DECODER_H
+#define NITROKEY_HOTP_VERIFICATION_BASE32_DECODER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Validates and decodes coded_length characters of base32 (RFC4648 alphabet: A-Z and 2-7) in a single pass.
+ * The data may be followed by '=' padding, up to the end. floor(5 * data characters / 8) bytes are written to plain,
+ * the bits of an incomplete last byte are dropped, as in base32_decode.
+ * Returns RET_NO_ERROR, or RET_BADLY_FORMATTED_BASE32_STRING with error_position set to the first character, which is
+ * either not valid in its place, or does not fit into plain_size bytes. decoded_length and error_position may be NULL.
+ * Long input is processed with SSE2/AVX2 or NEON, when available.
+ */
+int base32_decode_checked(const char *coded, size_t coded_length, uint8_t *plain, size_t plain_size,
+                          size_t *decoded_length, size_t *error_position);
+// The same with the lookup table only, kept for the tests
+int base32_decode_checked_scalar(const char *coded, size_t coded_length, uint8_t *plain, size_t plain_size,
+                                 size_t *decoded_length, size_t *error_position);
+const char *base32_decoder_implementation(void);
+
+#endif//NITROKEY_HOTP_VERIFICATION_BASE32_DECODER_H
@@ -25,7 +25,9 @@
 #include "return_codes.h"
 #include "settings.h"
 #include "tlv.h"
+#include "usb_context.h"
 #include "utils.h"
+#include <endian.h>
 #include <libusb.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -40,58 +42,126 @@ static const int WRITE_ENDPOINT = 0x01;
 
 static const int TIMEOUT = 2 * 1000;
 
+// Count of the frames with not matching sequence number, to drop before failing the receive call
+static const int MAX_STALE_FRAMES = 8;
 
-uint32_t icc_compose(uint8_t *buf, uint32_t buffer_length, uint8_t msg_type, size_t data_len, uint8_t slot, uint8_t seq, uint16_t param, uint8_t *data) {
-    static int _seq = 0;
-    if (seq == 0) {
-        seq = _seq++;
-    }
+// Delay between the receive attempts, while the device reports the time extension (e.g. waits for touch)
+static const uint32_t TIME_EXTENSION_FIRST_DELAY_MS = 5;
+static const uint32_t TIME_EXTENSION_MAX_DELAY_MS = 100;
 
-    size_t i = 0;
-    buf[i++] = msg_type;
 
-    rassert(data_len < INT32_MAX);
-    int32_t _data_len = (int32_t) data_len;
-    buf[i++] = _data_len << 0;
-    buf[i++] = _data_len << 8;
-    buf[i++] = _data_len << 16;
-    buf[i++] = _data_len << 24;
+// PC_to_RDR_XfrBlock message type
+#define ICC_XFR_BLOCK (0x6F)
+// Secrets App AID
+static const uint8_t SECRETS_APP_AID[] = {0xa0, 0x00, 0x00, 0x05, 0x27, 0x21, 0x01};
 
-    buf[i++] = slot;
-    buf[i++] = seq;
-    buf[i++] = 0;
-    buf[i++] = param << 0;
-    buf[i++] = param << 8;
-    const size_t final_data_length = min(data_len, buffer_length - i);
-    memmove(buf + i, data, final_data_length);
-    i += final_data_length;
-    return i;
+void frame_begin(FrameWriter *writer, uint8_t *buf, size_t buf_size, uint8_t cls, uint8_t ins, uint8_t p1,
+                 uint8_t p2, bool extended) {
+    writer->buf = buf;
+    writer->size = buf_size;
+    writer->extended = extended;
+    writer->overflow = buf_size < ICC_HEADER_SIZE + APDU_HEADER_SIZE + 3;
+    if (writer->overflow) {
+        writer->length = 0;
+        return;
+    }
+    memset(buf, 0, ICC_HEADER_SIZE);
+    buf[0] = ICC_XFR_BLOCK;
+    uint8_t *apdu = buf + ICC_HEADER_SIZE;
+    apdu[0] = cls;
+    apdu[1] = ins;
+    apdu[2] = p1;
+    apdu[3] = p2;
+    // room for Lc, written at the end
+    writer->data_start = ICC_HEADER_SIZE + APDU_HEADER_SIZE + (extended ? 3 : 1);
+    writer->length = writer->data_start;
+}
+
+uint8_t *frame_reserve(FrameWriter *writer, size_t length) {
+    if (writer->overflow || length > writer->size - writer->length) {
+        writer->overflow = true;
+        return NULL;
+    }
+    uint8_t *reserved = writer->buf + writer->length;
+    writer->length += length;
+    return reserved;
 }
 
+void frame_append(FrameWriter *writer, const uint8_t *data, size_t length) {
+    uint8_t *reserved = frame_reserve(writer, length);
+    if (reserved != NULL) {
+        memcpy(reserved, data, length);
+    }
+}
 
-uint32_t iso7816_compose(uint8_t *buf, uint32_t buffer_length, uint8_t ins, uint8_t p1, uint8_t p2, uint8_t cls, uint8_t le, uint8_t *data, uint8_t data_len) {
-    size_t i = 0;
-    buf[i++] = cls;
-    buf[i++] = ins;
-    buf[i++] = p1;
-    buf[i++] = p2;
-    if (data != NULL && data_len != 0) {
-        buf[i++] = data_len;
-        const size_t data_length = min(data_len, buffer_length - i - 1);
-        memmove(buf + i, data, data_length);
-        i += data_length;
+void frame_append_tlvs(FrameWriter *writer, const TLV tlvs[], int tlvs_count) {
+    for (int i = 0; i < tlvs_count; ++i) {
+        uint8_t *reserved = frame_reserve(writer, tlv_encoded_length(&tlvs[i]));
+        if (reserved == NULL) {
+            return;
+        }
+        process_TLV(reserved, &tlvs[i]);
+    }
+}
+
+uint32_t frame_finish(FrameWriter *writer, uint32_t le) {
+    if (writer->overflow) {
+        return 0;
+    }
+    const size_t data_length = writer->length - writer->data_start;
+    uint8_t *apdu_end = writer->buf + ICC_HEADER_SIZE + APDU_HEADER_SIZE;
+    if (data_length > (writer->extended ? 0xFFFF : 0xFF) || le > (writer->extended ? 0x10000 : 0x100)) {
+        writer->overflow = true;
+        return 0;
+    }
+    if (data_length == 0) {
+        // no data, no Lc
+        writer->length = ICC_HEADER_SIZE + APDU_HEADER_SIZE;
+    } else if (writer->extended) {
+        apdu_end[0] = 0;
+        apdu_end[1] = (uint8_t) (data_length >> 8);
+        apdu_end[2] = (uint8_t) data_length;
+    } else {
+        apdu_end[0] = (uint8_t) data_length;
     }
     if (le != 0) {
-        buf[i++] = le;
+        // the maximum length is encoded as zeros
+        if (!writer->extended) {
+            frame_append(writer, (const uint8_t[]){(uint8_t) le}, 1);
+        } else if (data_length == 0) {
+            frame_append(writer, (const uint8_t[]){0, (uint8_t) (le >> 8), (uint8_t) le}, 3);
+        } else {
+            frame_append(writer, (const uint8_t[]){(uint8_t) (le >> 8), (uint8_t) le}, 2);
+        }
+        if (writer->overflow) {
+            return 0;
+        }
     }
-    return i;
+    const uint32_t apdu_length = (uint32_t) (writer->length - ICC_HEADER_SIZE);
+    // dwLength, little endian
+    writer->buf[1] = (uint8_t) apdu_length;
+    writer->buf[2] = (uint8_t) (apdu_length >> 8);
+    writer->buf[3] = (uint8_t) (apdu_length >> 16);
+    writer->buf[4] = (uint8_t) (apdu_length >> 24);
+    return (uint32_t) writer->length;
 }
 
+uint32_t compose_select(uint8_t *buf, size_t buf_size) {
+    FrameWriter writer;
+    frame_begin(&writer, buf, buf_size, 0, Ins_Select, 0x04, 0, false);
+    frame_append(&writer, SECRETS_APP_AID, sizeof SECRETS_APP_AID);
+    return frame_finish(&writer, 0);
+}
 
 IccResult parse_icc_result(uint8_t *buf, size_t buf_len) {
     rassert(buf_len >= 10);
-    unused(buf_len);
-    const uint8_t data_len = buf[1] | (buf[2] << 8) | (buf[3] << 16) | (buf[4] << 24);
+    uint32_t data_len = (uint32_t) buf[1] | ((uint32_t) buf[2] << 8) | ((uint32_t) buf[3] << 16) |
+                        ((uint32_t) buf[4] << 24);
+    if (data_len > buf_len - 10) {
+        // Make sure the response do not contain overread attempts
+        LOG("Declared data length %u exceeds the received %zu bytes\n", data_len, buf_len - 10);
+        data_len = (uint32_t) (buf_len - 10);
+    }
     // take last 2 bytes as the status code, if there is any data returned
     const uint16_t data_status_code = (data_len >= 2) ? be16toh(*(uint16_t *) &buf[10 + data_len - 2]) : 0;
     const IccResult i = {
@@ -103,11 +173,34 @@ IccResult parse_icc_result(uint8_t *buf, size_t buf_len) {
             //            .buffer = buf,
             //            .buffer_len = buf_len
     };
-    // Make sure the response do not contain overread attempts
-    rassert(i.data_len < buf_len - 10);
     return i;
 }
 
+int icc_unwrap_apdu(const uint8_t *frame, size_t frame_length, const uint8_t **apdu, size_t *apdu_length) {
+    if (frame_length < ICC_HEADER_SIZE || frame[0] != 0x6F) {
+        return RET_COMM_ERROR;
+    }
+    const uint32_t length = (uint32_t) frame[1] | ((uint32_t) frame[2] << 8) | ((uint32_t) frame[3] << 16) |
+                            ((uint32_t) frame[4] << 24);
+    if (length > frame_length - ICC_HEADER_SIZE) {
+        return RET_COMM_ERROR;
+    }
+    *apdu = frame + ICC_HEADER_SIZE;
+    *apdu_length = length;
+    return RET_NO_ERROR;
+}
+
+void icc_write_data_block_header(uint8_t *frame, uint32_t data_length, uint8_t seq, uint8_t status) {
+    memset(frame, 0, ICC_HEADER_SIZE);
+    frame[0] = 0x80;
+    frame[1] = data_length & 0xFF;
+    frame[2] = (data_length >> 8) & 0xFF;
+    frame[3] = (data_length >> 16) & 0xFF;
+    frame[4] = (data_length >> 24) & 0xFF;
+    frame[ICC_SEQ_OFFSET] = seq;
+    frame[7] = status;
+}
+
 libusb_device_handle *get_device(libusb_context *ctx, const struct VidPid pPid[], int devices_count) {
     int r;
     libusb_device **devs;
@@ -143,42 +236,120 @@ libusb_device_handle *get_device(libusb_context *ctx, const struct VidPid pPid[]
         return NULL;
     }
 
-    r = libusb_claim_interface(handle, 0);
+    if (ccid_claim_device(handle) != RET_NO_ERROR) {
+        return NULL;
+    }
+    return handle;
+}
+
+int ccid_claim_device(libusb_device_handle *handle) {
+    int r = libusb_claim_interface(handle, 0);
     if (r < 0) {
+#ifdef FEATURE_USE_CTAPHID
+        // not an error yet, the CTAPHID interface is tried next
+        LOG("Error claiming interface: %s\n", libusb_strerror(r));
+#else
         printf("Error claiming interface: %s\n", libusb_strerror(r));
-        return NULL;
+#endif
+        return RET_COMM_ERROR;
     }
 
     LOG("set alt interface\n");
     r = libusb_set_interface_alt_setting(handle, 0, 0);
     if (r < 0) {
         printf("Error set alt interface: %s\n", libusb_strerror(r));
-        return NULL;
+        return RET_COMM_ERROR;
     }
+    return RET_NO_ERROR;
+}
 
-    return handle;
+int ccid_open_usb(struct Device *dev) {
+    if (dev->mp_devhandle_usb != NULL) {
+        // Already opened and claimed by the device discovery
+        dev->connection_type = CONNECTION_CCID;
+        return RET_NO_ERROR;
+    }
+    dev->ctx_usb = usb_context_get();
+    if (dev->ctx_usb == NULL) {
+        return RET_COMM_ERROR;
+    }
+    dev->mp_devhandle_usb = get_device(dev->ctx_usb, devices_ccid, devices_ccid_size);
+    if (dev->mp_devhandle_usb == NULL) {
+        dev->ctx_usb = NULL;
+        return RET_COMM_ERROR;
+    }
+    dev->dev_info = devices_ccid[0];
+    dev->connection_type = CONNECTION_CCID;
+    return RET_NO_ERROR;
 }
 
 
-int ccid_process_single(libusb_device_handle *handle, uint8_t *receiving_buffer, uint32_t receiving_buffer_length, const uint8_t *sending_buffer,
+static int ccid_receive_response(struct Device *dev, uint8_t *receiving_buffer, uint32_t receiving_buffer_length,
+                                 IccResult *result);
+
+int ccid_process_single(struct Device *dev, uint8_t *receiving_buffer, uint32_t receiving_buffer_length, uint8_t *sending_buffer,
                         const uint32_t sending_buffer_length, IccResult *result) {
-    rassert(handle != NULL);
-    int actual_length = 0, r;
+    rassert(dev != NULL);
+    rassert(dev->transport != NULL);
+    int r = ccid_send(dev, sending_buffer, sending_buffer_length);
+    if (r != 0) {
+        return r;
+    }
+    return ccid_receive_response(dev, receiving_buffer, receiving_buffer_length, result);
+}
+
+int ccid_prepare_command(PreparedCommand *command, TLV tlvs[], int tlvs_count, int ins, uint8_t patched_tag) {
+    rassert(command != NULL);
+    FrameWriter writer;
+    frame_begin(&writer, command->frame, sizeof command->frame, 0, (uint8_t) ins, 0, 0, false);
+    frame_append_tlvs(&writer, tlvs, tlvs_count);
+    const uint32_t length = frame_finish(&writer, 0);
+    check_ret(length == 0, RET_INVALID_PARAMS);
+
+    TLV patched = {};
+    int r = get_tlv(command->frame + writer.data_start, length - writer.data_start, patched_tag, &patched);
+    check_ret(r != RET_NO_ERROR || patched.length != sizeof(uint32_t), RET_INVALID_PARAMS);
+
+    command->length = length;
+    command->value_offset = (uint32_t) (patched.v_data - command->frame);
+    return RET_NO_ERROR;
+}
 
-    r = ccid_send(handle, &actual_length, sending_buffer, sending_buffer_length);
+int ccid_execute_prepared(struct Device *dev, PreparedCommand *command, uint32_t value, IccResult *result) {
+    rassert(dev != NULL);
+    rassert(dev->transport != NULL);
+    rassert(command->length != 0);
+    const uint32_t value_be = htobe32(value);
+    memcpy(command->frame + command->value_offset, &value_be, sizeof value_be);
+    int r = ccid_send(dev, command->frame, command->length);
     if (r != 0) {
         return r;
     }
+    return ccid_receive_response(dev, dev->ccid_buffer_in, sizeof dev->ccid_buffer_in, result);
+}
 
+// Receive the response to the sent frame, waiting through the time extensions and the chained parts
+static int ccid_receive_response(struct Device *dev, uint8_t *receiving_buffer, uint32_t receiving_buffer_length,
+                                 IccResult *result) {
+    int actual_length = 0, r;
+    const int64_t start = micros();
+    uint32_t time_extension_delay_ms = 0;
     int prev_status = 0;
     while (true) {
-        usleep(10 * 1000);
-        r = ccid_receive(handle, &actual_length, receiving_buffer, receiving_buffer_length);
+        // Bulk IN blocks until the reader has the response, so wait only between the time extension frames
+        if (time_extension_delay_ms > 0) {
+            device_yield(dev);
+            const int64_t poll_start = micros();
+            dev->transport->poll(dev, time_extension_delay_ms);
+            dev->timings.poll_wait_us += micros() - poll_start;
+        }
+        dev->timings.probes++;
+        r = ccid_receive(dev, &actual_length, receiving_buffer, receiving_buffer_length);
         if (r != 0) {
             return r;
         }
 
-        IccResult iccResult = parse_icc_result(receiving_buffer, receiving_buffer_length);
+        IccResult iccResult = parse_icc_result(receiving_buffer, (size_t) actual_length);
         LOG("status %d, chain %d\n", iccResult.status, iccResult.chain);
         if (iccResult.data_len > 0) {
             print_buffer(iccResult.data, iccResult.data_len, "    returned data");
@@ -187,26 +358,23 @@ int ccid_process_single(libusb_device_handle *handle, uint8_t *receiving_buffer,
         if (iccResult.data[0] == DATA_REMAINING_STATUS_CODE) {
             // 0x61 status code means data remaining, make another receive call
 
-            uint8_t buf_sr[SMALL_CCID_BUFFER_SIZE] = {};
-            uint32_t send_rem_length = iso7816_compose(buf_sr, sizeof buf_sr,
-                                                       Ins_GetResponse, 0, 0, 0, 0xFF, NULL, 0);
-            uint8_t buf_sr_2[SMALL_CCID_BUFFER_SIZE] = {};
-            uint32_t send_rem_icc_len = icc_compose(buf_sr_2, sizeof buf_sr_2,
-                                                    0x6F, send_rem_length,
-                                                    0, 0, 0, buf_sr);
+            uint8_t buf_sr[ICC_HEADER_SIZE + APDU_HEADER_SIZE + 3];
+            FrameWriter writer;
+            frame_begin(&writer, buf_sr, sizeof buf_sr, 0, Ins_GetResponse, 0, 0, false);
+            const uint32_t send_rem_icc_len = frame_finish(&writer, 0xFF);
             int actual_length_sr = 0;
-            r = ccid_send(handle, &actual_length_sr, buf_sr_2, send_rem_icc_len);
+            r = ccid_send(dev, buf_sr, send_rem_icc_len);
             if (r != 0) {
                 return r;
             }
 
             memset(receiving_buffer, 0, receiving_buffer_length);
-            r = ccid_receive(handle, &actual_length_sr, receiving_buffer, receiving_buffer_length);
+            r = ccid_receive(dev, &actual_length_sr, receiving_buffer, receiving_buffer_length);
             if (r != 0) {
                 return r;
             }
 
-            iccResult = parse_icc_result(receiving_buffer, receiving_buffer_length);
+            iccResult = parse_icc_result(receiving_buffer, (size_t) actual_length_sr);
             LOG("status %d, chain %d\n", iccResult.status, iccResult.chain);
             if (iccResult.data_len > 0) {
                 print_buffer(iccResult.data, iccResult.data_len, "    returned data");
@@ -214,6 +382,9 @@ int ccid_process_single(libusb_device_handle *handle, uint8_t *receiving_buffer,
             }
         }
         if (iccResult.status == AWAITING_FOR_TOUCH_STATUS_CODE) {
+            dev->timings.time_extensions++;
+            time_extension_delay_ms = time_extension_delay_ms == 0 ? TIME_EXTENSION_FIRST_DELAY_MS
+                                                                   : MIN(time_extension_delay_ms * 2, TIME_EXTENSION_MAX_DELAY_MS);
             if (prev_status != iccResult.status) {
                 printf("Please touch the USB security key if it blinks ");
                 fflush(stdout);
@@ -230,10 +401,13 @@ int ccid_process_single(libusb_device_handle *handle, uint8_t *receiving_buffer,
             }
         }
         prev_status = iccResult.status;
+        time_extension_delay_ms = 0;
         if (iccResult.chain == 0 || iccResult.chain == 2) {
             if (result != NULL) {
                 memmove(result, &iccResult, sizeof iccResult);
             }
+            dev->timings.responses++;
+            dev->timings.response_wait_us += micros() - start;
             break;
         }
         switch (iccResult.chain) {
@@ -248,7 +422,7 @@ int ccid_process_single(libusb_device_handle *handle, uint8_t *receiving_buffer,
     return 0;
 }
 
-int ccid_process(libusb_device_handle *handle, uint8_t *buf, uint32_t buf_length, const uint8_t **data_to_send,
+int ccid_process(struct Device *dev, uint8_t *buf, uint32_t buf_length, uint8_t **data_to_send,
                  int data_to_send_count, const uint32_t *data_to_send_sizes, bool continue_on_errors,
                  IccResult *result) {
     int r;
@@ -256,10 +430,10 @@ int ccid_process(libusb_device_handle *handle, uint8_t *buf, uint32_t buf_length
     rassert(buf_length >= 270);
 
     for (int i = 0; i < data_to_send_count; ++i) {
-        const unsigned char *d = data_to_send[i];
+        unsigned char *d = data_to_send[i];
         const int length = (int) data_to_send_sizes[i];
 
-        r = ccid_process_single(handle, buf, buf_length, d, length, result);
+        r = ccid_process_single(dev, buf, buf_length, d, length, result);
         if (r != 0) {
             if (continue_on_errors) {
                 // ignore error, continue with sending the next record
@@ -273,34 +447,12 @@ int ccid_process(libusb_device_handle *handle, uint8_t *buf, uint32_t buf_length
     return 0;
 }
 
-int send_select_ccid(libusb_device_handle *handle, uint8_t buf[], size_t buf_size, IccResult *iccResult) {
-    unsigned char cmd_select[] = {
-            0x6f,
-            0x0c,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0xa4,
-            0x04,
-            0x00,
-            0x07,
-            0xa0,
-            0x00,
-            0x00,
-            0x05,
-            0x27,
-            0x21,
-            0x01,
-    };
+int send_select_ccid(struct Device *dev, uint8_t buf[], size_t buf_size, IccResult *iccResult) {
+    uint8_t cmd_select[ICC_HEADER_SIZE + APDU_HEADER_SIZE + 1 + sizeof SECRETS_APP_AID];
+    const uint32_t cmd_select_length = compose_select(cmd_select, sizeof cmd_select);
 
     check_ret(
-            ccid_process_single(handle, buf, buf_size, cmd_select, sizeof cmd_select, iccResult),
+            ccid_process_single(dev, buf, buf_size, cmd_select, cmd_select_length, iccResult),
             RET_COMM_ERROR);
 
 
@@ -308,69 +460,40 @@ int send_select_ccid(libusb_device_handle *handle, uint8_t buf[], size_t buf_siz
 }
 
 
-int ccid_init(libusb_device_handle *handle) {
-
-    unsigned char cmd_select[] = {
-            0x6f,
-            0x0c,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0xa4,
-            0x04,
-            0x00,
-            0x07,
-            0xa0,
-            0x00,
-            0x00,
-            0x05,
-            0x27,
-            0x21,
-            0x01,
-    };
-
+int ccid_init(struct Device *dev) {
+    uint8_t cmd_select[ICC_HEADER_SIZE + APDU_HEADER_SIZE + 1 + sizeof SECRETS_APP_AID];
+    const uint32_t cmd_select_length = compose_select(cmd_select, sizeof cmd_select);
 
-    const unsigned char *data_to_send[] = {
+    unsigned char *data_to_send[] = {
             cmd_select,
             cmd_select,
     };
 
     const unsigned int data_to_send_size[] = {
-            sizeof(cmd_select),
-            sizeof(cmd_select),
+            cmd_select_length,
+            cmd_select_length,
     };
 
     unsigned char buf[MAX_CCID_BUFFER_SIZE] = {};
-    ccid_process(handle, buf, sizeof buf, data_to_send, LEN_ARR(data_to_send), data_to_send_size, true, NULL);
+    ccid_process(dev, buf, sizeof buf, data_to_send, LEN_ARR(data_to_send), data_to_send_size, true, NULL);
     return 0;
 }
 
-uint32_t icc_pack_tlvs_for_sending(uint8_t *buf, size_t buflen, TLV *tlvs, int tlvs_count, int ins) {
-    uint8_t data_tlvs[MAX_CCID_BUFFER_SIZE] = {};
-    int tlvs_actual_length = process_all(data_tlvs, tlvs, tlvs_count);
-
-    // encode instruction
-    uint8_t data_iso[MAX_CCID_BUFFER_SIZE] = {};
-    uint32_t iso_actual_length = iso7816_compose(
-            data_iso, sizeof data_iso,
-            ins, 0, 0, 0, 0, data_tlvs, tlvs_actual_length);
-
-    // encode ccid wrapper
-    uint32_t icc_actual_length = icc_compose(buf, buflen,
-                                             0x6F, iso_actual_length,
-                                             0, 0, 0, data_iso);
-
-
-    return icc_actual_length;
+int icc_pack_tlvs_for_sending(uint8_t *buf, size_t buflen, TLV *tlvs, int tlvs_count, int ins, uint32_t *length) {
+    rassert(length != NULL);
+    size_t tlvs_length = 0;
+    for (int i = 0; i < tlvs_count; ++i) {
+        tlvs_length += tlv_encoded_length(&tlvs[i]);
+    }
+    FrameWriter writer;
+    frame_begin(&writer, buf, buflen, 0, (uint8_t) ins, 0, 0, tlvs_length > 0xFF);
+    frame_append_tlvs(&writer, tlvs, tlvs_count);
+    *length = frame_finish(&writer, 0);
+    check_ret(*length == 0, RET_INVALID_PARAMS);
+    return RET_NO_ERROR;
 }
 
-int ccid_receive(libusb_device_handle *device, int *actual_length, unsigned char *returned_data, size_t buffer_length) {
+static int ccid_usb_receive(libusb_device_handle *device, int *actual_length, unsigned char *returned_data, size_t buffer_length) {
     rassert(device != NULL);
     rassert(actual_length != NULL);
     rassert(returned_data != NULL);
@@ -383,16 +506,14 @@ int ccid_receive(libusb_device_handle *device, int *actual_length, unsigned char
         LOG("Error reading data: %s\n", libusb_strerror(r));
         return RET_COMM_ERROR;
     }
-    print_buffer(returned_data, (*actual_length), "recv");
     return 0;
 }
 
-int ccid_send(libusb_device_handle *device, int *actual_length, const unsigned char *data, const size_t length) {
+static int ccid_usb_send(libusb_device_handle *device, int *actual_length, const unsigned char *data, const size_t length) {
     rassert(device != NULL);
     rassert(actual_length != NULL);
     rassert(data != NULL);
     rassert(length > 0);
-    print_buffer(data, length, "sending");
     stopwatch_start();
     int r = libusb_bulk_transfer(device, WRITE_ENDPOINT, (uint8_t *) data, (int) length, actual_length, TIMEOUT);
     LOG("*** Time for %s: %ld\n", __FUNCTION__, stopwatch_stop());
@@ -403,6 +524,88 @@ int ccid_send(libusb_device_handle *device, int *actual_length, const unsigned c
     return 0;
 }
 
+int ccid_receive(struct Device *dev, int *actual_length, unsigned char *returned_data, size_t buffer_length) {
+    rassert(dev != NULL);
+    rassert(actual_length != NULL);
+    rassert(returned_data != NULL);
+    rassert(buffer_length > 0);
+    for (int i = 0; i <= MAX_STALE_FRAMES; ++i) {
+        size_t received = 0;
+        int r = dev->transport->receive(dev, returned_data, buffer_length, &received);
+        if (r != RET_NO_ERROR) {
+            return RET_COMM_ERROR;
+        }
+        *actual_length = (int) received;
+        print_buffer(returned_data, (*actual_length), "recv");
+        if (received >= ICC_HEADER_SIZE && returned_data[ICC_SEQ_OFFSET] == dev->ccid_seq) {
+            return 0;
+        }
+        // Leftover of an earlier request, e.g. after a timeout
+        LOG("Dropping frame with sequence number %d, expected %d\n", returned_data[ICC_SEQ_OFFSET], dev->ccid_seq);
+        dev->timings.stale_frames++;
+    }
+    return RET_COMM_ERROR;
+}
+
+int ccid_send(struct Device *dev, unsigned char *data, const size_t length) {
+    rassert(dev != NULL);
+    rassert(data != NULL);
+    rassert(length >= ICC_HEADER_SIZE && length <= MAX_CCID_BUFFER_SIZE);
+    // Sequence numbers are assigned per device, to match the response frames to the request
+    data[ICC_SEQ_OFFSET] = ++dev->ccid_seq;
+    print_buffer(data, length, "sending");
+    device_mark_first_send(dev);
+    int r = dev->transport->send(dev, data, length);
+    if (r != RET_NO_ERROR) {
+        return RET_COMM_ERROR;
+    }
+    return 0;
+}
+
+static int ccid_transport_open(struct Device *dev) {
+    return ccid_open_usb(dev);
+}
+
+static int ccid_transport_send(struct Device *dev, const uint8_t *data, size_t length) {
+    int actual_length = 0;
+    int r = ccid_usb_send(dev->mp_devhandle_usb, &actual_length, data, length);
+    return r == 0 ? RET_NO_ERROR : RET_COMM_ERROR;
+}
+
+static int ccid_transport_receive(struct Device *dev, uint8_t *data, size_t length, size_t *actual_length) {
+    int received = 0;
+    int r = ccid_usb_receive(dev->mp_devhandle_usb, &received, data, length);
+    if (r != 0) {
+        return RET_COMM_ERROR;
+    }
+    *actual_length = (size_t) received;
+    return RET_NO_ERROR;
+}
+
+static int ccid_transport_poll(struct Device *dev, uint32_t timeout_ms) {
+    unused(dev);
+    usleep(timeout_ms * 1000);
+    return RET_NO_ERROR;
+}
+
+static int ccid_transport_close(struct Device *dev) {
+    if (dev->mp_devhandle_usb == NULL) return RET_UNKNOWN_DEVICE;
+    libusb_release_interface(dev->mp_devhandle_usb, 0);
+    libusb_close(dev->mp_devhandle_usb);
+    dev->mp_devhandle_usb = NULL;
+    dev->ctx_usb = NULL;
+    return RET_NO_ERROR;
+}
+
+const Transport transport_ccid = {
+        .name = "ccid",
+        .open = ccid_transport_open,
+        .send = ccid_transport_send,
+        .receive = ccid_transport_receive,
+        .poll = ccid_transport_poll,
+        .close = ccid_transport_close,
+};
+
 void print_buffer(const unsigned char *buffer, const uint32_t length, const char *message) {
 #ifdef NDEBUG
     unused(message);
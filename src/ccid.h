@@ -28,13 +28,35 @@
 #include <libusb.h>
 #include <stdint.h>
 
-uint32_t
-icc_compose(uint8_t *buf, uint32_t buffer_length, uint8_t msg_type, size_t data_len, uint8_t slot, uint8_t seq,
-            uint16_t param, uint8_t *data);
-
-uint32_t
-iso7816_compose(uint8_t *buf, uint32_t buffer_length, uint8_t ins, uint8_t p1, uint8_t p2, uint8_t cls, uint8_t le,
-                uint8_t *data, uint8_t data_len);
+/**
+ * Writer of a PC_to_RDR_XfrBlock frame, composed in place in the output buffer: the CCID header, the APDU
+ * header and the room for Lc are reserved by frame_begin, the data is appended directly after them, and the
+ * lengths are written by frame_finish.
+ */
+typedef struct FrameWriter {
+    uint8_t *buf;
+    size_t size;
+    size_t length;
+    // Offset of the APDU data
+    size_t data_start;
+    // Use the extended APDU length encoding, for the data longer than 255 bytes
+    bool extended;
+    // Set when the frame did not fit in the buffer
+    bool overflow;
+} FrameWriter;
+
+void frame_begin(FrameWriter *writer, uint8_t *buf, size_t buf_size, uint8_t cls, uint8_t ins, uint8_t p1,
+                 uint8_t p2, bool extended);
+// Reserve the room for the data written by the caller, NULL if it does not fit
+uint8_t *frame_reserve(FrameWriter *writer, size_t length);
+void frame_append(FrameWriter *writer, const uint8_t *data, size_t length);
+void frame_append_tlvs(FrameWriter *writer, const TLV tlvs[], int tlvs_count);
+/**
+ * Write the CCID and APDU lengths.
+ * @param le expected response length, 0 for none
+ * @return frame length, 0 if it did not fit in the buffer or in the APDU length encoding
+ */
+uint32_t frame_finish(FrameWriter *writer, uint32_t le);
 
 typedef struct {
     uint8_t status;
@@ -46,30 +68,57 @@ typedef struct {
     //    const uint32_t buffer_len;
 } IccResult;
 
+// Decode the RDR_to_PC_DataBlock frame, buf_len being the received length, which bounds the data
 IccResult parse_icc_result(uint8_t *buf, size_t buf_len);
 
+// Compose the frame selecting the Secrets App, returns its length, or 0 if buf_size is too small
+uint32_t compose_select(uint8_t *buf, size_t buf_size);
+// Locate the APDU in the PC_to_RDR_XfrBlock frame, for the transports exchanging the bare APDUs
+int icc_unwrap_apdu(const uint8_t *frame, size_t frame_length, const uint8_t **apdu, size_t *apdu_length);
+// Write the RDR_to_PC_DataBlock header, for the response data placed after it by the caller
+void icc_write_data_block_header(uint8_t *frame, uint32_t data_length, uint8_t seq, uint8_t status);
+
 int ccid_test();
 
 void print_buffer(const unsigned char *buffer, const uint32_t length, const char *message);
 
-int ccid_send(libusb_device_handle *device, int *actual_length, const unsigned char *data, const size_t length);
+// Send the frame, setting its sequence number in place
+int ccid_send(struct Device *dev, unsigned char *data, const size_t length);
 
-int ccid_receive(libusb_device_handle *device, int *actual_length, unsigned char *returned_data, size_t buffer_length);
+int ccid_receive(struct Device *dev, int *actual_length, unsigned char *returned_data, size_t buffer_length);
 
 
-int ccid_process(libusb_device_handle *handle, uint8_t *buf, uint32_t buf_length, const uint8_t *data_to_send[],
+int ccid_process(struct Device *dev, uint8_t *buf, uint32_t buf_length, uint8_t *data_to_send[],
                  int data_to_send_count, const uint32_t data_to_send_sizes[], bool continue_on_errors,
                  IccResult *result);
 
-int ccid_process_single(libusb_device_handle *handle, uint8_t *receiving_buffer, uint32_t receiving_buffer_length, const uint8_t *sending_buffer,
+int ccid_process_single(struct Device *dev, uint8_t *receiving_buffer, uint32_t receiving_buffer_length, uint8_t *sending_buffer,
                         const uint32_t sending_buffer_length, IccResult *result);
 
 char *ccid_error_message(uint16_t status_code);
 
-uint32_t icc_pack_tlvs_for_sending(uint8_t *buf, size_t buflen, TLV tlvs[], int tlvs_count, int ins);
+/**
+ * Encode the command frame with the TLVs.
+ * @param length set to the frame length
+ * @return RET_INVALID_PARAMS if the frame does not fit the buffer
+ */
+int icc_pack_tlvs_for_sending(uint8_t *buf, size_t buflen, TLV tlvs[], int tlvs_count, int ins, uint32_t *length);
+
+/**
+ * Encode the command frame, to be sent with ccid_execute_prepared.
+ * @param patched_tag tag of the 4 bytes integer TLV patched on each execution
+ * @return RET_INVALID_PARAMS if the frame is too big, or the patched TLV is not found
+ */
+int ccid_prepare_command(PreparedCommand *command, TLV tlvs[], int tlvs_count, int ins, uint8_t patched_tag);
+// Patch the value into the prepared frame, send it and receive the response into dev->ccid_buffer_in
+int ccid_execute_prepared(struct Device *dev, PreparedCommand *command, uint32_t value, IccResult *result);
 libusb_device_handle *get_device(libusb_context *ctx, const struct VidPid pPid[], int devices_count);
-int ccid_init(libusb_device_handle *handle);
-int send_select_ccid(libusb_device_handle *handle, uint8_t buf[], size_t buf_size, IccResult *iccResult);
+// Claim the CCID interface of the opened device
+int ccid_claim_device(libusb_device_handle *handle);
+// Open the CCID device over libusb, unless it was opened already by the device discovery
+int ccid_open_usb(struct Device *dev);
+int ccid_init(struct Device *dev);
+int send_select_ccid(struct Device *dev, uint8_t buf[], size_t buf_size, IccResult *iccResult);
 
 
 enum {
@@ -121,6 +170,10 @@ enum {
     Ins_GetResponse = 0xc0,
 };
 
+#define ICC_HEADER_SIZE (10)
+#define ICC_SEQ_OFFSET (6)
+// CLA, INS, P1 and P2
+#define APDU_HEADER_SIZE (4)
 #define AWAITING_FOR_TOUCH_STATUS_CODE (0x80)
 #define DATA_REMAINING_STATUS_CODE (0x61)
 
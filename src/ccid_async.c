@@ -0,0 +1,312 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+/**
+ * CCID transport based on the asynchronous libusb API.
+ * A bulk IN transfer is kept posted all the time, and the received frames are queued
+ * in the arrival order. The OUT transfer is submitted without waiting for its completion,
+ * so it overlaps with the IN handling. Matching the frames to the requests by the sequence
+ * number is done in ccid_receive().
+ */
+
+#include "ccid.h"
+#include "device.h"
+#include "return_codes.h"
+#include "settings.h"
+#include "utils.h"
+#include <libusb.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+static const unsigned char READ_ENDPOINT = 0x81;
+static const unsigned char WRITE_ENDPOINT = 0x01;
+static const int64_t RECEIVE_TIMEOUT_MS = 2 * 1000;
+
+static int64_t now_ms(void) {
+    return micros() / 1000;
+}
+
+#define IN_TRANSFERS_COUNT 2
+#define OUT_TRANSFERS_COUNT 2
+#define QUEUE_SIZE 4
+
+typedef struct CcidFrame {
+    uint8_t data[MAX_CCID_BUFFER_SIZE];
+    size_t length;
+} CcidFrame;
+
+typedef struct CcidAsyncEngine {
+    libusb_context *ctx;
+    libusb_device_handle *handle;
+
+    struct libusb_transfer *in_transfers[IN_TRANSFERS_COUNT];
+    uint8_t in_buffers[IN_TRANSFERS_COUNT][MAX_CCID_BUFFER_SIZE];
+    bool in_posted[IN_TRANSFERS_COUNT];
+    struct libusb_transfer *out_transfers[OUT_TRANSFERS_COUNT];
+    uint8_t out_buffers[OUT_TRANSFERS_COUNT][MAX_CCID_BUFFER_SIZE];
+    bool out_busy[OUT_TRANSFERS_COUNT];
+    int out_next;
+    int in_flight;
+    bool closing;
+    // First error reported by the transfers since the last one was returned, RET_NO_ERROR otherwise
+    int error;
+
+    // Received frames, in the arrival order
+    CcidFrame queue[QUEUE_SIZE];
+    int queue_head;
+    int queue_count;
+    uint32_t frames_overflown;
+} CcidAsyncEngine;
+
+static int transfer_error(enum libusb_transfer_status status) {
+    return status == LIBUSB_TRANSFER_NO_DEVICE ? RET_CONNECTION_LOST : RET_COMM_ERROR;
+}
+
+static void LIBUSB_CALL in_transfer_done(struct libusb_transfer *transfer) {
+    CcidAsyncEngine *e = transfer->user_data;
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED && transfer->actual_length >= ICC_HEADER_SIZE) {
+        if (e->queue_count == QUEUE_SIZE) {
+            // Drop the oldest frame, usually a stale one. Were it the awaited response, the receive times out.
+            e->frames_overflown++;
+            LOG("Receive queue full, dropping frame with sequence number %d (%u dropped)\n",
+                e->queue[e->queue_head].data[ICC_SEQ_OFFSET], e->frames_overflown);
+            e->queue_head = (e->queue_head + 1) % QUEUE_SIZE;
+            e->queue_count--;
+        }
+        CcidFrame *f = &e->queue[(e->queue_head + e->queue_count) % QUEUE_SIZE];
+        memcpy(f->data, transfer->buffer, transfer->actual_length);
+        f->length = transfer->actual_length;
+        e->queue_count++;
+    } else if (transfer->status != LIBUSB_TRANSFER_COMPLETED &&
+               transfer->status != LIBUSB_TRANSFER_TIMED_OUT &&
+               transfer->status != LIBUSB_TRANSFER_CANCELLED &&
+               e->error == RET_NO_ERROR) {
+        e->error = transfer_error(transfer->status);
+    }
+
+    if (!e->closing && e->error == RET_NO_ERROR && libusb_submit_transfer(transfer) == LIBUSB_SUCCESS) {
+        return;
+    }
+    for (int i = 0; i < IN_TRANSFERS_COUNT; ++i) {
+        if (e->in_transfers[i] == transfer) {
+            e->in_posted[i] = false;
+        }
+    }
+    e->in_flight--;
+}
+
+static void LIBUSB_CALL out_transfer_done(struct libusb_transfer *transfer) {
+    CcidAsyncEngine *e = transfer->user_data;
+    for (int i = 0; i < OUT_TRANSFERS_COUNT; ++i) {
+        if (e->out_transfers[i] == transfer) {
+            e->out_busy[i] = false;
+        }
+    }
+    e->in_flight--;
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED && e->error == RET_NO_ERROR) {
+        e->error = transfer_error(transfer->status);
+    }
+}
+
+// Process the transfer events for up to timeout_ms, or until any transfer completes
+static void handle_events(CcidAsyncEngine *e, int64_t timeout_ms) {
+    struct timeval tv = {
+            .tv_sec = timeout_ms / 1000,
+            .tv_usec = (timeout_ms % 1000) * 1000,
+    };
+    libusb_handle_events_timeout_completed(e->ctx, &tv, NULL);
+}
+
+// Post again the IN transfers stopped by an error
+static void repost_in_transfers(CcidAsyncEngine *e) {
+    for (int i = 0; i < IN_TRANSFERS_COUNT; ++i) {
+        if (!e->in_posted[i] && libusb_submit_transfer(e->in_transfers[i]) == LIBUSB_SUCCESS) {
+            e->in_posted[i] = true;
+            e->in_flight++;
+        }
+    }
+}
+
+// Return the pending error once, and resume the reception for the next commands
+static int take_error(CcidAsyncEngine *e) {
+    const int error = e->error;
+    e->error = RET_NO_ERROR;
+    repost_in_transfers(e);
+    return error;
+}
+
+static void free_transfers(CcidAsyncEngine *e) {
+    e->closing = true;
+    for (int i = 0; i < IN_TRANSFERS_COUNT; ++i) {
+        if (e->in_posted[i]) {
+            libusb_cancel_transfer(e->in_transfers[i]);
+        }
+    }
+    for (int i = 0; i < OUT_TRANSFERS_COUNT; ++i) {
+        if (e->out_busy[i]) {
+            libusb_cancel_transfer(e->out_transfers[i]);
+        }
+    }
+    // The callbacks reference the engine and the device handle, so wait for all of them before closing it
+    const int64_t deadline = now_ms() + RECEIVE_TIMEOUT_MS;
+    bool reported = false;
+    while (e->in_flight > 0) {
+        if (!reported && now_ms() >= deadline) {
+            LOG("Waiting for %d transfers to finish on close\n", e->in_flight);
+            reported = true;
+        }
+        handle_events(e, 100);
+    }
+    for (int i = 0; i < IN_TRANSFERS_COUNT; ++i) {
+        libusb_free_transfer(e->in_transfers[i]);
+    }
+    for (int i = 0; i < OUT_TRANSFERS_COUNT; ++i) {
+        libusb_free_transfer(e->out_transfers[i]);
+    }
+    free(e);
+}
+
+static int ccid_async_transport_close(struct Device *dev) {
+    CcidAsyncEngine *e = dev->transport_state;
+    if (e == NULL) return RET_UNKNOWN_DEVICE;
+    free_transfers(e);
+    libusb_release_interface(dev->mp_devhandle_usb, 0);
+    libusb_close(dev->mp_devhandle_usb);
+    dev->mp_devhandle_usb = NULL;
+    dev->ctx_usb = NULL;
+    dev->transport_state = NULL;
+    return RET_NO_ERROR;
+}
+
+static int ccid_async_transport_open(struct Device *dev) {
+    int r = ccid_open_usb(dev);
+    if (r != RET_NO_ERROR) {
+        return r;
+    }
+
+    CcidAsyncEngine *e = calloc(1, sizeof *e);
+    rassert(e != NULL);
+    e->ctx = dev->ctx_usb;
+    e->handle = dev->mp_devhandle_usb;
+    e->error = RET_NO_ERROR;
+    dev->transport_state = e;
+
+    for (int i = 0; i < OUT_TRANSFERS_COUNT; ++i) {
+        e->out_transfers[i] = libusb_alloc_transfer(0);
+        rassert(e->out_transfers[i] != NULL);
+    }
+    for (int i = 0; i < IN_TRANSFERS_COUNT; ++i) {
+        e->in_transfers[i] = libusb_alloc_transfer(0);
+        rassert(e->in_transfers[i] != NULL);
+        libusb_fill_bulk_transfer(e->in_transfers[i], e->handle, READ_ENDPOINT, e->in_buffers[i],
+                                  sizeof e->in_buffers[i], in_transfer_done, e, 0);
+        r = libusb_submit_transfer(e->in_transfers[i]);
+        if (r != LIBUSB_SUCCESS) {
+            printf("Error submitting transfer: %s\n", libusb_strerror(r));
+            ccid_async_transport_close(dev);
+            return RET_COMM_ERROR;
+        }
+        e->in_posted[i] = true;
+        e->in_flight++;
+    }
+    return RET_NO_ERROR;
+}
+
+static int ccid_async_transport_send(struct Device *dev, const uint8_t *data, size_t length) {
+    CcidAsyncEngine *e = dev->transport_state;
+    rassert(e != NULL);
+    rassert(length <= MAX_CCID_BUFFER_SIZE);
+    const int slot = e->out_next;
+    const int64_t deadline = now_ms() + RECEIVE_TIMEOUT_MS;
+    while (e->out_busy[slot] && e->error == RET_NO_ERROR) {
+        if (now_ms() >= deadline) {
+            return RET_COMM_ERROR;
+        }
+        handle_events(e, RECEIVE_TIMEOUT_MS);
+    }
+    if (e->error != RET_NO_ERROR) {
+        return take_error(e);
+    }
+
+    memcpy(e->out_buffers[slot], data, length);
+    libusb_fill_bulk_transfer(e->out_transfers[slot], e->handle, WRITE_ENDPOINT, e->out_buffers[slot],
+                              (int) length, out_transfer_done, e, RECEIVE_TIMEOUT_MS);
+    const int r = libusb_submit_transfer(e->out_transfers[slot]);
+    if (r != LIBUSB_SUCCESS) {
+        LOG("Error submitting transfer: %s\n", libusb_strerror(r));
+        return RET_COMM_ERROR;
+    }
+    e->out_busy[slot] = true;
+    e->in_flight++;
+    e->out_next = (slot + 1) % OUT_TRANSFERS_COUNT;
+    return RET_NO_ERROR;
+}
+
+static int ccid_async_transport_receive(struct Device *dev, uint8_t *data, size_t length, size_t *actual_length) {
+    CcidAsyncEngine *e = dev->transport_state;
+    rassert(e != NULL);
+    const int64_t deadline = now_ms() + RECEIVE_TIMEOUT_MS;
+    while (e->queue_count == 0) {
+        if (e->error != RET_NO_ERROR) {
+            return take_error(e);
+        }
+        const int64_t remaining = deadline - now_ms();
+        if (remaining <= 0) {
+            LOG("Error reading data: timeout\n");
+            return RET_COMM_ERROR;
+        }
+        handle_events(e, remaining);
+    }
+
+    const CcidFrame *f = &e->queue[e->queue_head];
+    e->queue_head = (e->queue_head + 1) % QUEUE_SIZE;
+    e->queue_count--;
+    if (f->length > length) {
+        return RET_COMM_ERROR;
+    }
+    memcpy(data, f->data, f->length);
+    *actual_length = f->length;
+    return RET_NO_ERROR;
+}
+
+static int ccid_async_transport_poll(struct Device *dev, uint32_t timeout_ms) {
+    CcidAsyncEngine *e = dev->transport_state;
+    rassert(e != NULL);
+    // Keep the frames flowing into the queue while waiting
+    const int64_t deadline = now_ms() + timeout_ms;
+    int64_t remaining;
+    while (e->queue_count == 0 && (remaining = deadline - now_ms()) > 0) {
+        handle_events(e, remaining);
+    }
+    return RET_NO_ERROR;
+}
+
+const Transport transport_ccid_async = {
+        .name = "ccid-async",
+        .open = ccid_async_transport_open,
+        .send = ccid_async_transport_send,
+        .receive = ccid_async_transport_receive,
+        .poll = ccid_async_transport_poll,
+        .close = ccid_async_transport_close,
+};
@@ -20,8 +20,27 @@
  */
 
 #include "crc32.h"
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#define CRC32_CLMUL_X86
+#include <immintrin.h>
+#elif defined(__aarch64__) && (defined(__ARM_FEATURE_AES) || defined(__ARM_FEATURE_CRYPTO)) && \
+        defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define CRC32_CLMUL_ARM64
+#include <arm_neon.h>
+#ifdef __linux__
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+#endif
+
+#define STM32_CRC32_POLYNOMIAL 0x04C11DB7
+// Below this size the folding setup costs more than it saves
+#define CLMUL_MIN_SIZE 32
 
 //taken from libnitrokey
 
@@ -31,7 +50,7 @@ uint32_t _crc32(uint32_t crc, uint32_t data) {
 
     for (i = 0; i < 32; i++) {
         if (crc & 0x80000000)
-            crc = (crc << 1) ^ 0x04C11DB7;// polynomial used in STM32
+            crc = (crc << 1) ^ STM32_CRC32_POLYNOMIAL;// polynomial used in STM32
         else
             crc = (crc << 1);
     }
@@ -39,10 +58,201 @@ uint32_t _crc32(uint32_t crc, uint32_t data) {
     return crc;
 }
 
-uint32_t stm_crc32(const uint8_t *data, size_t size) {
+static uint32_t load_word(const uint8_t *p) {
+    uint32_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+uint32_t stm_crc32_bitwise(const uint8_t *data, size_t size) {
     uint32_t crc = 0xffffffff;
-    const uint32_t *pend = (const uint32_t *) (data + size);
-    for (const uint32_t *p = (const uint32_t *) (data); p < pend; p++)
-        crc = _crc32(crc, *p);
+    for (size_t i = 0; i + sizeof(uint32_t) <= size; i += sizeof(uint32_t))
+        crc = _crc32(crc, load_word(data + i));
+    return crc;
+}
+
+// crc32_table[k][b] is the CRC register after feeding byte b followed by k zero bytes
+static uint32_t crc32_table[8][256];
+static bool crc32_table_ready = false;
+
+static void crc32_table_init(void) {
+    if (crc32_table_ready) {
+        return;
+    }
+    for (uint32_t b = 0; b < 256; b++) {
+        uint32_t crc = b << 24;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc & 0x80000000) ? (crc << 1) ^ STM32_CRC32_POLYNOMIAL : (crc << 1);
+        }
+        crc32_table[0][b] = crc;
+    }
+    for (int k = 1; k < 8; k++) {
+        for (uint32_t b = 0; b < 256; b++) {
+            const uint32_t prev = crc32_table[k - 1][b];
+            crc32_table[k][b] = (prev << 8) ^ crc32_table[0][prev >> 24];
+        }
+    }
+    crc32_table_ready = true;
+}
+
+// Each word is fed most significant byte first, so its bytes go through the table in the b3..b0 order
+static uint32_t crc32_table_words(uint32_t crc, const uint8_t *data, size_t words) {
+    const uint32_t(*t)[256] = (const uint32_t(*)[256]) crc32_table;
+    for (; words >= 2; words -= 2, data += 8) {
+        const uint32_t first = crc ^ load_word(data);
+        const uint32_t second = load_word(data + 4);
+        crc = t[7][first >> 24] ^ t[6][(first >> 16) & 0xFF] ^ t[5][(first >> 8) & 0xFF] ^ t[4][first & 0xFF] ^
+              t[3][second >> 24] ^ t[2][(second >> 16) & 0xFF] ^ t[1][(second >> 8) & 0xFF] ^ t[0][second & 0xFF];
+    }
+    if (words == 1) {
+        const uint32_t word = crc ^ load_word(data);
+        crc = t[3][word >> 24] ^ t[2][(word >> 16) & 0xFF] ^ t[1][(word >> 8) & 0xFF] ^ t[0][word & 0xFF];
+    }
     return crc;
-}
\ No newline at end of file
+}
+
+uint32_t stm_crc32_table(const uint8_t *data, size_t size) {
+    crc32_table_init();
+    return crc32_table_words(0xffffffff, data, size / sizeof(uint32_t));
+}
+
+#if defined(CRC32_CLMUL_X86) || defined(CRC32_CLMUL_ARM64)
+
+// x^n mod P, the folding constants
+static uint32_t xpow_mod(int n) {
+    uint32_t r = 1;
+    while (n-- > 0) {
+        r = (r & 0x80000000) ? (r << 1) ^ STM32_CRC32_POLYNOMIAL : (r << 1);
+    }
+    return r;
+}
+
+static uint64_t fold_high_constant;// x^192 mod P
+static uint64_t fold_low_constant; // x^128 mod P
+
+static void clmul_constants_init(void) {
+    if (fold_high_constant != 0) {
+        return;
+    }
+    fold_low_constant = xpow_mod(128);
+    fold_high_constant = xpow_mod(192);
+}
+
+/*
+ * The data is read as 128-bit blocks, the first word being the most significant one. The accumulator A = H*x^64 + L
+ * is folded over the next block B with A*x^128 + B = H*(x^192 mod P) + L*(x^128 mod P) + B (mod P), which keeps it
+ * at 128 bits. The remaining accumulator is reduced by feeding its four words to the table implementation, starting
+ * from a zero register, and the tail words follow it.
+ */
+static uint32_t crc32_finish_fold(uint64_t high, uint64_t low, const uint8_t *tail, size_t tail_words) {
+    uint8_t folded[16];
+    const uint32_t words[4] = {(uint32_t) (high >> 32), (uint32_t) high, (uint32_t) (low >> 32), (uint32_t) low};
+    memcpy(folded, words, sizeof(folded));
+    const uint32_t crc = crc32_table_words(0, folded, 4);
+    return crc32_table_words(crc, tail, tail_words);
+}
+
+#endif
+
+#ifdef CRC32_CLMUL_X86
+
+__attribute__((target("sse2,pclmul"))) static uint32_t crc32_clmul_blocks(const uint8_t *data, size_t blocks,
+                                                                           size_t tail_words) {
+    const __m128i constants = _mm_set_epi64x((long long) fold_high_constant, (long long) fold_low_constant);
+    // Reverse the lanes, so that the first word of a block becomes its most significant one
+    __m128i acc = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) data), 0x1B);
+    acc = _mm_xor_si128(acc, _mm_slli_si128(_mm_cvtsi32_si128((int) 0xffffffff), 12));
+    for (size_t i = 1; i < blocks; i++) {
+        const __m128i block = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) (data + 16 * i)), 0x1B);
+        const __m128i high = _mm_clmulepi64_si128(acc, constants, 0x11);
+        const __m128i low = _mm_clmulepi64_si128(acc, constants, 0x00);
+        acc = _mm_xor_si128(_mm_xor_si128(high, low), block);
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *) lanes, acc);
+    return crc32_finish_fold(lanes[1], lanes[0], data + 16 * blocks, tail_words);
+}
+
+static bool clmul_supported(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("pclmul");
+}
+
+#endif
+
+#ifdef CRC32_CLMUL_ARM64
+
+static uint64x2_t load_block(const uint8_t *p) {
+    const uint32x4_t words = vrev64q_u32(vld1q_u32((const uint32_t *) p));
+    return vreinterpretq_u64_u32(vextq_u32(words, words, 2));
+}
+
+static uint32_t crc32_clmul_blocks(const uint8_t *data, size_t blocks, size_t tail_words) {
+    const poly64_t high_constant = (poly64_t) fold_high_constant;
+    const poly64_t low_constant = (poly64_t) fold_low_constant;
+    const uint64x2_t initial = vcombine_u64(vcreate_u64(0), vcreate_u64((uint64_t) 0xffffffff << 32));
+    uint64x2_t acc = veorq_u64(load_block(data), initial);
+    for (size_t i = 1; i < blocks; i++) {
+        const poly128_t high = vmull_p64((poly64_t) vgetq_lane_u64(acc, 1), high_constant);
+        const poly128_t low = vmull_p64((poly64_t) vgetq_lane_u64(acc, 0), low_constant);
+        acc = veorq_u64(veorq_u64(vreinterpretq_u64_p128(high), vreinterpretq_u64_p128(low)),
+                        load_block(data + 16 * i));
+    }
+    return crc32_finish_fold(vgetq_lane_u64(acc, 1), vgetq_lane_u64(acc, 0), data + 16 * blocks, tail_words);
+}
+
+static bool clmul_supported(void) {
+#ifdef __linux__
+    return (getauxval(AT_HWCAP) & HWCAP_PMULL) != 0;
+#else
+    return true;
+#endif
+}
+
+#endif
+
+bool stm_crc32_clmul_available(void) {
+#if defined(CRC32_CLMUL_X86) || defined(CRC32_CLMUL_ARM64)
+    static int available = -1;
+    if (available < 0) {
+        available = clmul_supported();
+    }
+    return available;
+#else
+    return false;
+#endif
+}
+
+uint32_t stm_crc32_clmul(const uint8_t *data, size_t size) {
+    crc32_table_init();
+#if defined(CRC32_CLMUL_X86) || defined(CRC32_CLMUL_ARM64)
+    if (size >= CLMUL_MIN_SIZE && stm_crc32_clmul_available()) {
+        clmul_constants_init();
+        return crc32_clmul_blocks(data, size / 16, (size % 16) / sizeof(uint32_t));
+    }
+#endif
+    return crc32_table_words(0xffffffff, data, size / sizeof(uint32_t));
+}
+
+static uint32_t stm_crc32_select(const uint8_t *data, size_t size);
+
+static uint32_t (*stm_crc32_selected)(const uint8_t *data, size_t size) = stm_crc32_select;
+
+static uint32_t stm_crc32_select(const uint8_t *data, size_t size) {
+    crc32_table_init();
+    if (stm_crc32_clmul_available()) {
+        clmul_constants_init();
+        stm_crc32_selected = stm_crc32_clmul;
+    } else {
+        stm_crc32_selected = stm_crc32_table;
+    }
+    return stm_crc32_selected(data, size);
+}
+
+const char *stm_crc32_implementation(void) {
+    return stm_crc32_clmul_available() ? "clmul" : "table";
+}
+
+uint32_t stm_crc32(const uint8_t *data, size_t size) {
+    return stm_crc32_selected(data, size);
+}
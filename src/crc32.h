@@ -22,10 +22,23 @@
 #ifndef NITROKEY_HOTP_VERIFICATION_CRC32_H
 #define NITROKEY_HOTP_VERIFICATION_CRC32_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+
+/*
+ * The STM32 CRC (polynomial 0x04C11DB7, not reflected, initial value 0xFFFFFFFF) over the native 32-bit words of
+ * the data, each fed most significant bit first. Trailing bytes not filling a whole word are not included.
+ * stm_crc32 uses the fastest implementation available on the running CPU; the others are kept for the tests.
+ */
 uint32_t _crc32(uint32_t crc, uint32_t data);
 uint32_t stm_crc32(const uint8_t *data, size_t size);
+uint32_t stm_crc32_bitwise(const uint8_t *data, size_t size);
+uint32_t stm_crc32_table(const uint8_t *data, size_t size);
+// Folds the data with carry-less multiplication (PCLMULQDQ or PMULL), falls back to the table when not available
+uint32_t stm_crc32_clmul(const uint8_t *data, size_t size);
+bool stm_crc32_clmul_available(void);
+const char *stm_crc32_implementation(void);
 
 
 #endif//NITROKEY_HOTP_VERIFICATION_CRC32_H
@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+/**
+ * CCID transport for the Nitrokey 3, reaching the Secrets App through the Nitrokey vendor command
+ * of the CTAPHID (FIDO) interface, over the interrupt endpoints. Used when the CCID interface is
+ * held by another application, like pcscd.
+ * As in the PC/SC transport, the APDUs are taken out of the XfrBlock frames composed in ccid.c,
+ * and the responses are wrapped back into the DataBlock frames. The CTAPHID keepalive frames
+ * requesting the user presence are reported as the CCID time extensions.
+ */
+
+#include "ccid.h"
+#include "device.h"
+#include "min.h"
+#include "random_data.h"
+#include "return_codes.h"
+#include "settings.h"
+#include "transport.h"
+#include "utils.h"
+#include <libusb.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CTAPHID_PACKET_SIZE 64
+#define CTAPHID_INIT_HEADER_SIZE 7
+#define CTAPHID_CONT_HEADER_SIZE 5
+#define CTAPHID_NONCE_SIZE 8
+
+static const uint32_t CTAPHID_BROADCAST_CID = 0xFFFFFFFF;
+static const uint8_t CTAPHID_INIT = 0x86;
+static const uint8_t CTAPHID_KEEPALIVE = 0xBB;
+static const uint8_t CTAPHID_ERROR = 0xBF;
+// Nitrokey vendor command passing the APDUs to the Secrets App. The response starts with the status word.
+static const uint8_t CTAPHID_VENDOR_NITROKEY_OTP = 0xF0;
+static const uint8_t KEEPALIVE_STATUS_UPNEEDED = 2;
+static const unsigned int CTAPHID_TIMEOUT_MS = 2 * 1000;
+// The user presence is waited for with the keepalive frames coming every 100 ms
+static const int MAX_KEEPALIVE_FRAMES = 30 * 10;
+
+typedef struct CtaphidState {
+    uint32_t cid;
+    uint8_t endpoint_in;
+    uint8_t endpoint_out;
+    // Sequence number of the CCID frame awaiting the response, valid if pending
+    uint8_t ccid_seq;
+    bool pending;
+    uint8_t message[MAX_CCID_BUFFER_SIZE];
+} CtaphidState;
+
+static void write_be32(uint8_t *p, uint32_t value) {
+    p[0] = (value >> 24) & 0xFF;
+    p[1] = (value >> 16) & 0xFF;
+    p[2] = (value >> 8) & 0xFF;
+    p[3] = value & 0xFF;
+}
+
+static uint32_t read_be32(const uint8_t *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
+
+static int find_endpoints(struct Device *dev, CtaphidState *s) {
+    struct libusb_config_descriptor *config = nullptr;
+    libusb_device *usb_dev = libusb_get_device(dev->mp_devhandle_usb);
+    if (libusb_get_active_config_descriptor(usb_dev, &config) != LIBUSB_SUCCESS) {
+        return RET_COMM_ERROR;
+    }
+    for (int i = 0; i < config->bNumInterfaces; ++i) {
+        const struct libusb_interface_descriptor *interface = &config->interface[i].altsetting[0];
+        if (interface->bInterfaceNumber != dev->usb_interface) {
+            continue;
+        }
+        for (int e = 0; e < interface->bNumEndpoints; ++e) {
+            const struct libusb_endpoint_descriptor *endpoint = &interface->endpoint[e];
+            if ((endpoint->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) != LIBUSB_TRANSFER_TYPE_INTERRUPT) {
+                continue;
+            }
+            if (endpoint->bEndpointAddress & LIBUSB_ENDPOINT_IN) {
+                s->endpoint_in = endpoint->bEndpointAddress;
+            } else {
+                s->endpoint_out = endpoint->bEndpointAddress;
+            }
+        }
+    }
+    libusb_free_config_descriptor(config);
+    return s->endpoint_in != 0 && s->endpoint_out != 0 ? RET_NO_ERROR : RET_COMM_ERROR;
+}
+
+static int write_message(struct Device *dev, CtaphidState *s, uint32_t cid, uint8_t cmd, const uint8_t *data,
+                         size_t length) {
+    uint8_t packet[CTAPHID_PACKET_SIZE];
+    size_t sent = 0;
+    uint8_t seq = 0;
+    do {
+        memset(packet, 0, sizeof packet);
+        write_be32(packet, cid);
+        size_t offset;
+        if (sent == 0) {
+            packet[4] = cmd;
+            packet[5] = (length >> 8) & 0xFF;
+            packet[6] = length & 0xFF;
+            offset = CTAPHID_INIT_HEADER_SIZE;
+        } else {
+            packet[4] = seq++;
+            offset = CTAPHID_CONT_HEADER_SIZE;
+        }
+        const size_t chunk = min(length - sent, sizeof packet - offset);
+        memcpy(packet + offset, data + sent, chunk);
+        sent += chunk;
+        int transferred = 0;
+        const int r = libusb_interrupt_transfer(dev->mp_devhandle_usb, s->endpoint_out, packet, sizeof packet,
+                                                &transferred, CTAPHID_TIMEOUT_MS);
+        if (r != LIBUSB_SUCCESS || transferred != (int) sizeof packet) {
+            LOG("CTAPHID write failed: %s\n", libusb_strerror(r));
+            return RET_CONNECTION_LOST;
+        }
+    } while (sent < length);
+    return RET_NO_ERROR;
+}
+
+/**
+ * Read the next message on the channel, reassembling its continuation packets.
+ * Packets of the other channels are skipped.
+ */
+static int read_message(struct Device *dev, CtaphidState *s, uint32_t cid, uint8_t *cmd, size_t *length) {
+    uint8_t packet[CTAPHID_PACKET_SIZE];
+    size_t expected = 0;
+    size_t received = 0;
+    uint8_t next_seq = 0;
+    bool started = false;
+    while (!started || received < expected) {
+        int transferred = 0;
+        const int r = libusb_interrupt_transfer(dev->mp_devhandle_usb, s->endpoint_in, packet, sizeof packet,
+                                                &transferred, CTAPHID_TIMEOUT_MS);
+        if (r != LIBUSB_SUCCESS) {
+            LOG("CTAPHID read failed: %s\n", libusb_strerror(r));
+            return RET_CONNECTION_LOST;
+        }
+        if (transferred < CTAPHID_INIT_HEADER_SIZE || read_be32(packet) != cid) {
+            continue;
+        }
+        size_t offset;
+        if (!started) {
+            if ((packet[4] & 0x80) == 0) {
+                // continuation of a message not read from the start
+                continue;
+            }
+            *cmd = packet[4];
+            expected = ((size_t) packet[5] << 8) | packet[6];
+            if (expected > sizeof s->message) {
+                return RET_COMM_ERROR;
+            }
+            offset = CTAPHID_INIT_HEADER_SIZE;
+            started = true;
+        } else {
+            if (packet[4] != next_seq++) {
+                LOG("CTAPHID continuation packet out of order\n");
+                return RET_COMM_ERROR;
+            }
+            offset = CTAPHID_CONT_HEADER_SIZE;
+        }
+        const size_t chunk = min(expected - received, (size_t) transferred - offset);
+        memcpy(s->message + received, packet + offset, chunk);
+        received += chunk;
+    }
+    *length = expected;
+    return RET_NO_ERROR;
+}
+
+static int allocate_channel(struct Device *dev, CtaphidState *s) {
+    uint8_t nonce[CTAPHID_NONCE_SIZE];
+    read_random_bytes_to_buf(nonce, sizeof nonce);
+    int r = write_message(dev, s, CTAPHID_BROADCAST_CID, CTAPHID_INIT, nonce, sizeof nonce);
+    if (r != RET_NO_ERROR) {
+        return r;
+    }
+    // responses to the other hosts' INIT requests are told apart by the nonce
+    for (int i = 0; i < 8; ++i) {
+        uint8_t cmd = 0;
+        size_t length = 0;
+        r = read_message(dev, s, CTAPHID_BROADCAST_CID, &cmd, &length);
+        if (r != RET_NO_ERROR) {
+            return r;
+        }
+        if (cmd == CTAPHID_INIT && length >= CTAPHID_NONCE_SIZE + 4 &&
+            memcmp(s->message, nonce, sizeof nonce) == 0) {
+            s->cid = read_be32(s->message + CTAPHID_NONCE_SIZE);
+            return RET_NO_ERROR;
+        }
+    }
+    return RET_COMM_ERROR;
+}
+
+static void release_usb(struct Device *dev) {
+    libusb_release_interface(dev->mp_devhandle_usb, dev->usb_interface);
+    libusb_close(dev->mp_devhandle_usb);
+    dev->mp_devhandle_usb = nullptr;
+    dev->ctx_usb = nullptr;
+    dev->usb_ctaphid = false;
+}
+
+static int ctaphid_open(struct Device *dev) {
+    if (dev->mp_devhandle_usb == nullptr || !dev->usb_ctaphid) {
+        // opened only through the device discovery
+        return RET_COMM_ERROR;
+    }
+    CtaphidState *s = calloc(1, sizeof *s);
+    if (s == nullptr) {
+        return RET_COMM_ERROR;
+    }
+    int r = find_endpoints(dev, s);
+    if (r == RET_NO_ERROR) {
+        r = allocate_channel(dev, s);
+    }
+    if (r != RET_NO_ERROR) {
+        free(s);
+        // the handle was passed by the discovery, and would not be released otherwise
+        release_usb(dev);
+        return r;
+    }
+    LOG("CTAPHID channel 0x%08x\n", s->cid);
+    dev->transport_state = s;
+    dev->connection_type = CONNECTION_CCID;
+    return RET_NO_ERROR;
+}
+
+static int ctaphid_send(struct Device *dev, const uint8_t *data, size_t length) {
+    CtaphidState *s = dev->transport_state;
+    const uint8_t *apdu;
+    size_t apdu_length;
+    if (icc_unwrap_apdu(data, length, &apdu, &apdu_length) != RET_NO_ERROR) {
+        return RET_COMM_ERROR;
+    }
+    const int r = write_message(dev, s, s->cid, CTAPHID_VENDOR_NITROKEY_OTP, apdu, apdu_length);
+    if (r != RET_NO_ERROR) {
+        return r;
+    }
+    s->ccid_seq = data[ICC_SEQ_OFFSET];
+    s->pending = true;
+    return RET_NO_ERROR;
+}
+
+static int ctaphid_receive(struct Device *dev, uint8_t *data, size_t length, size_t *actual_length) {
+    CtaphidState *s = dev->transport_state;
+    if (!s->pending || length < ICC_HEADER_SIZE) {
+        return RET_COMM_ERROR;
+    }
+    for (int i = 0; i < MAX_KEEPALIVE_FRAMES; ++i) {
+        uint8_t cmd = 0;
+        size_t message_length = 0;
+        const int r = read_message(dev, s, s->cid, &cmd, &message_length);
+        if (r != RET_NO_ERROR) {
+            return r;
+        }
+        if (cmd == CTAPHID_KEEPALIVE) {
+            if (message_length >= 1 && s->message[0] == KEEPALIVE_STATUS_UPNEEDED) {
+                icc_write_data_block_header(data, 0, s->ccid_seq, AWAITING_FOR_TOUCH_STATUS_CODE);
+                *actual_length = ICC_HEADER_SIZE;
+                return RET_NO_ERROR;
+            }
+            continue;
+        }
+        s->pending = false;
+        if (cmd == CTAPHID_ERROR) {
+            LOG("CTAPHID error 0x%02x\n", message_length > 0 ? s->message[0] : 0);
+            return RET_COMM_ERROR;
+        }
+        if (cmd != CTAPHID_VENDOR_NITROKEY_OTP || message_length < 2 ||
+            ICC_HEADER_SIZE + message_length > length) {
+            return RET_COMM_ERROR;
+        }
+        // move the leading status word to the end, as in the ISO 7816 response
+        const size_t data_length = message_length - 2;
+        memcpy(data + ICC_HEADER_SIZE, s->message + 2, data_length);
+        memcpy(data + ICC_HEADER_SIZE + data_length, s->message, 2);
+        icc_write_data_block_header(data, (uint32_t) message_length, s->ccid_seq, 0);
+        *actual_length = ICC_HEADER_SIZE + message_length;
+        return RET_NO_ERROR;
+    }
+    return RET_COMM_ERROR;
+}
+
+static int ctaphid_poll(struct Device *dev, uint32_t timeout_ms) {
+    // the interrupt IN transfer in receive blocks until the device answers
+    unused(dev);
+    unused(timeout_ms);
+    return RET_NO_ERROR;
+}
+
+static int ctaphid_close(struct Device *dev) {
+    if (dev->mp_devhandle_usb == nullptr) return RET_UNKNOWN_DEVICE;
+    free(dev->transport_state);
+    dev->transport_state = nullptr;
+    release_usb(dev);
+    return RET_NO_ERROR;
+}
+
+const Transport transport_ctaphid = {
+        .name = "ctaphid",
+        .open = ctaphid_open,
+        .send = ctaphid_send,
+        .receive = ctaphid_receive,
+        .poll = ctaphid_poll,
+        .close = ctaphid_close,
+};
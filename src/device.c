@@ -23,15 +23,24 @@
 #include "ccid.h"
 #include "command_id.h"
 #include "crc32.h"
+#include "device_hint.h"
+#include "discovery.h"
+#include "hid_hidraw.h"
+#include "hotplug.h"
 #include "min.h"
+#include "operations.h"
 #include "return_codes.h"
 #include "settings.h"
 #include "structs.h"
+#include "usb_context.h"
 #include "utils.h"
 #include <assert.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/param.h>
 #include <unistd.h>
 
 #define NITROKEY_USB_VID 0x20a0
@@ -77,36 +86,109 @@ const VidPid devices_ccid[] = {
 };
 
 const size_t devices_size = sizeof(devices) / sizeof(devices[0]);
+const size_t devices_ccid_size = sizeof(devices_ccid) / sizeof(devices_ccid[0]);
+
+// Default time to wait for a device to be connected, overridden with HOTP_VERIFICATION_WAIT_MS.
+// Matches the former 2 rounds of 500 ms attempts for each of the 3 HID models.
+static const uint32_t CONNECTION_WAIT_MS = 2 * 3 * 500;
+// Retry interval after the device arrival, until it can be opened
+static const int64_t CONNECTION_SETTLE_INTERVAL_MS = 10;
+// How long to retry after an arrival, before waiting for the next one
+static const int64_t CONNECTION_SETTLE_LIMIT_MS = 1000;
+// Longest accepted HOTP_VERIFICATION_WAIT_MS value
+static const long CONNECTION_WAIT_MAX_MS = 60 * 60 * 1000;
+// Retry interval when the hotplug notifications are not available
+static const int64_t CONNECTION_POLL_INTERVAL_MS = 500;
+
+typedef struct PollPolicy {
+    char name_short;
+    // Delay before the first receive attempt
+    uint32_t first_probe_ms;
+    // Limit of the exponentially growing interval between the receive attempts
+    uint32_t max_interval_ms;
+    // Schedule the first attempt using the response latency observed so far
+    bool learn_latency;
+} PollPolicy;
+
+static const PollPolicy poll_policies[] = {
+        // keep this 200ms for Nitrokey Storage, to stabilize its responses (otherwise it sometimes returns with no data)
+        {'S', 200, 200, false},
+        {'P', 1, 64, true},
+        {'L', 1, 64, true},
+};
+static const PollPolicy default_poll_policy = {0, 200, 200, false};
+// Same as the former limit of 40 attempts, 200ms each
+static const int64_t RECEIVE_DEADLINE_MS = 8000;
+
+static const PollPolicy *get_poll_policy(const struct Device *dev) {
+    for (size_t i = 0; i < sizeof(poll_policies) / sizeof(poll_policies[0]); ++i) {
+        if (poll_policies[i].name_short == dev->dev_info.name_short) {
+            return &poll_policies[i];
+        }
+    }
+    return &default_poll_policy;
+}
 
-static const int CONNECTION_ATTEMPTS_COUNT = 2;
+static uint32_t first_probe_delay_ms(const struct Device *dev, const PollPolicy *policy) {
+    if (!policy->learn_latency || dev->timings.learned_latency_ms == 0) {
+        return policy->first_probe_ms;
+    }
+    return MAX(policy->first_probe_ms, MIN(dev->timings.learned_latency_ms, policy->max_interval_ms));
+}
 
-static const int CONNECTION_ATTEMPT_DELAY_MICRO_SECONDS = 1000 * 1000 / 2;
+static void learn_latency(struct Device *dev, uint32_t latency_ms) {
+    uint32_t *learned = &dev->timings.learned_latency_ms;
+    // Follow the faster responses immediately, and the slower ones gradually
+    if (*learned == 0 || latency_ms < *learned) {
+        *learned = latency_ms;
+    } else {
+        *learned = (3 * *learned + latency_ms) / 4;
+    }
+}
 
 int device_receive(struct Device *dev, uint8_t *out_data, size_t out_buffer_size) {
-    const int receive_attempts = 40;
-    int i;
-    int receive_status = 0;
-    for (i = 0; i < receive_attempts; ++i) {
+    rassert(dev->transport != nullptr);
+    const PollPolicy *policy = get_poll_policy(dev);
+    uint32_t interval_ms = first_probe_delay_ms(dev, policy);
+    const int64_t start = micros();
+    const int64_t deadline = start + RECEIVE_DEADLINE_MS * 1000;
+    bool received = false;
+    while (true) {
 #ifdef _DEBUG
         fprintf(stderr, ".");
         fflush(stderr);
 #endif
-        // keep this 200ms for Nitrokey Storage, to stabilize its responses (otherwise it sometimes returns with no data)
-        usleep(200 * 1000);
-
-        receive_status = (hid_get_feature_report(dev->mp_devhandle, dev->packet_response.as_data, HID_REPORT_SIZE_CONST));
-        if (receive_status != (int) HID_REPORT_SIZE_CONST) continue;
-        dump((dev->packet_response.as_data + 1), receive_status - 1);
-        const bool valid_response_crc = stm_crc32(dev->packet_response.as_data + 1, HID_REPORT_SIZE_CONST - 5) == dev->packet_response.response_st.crc;
-        const bool valid_query_crc = dev->packet_query.crc == dev->packet_response.response_st.last_command_crc;
-        if (valid_response_crc && valid_query_crc && dev->packet_response.response_st.device_status == 0) {
+        const int64_t poll_start = micros();
+        dev->transport->poll(dev, interval_ms);
+        dev->timings.poll_wait_us += micros() - poll_start;
+        dev->timings.probes++;
+
+        size_t receive_length = 0;
+        const int receive_status = dev->transport->receive(dev, dev->packet_response.as_data, HID_REPORT_SIZE_CONST, &receive_length);
+        if (receive_status == RET_NO_ERROR && receive_length == HID_REPORT_SIZE_CONST) {
+            dump((dev->packet_response.as_data + 1), receive_length - 1);
+            const bool valid_response_crc = stm_crc32(dev->packet_response.as_data + 1, HID_REPORT_SIZE_CONST - 5) == dev->packet_response.response_st.crc;
+            const bool valid_query_crc = dev->packet_query.crc == dev->packet_response.response_st.last_command_crc;
+            if (valid_response_crc && valid_query_crc && dev->packet_response.response_st.device_status == 0) {
+                received = true;
+                break;
+            }
+        }
+        if (micros() >= deadline) {
             break;
         }
+        interval_ms = MIN(interval_ms * 2, policy->max_interval_ms);
     }
-    if (i >= receive_attempts - 1) {
+    if (!received) {
         printf("WARN %s:%d: could not receive the data from the device.\n", "device.c", __LINE__);
         return RET_CONNECTION_LOST;
     }
+    const int64_t latency_us = micros() - start;
+    dev->timings.responses++;
+    dev->timings.response_wait_us += latency_us;
+    if (policy->learn_latency) {
+        learn_latency(dev, (uint32_t) (latency_us / 1000));
+    }
 
     if (out_data != nullptr) {
         rassert(out_buffer_size != 0);
@@ -123,6 +205,7 @@ int device_receive(struct Device *dev, uint8_t *out_data, size_t out_buffer_size
 }
 
 int device_send(struct Device *dev, uint8_t *in_data, size_t data_size, uint8_t command_ID) {
+    rassert(dev->transport != nullptr);
     device_clear_buffers(dev);
 
     dev->packet_query.command_id = command_ID;
@@ -140,9 +223,10 @@ int device_send(struct Device *dev, uint8_t *in_data, size_t data_size, uint8_t
 
     dev->packet_query.crc = stm_crc32(dev->packet_query.as_data + 1, HID_REPORT_SIZE_CONST - 5);
     dump((dev->packet_query.as_data + 1), HID_REPORT_SIZE_CONST - 1);
-    int send_status = hid_send_feature_report(dev->mp_devhandle, dev->packet_query.as_data, HID_REPORT_SIZE_CONST);
+    device_mark_first_send(dev);
+    int send_status = dev->transport->send(dev, dev->packet_query.as_data, HID_REPORT_SIZE_CONST);
 
-    if (send_status != (int) HID_REPORT_SIZE_CONST) {
+    if (send_status != RET_NO_ERROR) {
         printf("WARN %s:%d: could not send the data to the device.\n", "device.c", __LINE__);
         return RET_CONNECTION_LOST;
     }
@@ -150,94 +234,305 @@ int device_send(struct Device *dev, uint8_t *in_data, size_t data_size, uint8_t
     return RET_NO_ERROR;
 }
 
-int device_connect_hid(struct Device *dev);
+int device_connect_transport(struct Device *dev, const Transport *transport) {
+    rassert(transport != nullptr);
+    // Abort if device seem to be initialized
+    rassert(dev->transport == nullptr);
 
-int device_connect_ccid(struct Device *dev) {
-    dev->ctx_ccid = NULL;
-    int r = libusb_init(&dev->ctx_ccid);
-    if (r < 0) {
-        printf("Error initializing libusb: %s\n", libusb_strerror(r));
-        return RET_COMM_ERROR;
+    dev->transport = transport;
+    dev->timings.discovered_us = micros();
+    int r = transport->open(dev);
+    if (r != RET_NO_ERROR) {
+        dev->transport = nullptr;
+        dev->connection_type = CONNECTION_UNKNOWN;
+        return r;
     }
-    dev->mp_devhandle_ccid = get_device(dev->ctx_ccid, devices_ccid, 1);
-    if (dev->mp_devhandle_ccid == NULL) {
-        return RET_COMM_ERROR;
+    dev->timings.opened_us = micros();
+    if (dev->connection_type == CONNECTION_CCID) {
+        ccid_init(dev);
     }
-    ccid_init(dev->mp_devhandle_ccid);
-
     return RET_NO_ERROR;
 }
-int device_connect(struct Device *dev) {
-    int r = device_connect_hid(dev);
-    if (r == RET_NO_ERROR) {
-        dev->connection_type = CONNECTION_HID;
-        fprintf(stderr, "\n");
-        fflush(stderr);
-        return r;
+
+static uint32_t connection_wait_ms(void) {
+    const char *value = getenv("HOTP_VERIFICATION_WAIT_MS");
+    if (value == nullptr || value[0] == 0) {
+        return CONNECTION_WAIT_MS;
     }
+    const long wait_ms = strtol10_s(value);
+    if (!validate_number(value) || wait_ms > CONNECTION_WAIT_MAX_MS) {
+        fprintf(stderr, "Invalid HOTP_VERIFICATION_WAIT_MS value, expected milliseconds up to %ld. Using %" PRIu32 " ms.\n",
+                CONNECTION_WAIT_MAX_MS, CONNECTION_WAIT_MS);
+        return CONNECTION_WAIT_MS;
+    }
+    return (uint32_t) wait_ms;
+}
 
+static const Transport *device_transport_for(const struct Device *dev) {
+#ifdef FEATURE_USE_CTAPHID
+    if (dev->usb_ctaphid) {
+        return &transport_ctaphid;
+    }
+#endif
 #ifdef FEATURE_USE_CCID
-    fflush(stderr);
-    fprintf(stderr, ".");
-    r = device_connect_ccid(dev);
-    if (r == RET_NO_ERROR) {
-        dev->connection_type = CONNECTION_CCID;
-        fprintf(stderr, "\n");
-        fflush(stderr);
+    if (dev->connection_type == CONNECTION_CCID) {
+#ifdef FEATURE_CCID_ASYNC_TRANSFERS
+        return &transport_ccid_async;
+#else
+        return &transport_ccid;
+#endif
+    }
+#endif
+#ifdef FEATURE_HID_LIBUSB
+    return &transport_hid_libusb;
+#else
+    return &transport_hid;
+#endif
+}
+
+#ifdef FEATURE_DEVICE_HINT_CACHE
+static int device_connect_hinted(struct Device *dev) {
+    DeviceHint hint;
+    int r = device_hint_load(&hint);
+    if (r != RET_NO_ERROR) {
+        return r;
+    }
+#ifdef FEATURE_HID_HIDRAW
+    if (hint.connection_type == CONNECTION_HID) {
+        // opening through libusb would detach the kernel driver serving hidraw
+        return RET_COMM_ERROR;
+    }
+#endif
+    r = discover_device_at(dev, hint.vid, hint.pid, (ConnectionType) hint.connection_type, &hint.location);
+    if (r != RET_NO_ERROR) {
+        LOG("Hinted device not found, running full discovery\n");
+        return r;
+    }
+    r = device_connect_transport(dev, device_transport_for(dev));
+    if (r != RET_NO_ERROR) {
         return r;
     }
+    dev->timings.learned_latency_ms = hint.learned_latency_ms;
+    return RET_NO_ERROR;
+}
+#endif
+
+static int device_connect_discovered(struct Device *dev) {
+#ifdef FEATURE_HID_HIDRAW
+    // the HID devices are reached through their kernel driver, without the USB enumeration
+    if (hidraw_discover(dev) == RET_NO_ERROR) {
+        return device_connect_transport(dev, &transport_hid_hidraw);
+    }
+#endif
+#ifdef FEATURE_USE_PCSC
+    // a card shared through pcscd is used before claiming the USB interface directly
+    if (device_connect_transport(dev, &transport_pcsc) == RET_NO_ERROR) {
+        return RET_NO_ERROR;
+    }
+#endif
+#ifdef FEATURE_DEVICE_HINT_CACHE
+    if (device_connect_hinted(dev) == RET_NO_ERROR) {
+        return RET_NO_ERROR;
+    }
+#endif
+    // a single bus enumeration covers both the HID and CCID device tables
+    if (discover_device(dev, CONNECTION_UNKNOWN) != RET_NO_ERROR) {
+        return RET_COMM_ERROR;
+    }
+    const bool found_hid = dev->connection_type == CONNECTION_HID;
+    int r = device_connect_transport(dev, device_transport_for(dev));
+#ifdef FEATURE_USE_CCID
+    if (r != RET_NO_ERROR && found_hid) {
+        // the HID device could not be opened, e.g. without the permissions, fall back to a CCID one
+        LOG("Could not open the HID device, looking for a CCID one\n");
+        if (discover_device(dev, CONNECTION_CCID) == RET_NO_ERROR) {
+            r = device_connect_transport(dev, device_transport_for(dev));
+        }
+    }
+#else
+    unused(found_hid);
 #endif
+    return r;
+}
+
+int device_connect_once(struct Device *dev) {
+    dev->timings.connect_start_us = micros();
+    return device_connect_discovered(dev);
+}
+
+int device_connect(struct Device *dev) {
+    dev->timings.connect_start_us = micros();
+    const int64_t deadline_us = dev->timings.connect_start_us + (int64_t) connection_wait_ms() * 1000;
+    HotplugWaiter waiter = {0};
+    bool hotplug_tried = false;
+    int64_t arrival_us = 0;
+    bool waiting = false;
+    int r = RET_COMM_ERROR;
+    while (true) {
+        if (device_connect_discovered(dev) == RET_NO_ERROR) {
+            r = RET_NO_ERROR;
+            break;
+        }
+        const int64_t now_us = micros();
+        const int64_t remaining_ms = (deadline_us - now_us) / 1000;
+        if (remaining_ms <= 0) {
+            break;
+        }
+        fprintf(stderr, waiting ? "." : "Trying to connect to device: ");
+        fflush(stderr);
+        waiting = true;
+        if (!hotplug_tried) {
+            hotplug_tried = true;
+            if (hotplug_waiter_start(&waiter) == RET_NO_ERROR) {
+                // the devices connected before the registration are not reported, the next discovery finds them
+                continue;
+            }
+        }
+        if (arrival_us != 0 && now_us - arrival_us < CONNECTION_SETTLE_LIMIT_MS * 1000) {
+            // the device was seen arriving, but its drivers might not be ready yet
+            usleep(MIN(remaining_ms, CONNECTION_SETTLE_INTERVAL_MS) * 1000);
+            continue;
+        }
+        arrival_us = 0;
+        if (!waiter.registered) {
+            // no hotplug notifications on this platform
+            usleep(MIN(remaining_ms, CONNECTION_POLL_INTERVAL_MS) * 1000);
+            continue;
+        }
+        const int w = hotplug_waiter_wait(&waiter, (uint32_t) remaining_ms);
+        if (w == RET_NO_ERROR) {
+            arrival_us = micros();
+        } else if (w == RET_COMM_ERROR) {
+            hotplug_waiter_stop(&waiter);
+        }
+    }
+    hotplug_waiter_stop(&waiter);
 
     fprintf(stderr, "\n");
-    return RET_COMM_ERROR;
+    fflush(stderr);
+    return r;
+}
+
+void device_yield(struct Device *dev) {
+    if (dev->yield != nullptr) {
+        dev->yield(dev->yield_context);
+    }
 }
 
-int device_connect_hid(struct Device *dev) {
-    int count = CONNECTION_ATTEMPTS_COUNT;
+int device_disconnect(struct Device *dev) {
+    if (dev->transport == nullptr) return RET_UNKNOWN_DEVICE;
+#ifdef FEATURE_DEVICE_HINT_CACHE
+    device_hint_store(dev);
+#endif
+    int r = dev->transport->close(dev);
+    if (r != RET_NO_ERROR) return r;
+    dev->transport = nullptr;
+    device_clear_buffers(dev);
+    dev->connection_type = CONNECTION_UNKNOWN;
+    memset(&dev->location, 0, sizeof dev->location);
+    dev->verify_command.length = 0;
+    return RET_NO_ERROR;
+}
 
+static int hid_transport_open(struct Device *dev) {
     // Abort if device seem to be initialized
     rassert(dev->mp_devhandle == nullptr);
 
-    while (count-- > 0) {
-        for (size_t dev_id = 0; dev_id < devices_size; ++dev_id) {
-            const VidPid vidPid = devices[dev_id];
-            dev->mp_devhandle = hid_open(vidPid.vid, vidPid.pid, nullptr);
-            if (dev->mp_devhandle != nullptr) {
-                dev->dev_info = vidPid;
-                return RET_NO_ERROR;
-            }
-            usleep(CONNECTION_ATTEMPT_DELAY_MICRO_SECONDS);
+    if (dev->dev_info.vid != 0) {
+        // open the model found by the device discovery directly
+        dev->mp_devhandle = hid_open(dev->dev_info.vid, dev->dev_info.pid, nullptr);
+        if (dev->mp_devhandle == nullptr) {
+            return RET_COMM_ERROR;
         }
-        if (count == CONNECTION_ATTEMPTS_COUNT)
-            fprintf(stderr, "Trying to connect to device: ");
-        else
-            fprintf(stderr, ".");
-        fflush(stderr);
+        dev->connection_type = CONNECTION_HID;
+        return RET_NO_ERROR;
     }
 
+    for (size_t dev_id = 0; dev_id < devices_size; ++dev_id) {
+        const VidPid vidPid = devices[dev_id];
+        dev->mp_devhandle = hid_open(vidPid.vid, vidPid.pid, nullptr);
+        if (dev->mp_devhandle != nullptr) {
+            dev->dev_info = vidPid;
+            dev->connection_type = CONNECTION_HID;
+            return RET_NO_ERROR;
+        }
+    }
     return RET_COMM_ERROR;
 }
 
-int device_disconnect(struct Device *dev) {
-    if (dev->connection_type == CONNECTION_CCID) {
-        if (dev->mp_devhandle_ccid == nullptr) return 1;//TODO name error value
-        libusb_release_interface(dev->mp_devhandle_ccid, 0);
-        libusb_close(dev->mp_devhandle_ccid);
-        libusb_exit(dev->ctx_ccid);
-        dev->mp_devhandle_ccid = nullptr;
-        device_clear_buffers(dev);
-        dev->connection_type = CONNECTION_UNKNOWN;
-        return RET_NO_ERROR;
-    } else if (dev->connection_type == CONNECTION_HID) {
-        if (dev->mp_devhandle == nullptr) return 1;//TODO name error value
-        hid_close(dev->mp_devhandle);
-        hid_exit();
-        dev->mp_devhandle = nullptr;
-        device_clear_buffers(dev);
-        dev->connection_type = CONNECTION_UNKNOWN;
-        return RET_NO_ERROR;
+static int hid_transport_send(struct Device *dev, const uint8_t *data, size_t length) {
+    const int send_status = hid_send_feature_report(dev->mp_devhandle, data, length);
+    return send_status == (int) length ? RET_NO_ERROR : RET_CONNECTION_LOST;
+}
+
+static int hid_transport_receive(struct Device *dev, uint8_t *data, size_t length, size_t *actual_length) {
+    // the first byte holds the report ID
+    data[0] = 0;
+    const int receive_status = hid_get_feature_report(dev->mp_devhandle, data, length);
+    if (receive_status < 0) {
+        return RET_CONNECTION_LOST;
+    }
+    *actual_length = (size_t) receive_status;
+    return RET_NO_ERROR;
+}
+
+static int hid_transport_poll(struct Device *dev, uint32_t timeout_ms) {
+    unused(dev);
+    usleep(timeout_ms * 1000);
+    return RET_NO_ERROR;
+}
+
+static int hid_transport_close(struct Device *dev) {
+    if (dev->mp_devhandle == nullptr) return RET_UNKNOWN_DEVICE;
+    hid_close(dev->mp_devhandle);
+    hid_exit();
+    dev->mp_devhandle = nullptr;
+    return RET_NO_ERROR;
+}
+
+const Transport transport_hid = {
+        .name = "hid",
+        .open = hid_transport_open,
+        .send = hid_transport_send,
+        .receive = hid_transport_receive,
+        .poll = hid_transport_poll,
+        .close = hid_transport_close,
+};
+
+void device_mark_first_send(struct Device *dev) {
+    if (dev->timings.first_send_us == 0) {
+        dev->timings.first_send_us = micros();
+    }
+}
+
+void device_print_timings(const struct Device *dev) {
+    const DeviceTimings *t = &dev->timings;
+    fprintf(stderr, "Timings: %u responses, %u receive attempts, %u time extensions, %u stale frames, %" PRId64 " ms polling, %" PRId64 " ms waiting for responses",
+            t->responses, t->probes, t->time_extensions, t->stale_frames, t->poll_wait_us / 1000, t->response_wait_us / 1000);
+    if (t->responses > 0) {
+        fprintf(stderr, " (%" PRId64 " us and %.2f wasted wake-ups per response)", t->response_wait_us / t->responses,
+                (double) (t->probes - t->responses) / t->responses);
+    }
+    fprintf(stderr, "\n");
+
+    if (t->first_send_us == 0 || t->connect_start_us == 0) {
+        return;
+    }
+    // libusb is initialized lazily during the discovery, its share is reported apart
+    const int64_t usb_init_us = usb_context_init_time_us();
+    const int64_t start_us = t->process_start_us != 0 ? t->process_start_us : t->main_us;
+    fprintf(stderr, "Startup: ");
+    if (t->process_start_us != 0) {
+        fprintf(stderr, "%.1f ms exec to main (%" PRId64 " ms resolution), ",
+                (t->main_us - t->process_start_us) / 1000.0, process_start_resolution_us() / 1000);
     }
-    return RET_UNKNOWN_DEVICE;
+    fprintf(stderr, "%.1f ms libusb init, %.1f ms discovery, %.1f ms transport open, %.1f ms to the first frame",
+            usb_init_us / 1000.0, (t->discovered_us - t->connect_start_us - usb_init_us) / 1000.0,
+            (t->opened_us - t->discovered_us) / 1000.0, (t->first_send_us - t->opened_us) / 1000.0);
+    if (start_us != 0) {
+        fprintf(stderr, ", %.1f ms total", (t->first_send_us - start_us) / 1000.0);
+    }
+    fprintf(stderr, "\n");
 }
 
 static void device_clear_buffers(struct Device *dev) {
@@ -268,7 +563,7 @@ int device_get_status(struct Device *dev, struct ResponseStatus *out_status) {
         int counter = 0;
         uint32_t serial = 0;
         uint16_t version = 0;
-        int res = status_ccid(dev->mp_devhandle_ccid,
+        int res = status_ccid(dev,
                               &counter,
                               &version,
                               &serial);
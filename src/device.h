@@ -24,8 +24,10 @@
 
 #include "settings.h"
 #include "structs.h"
+#include "transport.h"
 #include <hidapi/hidapi.h>
 #include <libusb.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -52,12 +54,65 @@ typedef struct VidPid {
     char name_short;
 } VidPid;
 
+typedef struct DeviceLocation {
+    uint8_t bus;
+    // Count of the valid entries in ports
+    uint8_t ports_count;
+    // Port numbers on the path from the root hub, as reported by libusb_get_port_numbers
+    uint8_t ports[7];
+} DeviceLocation;
+
+typedef struct DeviceTimings {
+    // Count of the valid responses received
+    uint32_t responses;
+    // Count of the receive attempts, including the ones returning busy or stale responses
+    uint32_t probes;
+    // Count of the CCID time extension frames received
+    uint32_t time_extensions;
+    // Count of the CCID frames dropped for not matching the sequence number of the request
+    uint32_t stale_frames;
+    // Time spent waiting in the transport poll
+    int64_t poll_wait_us;
+    // Time from the start of polling to the valid response, summed over all responses
+    int64_t response_wait_us;
+    // Response latency estimate, used to schedule the first probe of the next command
+    uint32_t learned_latency_ms;
+    // Startup milestones on the micros() clock, 0 when not reached: process start, entering main(),
+    // start of device_connect(), device found, transport opened, first frame sent
+    int64_t process_start_us;
+    int64_t main_us;
+    int64_t connect_start_us;
+    int64_t discovered_us;
+    int64_t opened_us;
+    int64_t first_send_us;
+} DeviceTimings;
+
+// Command frame encoded once, and sent repeatedly with only its 4 bytes value and sequence number patched
+typedef struct PreparedCommand {
+    uint8_t frame[SMALL_CCID_BUFFER_SIZE];
+    uint32_t length;
+    // Offset of the patched value in the frame
+    uint32_t value_offset;
+} PreparedCommand;
+
 struct Device {
+    const Transport *transport;
+    // Transport specific state, for the transports not listed below
+    void *transport_state;
     hid_device *mp_devhandle;
-    libusb_device_handle *mp_devhandle_ccid;
-    libusb_context *ctx_ccid;
+    // libusb handle and context, shared by the CCID and the libusb HID transports
+    libusb_device_handle *mp_devhandle_usb;
+    libusb_context *ctx_usb;
+    // Number of the interface claimed on mp_devhandle_usb
+    uint8_t usb_interface;
+    // The claimed interface is the CTAPHID one of a CCID device
+    bool usb_ctaphid;
+    // Opened hidraw node, -1 when not used. Set by hidraw_discover(), which runs before any hidraw use
+    int hidraw_fd;
     ConnectionType connection_type;
     VidPid dev_info;
+    // Sequence number of the last CCID frame sent
+    uint8_t ccid_seq;
     union {
         struct DeviceQuery packet_query;
         uint8_t ccid_buffer_out[MAX_CCID_BUFFER_SIZE];
@@ -68,9 +123,26 @@ struct Device {
     } __packed;
     uint8_t user_temporary_password[TEMPORARY_PASSWORD_LENGTH];
     uint8_t admin_temporary_password[TEMPORARY_PASSWORD_LENGTH];
+    DeviceTimings timings;
+    // USB location of the device found by the discovery, all zeros for the other connections
+    DeviceLocation location;
+    // HOTP verification command, encoded by the first verify_code_ccid call of the connection
+    PreparedCommand verify_command;
+    // Called at each step of the long operations polling the device (busy device, touch wait), to let
+    // the caller do other work meanwhile. Optional.
+    void (*yield)(void *yield_context);
+    void *yield_context;
 };
 
+extern const VidPid devices[];
+extern const size_t devices_size;
+extern const VidPid devices_ccid[];
+extern const size_t devices_ccid_size;
+
 int device_connect(struct Device *dev);
+// Single connection attempt, not waiting for the device to appear
+int device_connect_once(struct Device *dev);
+int device_connect_transport(struct Device *dev, const Transport *transport);
 int device_disconnect(struct Device *dev);
 int device_get_status(struct Device *dev, struct ResponseStatus *out_status);
 int device_send(struct Device *dev, uint8_t *in_data, size_t data_size, uint8_t command_ID);
@@ -78,6 +150,12 @@ int device_receive(struct Device *dev, uint8_t *out_data, size_t out_buffer_size
 int device_send_buf(struct Device *dev, uint8_t command_ID);
 int device_receive_buf(struct Device *dev);
 const char *command_status_to_string(uint8_t status_code);
+// Record the time of the first frame sent, for the startup breakdown
+void device_mark_first_send(struct Device *dev);
+// Let the caller run its work between the polling steps of a long operation
+void device_yield(struct Device *dev);
+// Print the response polling statistics and the startup breakdown to stderr
+void device_print_timings(const struct Device *dev);
 
 
 void clean_buffers(struct Device *dev);
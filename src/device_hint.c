@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "device_hint.h"
+#include "return_codes.h"
+#include "utils.h"
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define HINT_FILE_NAME "nitrokey_hotp_verification.hint"
+static const char HINT_MAGIC[8] = "HOTPHNT1";
+
+// Change of the learned latency worth a rewrite of the hint, in percent and at least in milliseconds
+static const uint32_t HINT_LATENCY_CHANGE_PERCENT = 25;
+static const uint32_t HINT_LATENCY_CHANGE_MIN_MS = 2;
+
+typedef struct HintFile {
+    char magic[8];
+    uint32_t size;
+    DeviceHint hint;
+} HintFile;
+
+static bool hint_path(char *path, size_t path_size) {
+    const char *file = getenv("HOTP_VERIFICATION_HINT_FILE");
+    if (file != nullptr) {
+        if (file[0] == 0) {
+            return false;
+        }
+        return (size_t) snprintf(path, path_size, "%s", file) < path_size;
+    }
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    if (dir == nullptr || dir[0] == 0) {
+        dir = "/run";
+    }
+    return (size_t) snprintf(path, path_size, "%s/%s", dir, HINT_FILE_NAME) < path_size;
+}
+
+int device_hint_load(DeviceHint *hint) {
+    char path[4096];
+    if (!hint_path(path, sizeof path)) {
+        return RET_COMM_ERROR;
+    }
+    FILE *f = fopen(path, "rb");
+    if (f == nullptr) {
+        return RET_COMM_ERROR;
+    }
+    HintFile file;
+    const bool ok = fread(&file, sizeof file, 1, f) == 1 &&
+                    memcmp(file.magic, HINT_MAGIC, sizeof HINT_MAGIC) == 0 &&
+                    file.size == sizeof file;
+    fclose(f);
+    if (!ok) {
+        return RET_COMM_ERROR;
+    }
+    *hint = file.hint;
+    return RET_NO_ERROR;
+}
+
+static bool latency_changed(uint32_t stored_ms, uint32_t learned_ms) {
+    const uint32_t difference = stored_ms > learned_ms ? stored_ms - learned_ms : learned_ms - stored_ms;
+    return difference >= HINT_LATENCY_CHANGE_MIN_MS && difference * 100 >= stored_ms * HINT_LATENCY_CHANGE_PERCENT;
+}
+
+void device_hint_store(const struct Device *dev) {
+    if (dev->location.bus == 0) {
+        return;
+    }
+    HintFile file;
+    memset(&file, 0, sizeof file);
+    memcpy(file.magic, HINT_MAGIC, sizeof HINT_MAGIC);
+    file.size = sizeof file;
+    file.hint.vid = dev->dev_info.vid;
+    file.hint.pid = dev->dev_info.pid;
+    file.hint.connection_type = (uint8_t) dev->connection_type;
+    file.hint.location = dev->location;
+    file.hint.learned_latency_ms = dev->timings.learned_latency_ms;
+
+    DeviceHint stored;
+    if (device_hint_load(&stored) == RET_NO_ERROR && stored.vid == file.hint.vid && stored.pid == file.hint.pid &&
+        stored.connection_type == file.hint.connection_type &&
+        memcmp(&stored.location, &file.hint.location, sizeof stored.location) == 0 &&
+        !latency_changed(stored.learned_latency_ms, file.hint.learned_latency_ms)) {
+        // the learned latency varies slightly on every run, which is not worth a rewrite
+        return;
+    }
+
+    char path[4096];
+    char temporary_path[4096 + 8];
+    if (!hint_path(path, sizeof path)) {
+        return;
+    }
+    snprintf(temporary_path, sizeof temporary_path, "%s.%d", path, (int) getpid());
+    // a file left by a crashed process with the same pid is removed; a symlink planted there is not followed
+    unlink(temporary_path);
+    const int fd = open(temporary_path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        LOG("Cannot write device hint to %s\n", temporary_path);
+        return;
+    }
+    const bool ok = write(fd, &file, sizeof file) == (ssize_t) sizeof file;
+    if (close(fd) != 0 || !ok || rename(temporary_path, path) != 0) {
+        LOG("Cannot write device hint to %s\n", path);
+        unlink(temporary_path);
+    }
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#ifndef NITROKEY_HOTP_VERIFICATION_DEVICE_HINT_H
+#define NITROKEY_HOTP_VERIFICATION_DEVICE_HINT_H
+
+#include "device.h"
+#include <stdint.h>
+
+/**
+ * Record of the last successfully connected device, kept in a runtime directory between the invocations.
+ * The file location is taken from the HOTP_VERIFICATION_HINT_FILE environment variable (empty value disables
+ * the cache), otherwise it is placed in $XDG_RUNTIME_DIR, or in /run.
+ */
+typedef struct DeviceHint {
+    uint16_t vid;
+    uint16_t pid;
+    uint8_t connection_type;
+    DeviceLocation location;
+    // latency observed on the last use of the device
+    uint32_t learned_latency_ms;
+} DeviceHint;
+
+/**
+ * Read the hint file.
+ * @return RET_NO_ERROR if a valid hint was read
+ */
+int device_hint_load(DeviceHint *hint);
+
+/**
+ * Write the hint describing the connected device, unless the stored one has the same model and location already,
+ * and a learned latency within 25% of the current one.
+ * Does nothing for the devices not connected through the USB discovery. Errors are ignored.
+ */
+void device_hint_store(const struct Device *dev);
+
+#endif//NITROKEY_HOTP_VERIFICATION_DEVICE_HINT_H
@@ -0,0 +1,294 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "discovery.h"
+#include "ccid.h"
+#include "hid_libusb.h"
+#include "return_codes.h"
+#include "settings.h"
+#include "usb_context.h"
+#include "utils.h"
+#include <libusb.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const VidPid *find_vid_pid(const VidPid table[], size_t table_size, const struct libusb_device_descriptor *desc) {
+    for (size_t i = 0; i < table_size; ++i) {
+        if (table[i].vid == desc->idVendor && table[i].pid == desc->idProduct) {
+            return &table[i];
+        }
+    }
+    return nullptr;
+}
+
+const VidPid *discovery_find_model(uint16_t vid, uint16_t pid, ConnectionType *connection_type) {
+    const struct libusb_device_descriptor desc = {.idVendor = vid, .idProduct = pid};
+    const VidPid *model = find_vid_pid(devices, devices_size, &desc);
+    if (model != nullptr) {
+        *connection_type = CONNECTION_HID;
+        return model;
+    }
+#ifdef FEATURE_USE_CCID
+    model = find_vid_pid(devices_ccid, devices_ccid_size, &desc);
+    if (model != nullptr) {
+        *connection_type = CONNECTION_CCID;
+        return model;
+    }
+#endif
+    return nullptr;
+}
+
+static bool find_interface(libusb_device *usb_dev, uint8_t interface_class, uint8_t *interface_number) {
+    *interface_number = 0;
+    struct libusb_config_descriptor *config = nullptr;
+    if (libusb_get_active_config_descriptor(usb_dev, &config) != LIBUSB_SUCCESS) {
+        // descriptor not available (e.g. device not configured yet) - rely on the VID/PID match only
+        return true;
+    }
+    bool found = false;
+    for (int i = 0; i < config->bNumInterfaces && !found; ++i) {
+        const struct libusb_interface *interface = &config->interface[i];
+        for (int a = 0; a < interface->num_altsetting; ++a) {
+            if (interface->altsetting[a].bInterfaceClass == interface_class) {
+                *interface_number = interface->altsetting[a].bInterfaceNumber;
+                found = true;
+                break;
+            }
+        }
+    }
+    libusb_free_config_descriptor(config);
+    return found;
+}
+
+void discovery_read_location(libusb_device *usb_dev, DeviceLocation *location) {
+    memset(location, 0, sizeof *location);
+    location->bus = libusb_get_bus_number(usb_dev);
+    const int count = libusb_get_port_numbers(usb_dev, location->ports, sizeof location->ports);
+    location->ports_count = count > 0 ? (uint8_t) count : 0;
+}
+
+#ifdef FEATURE_USE_CTAPHID
+static bool ctaphid_preferred(void) {
+    const char *value = getenv("HOTP_VERIFICATION_CTAPHID");
+    return value != nullptr && strcmp(value, "1") == 0;
+}
+
+/**
+ * Claim the CCID interface, or the CTAPHID one when the former is held by another application
+ * (e.g. pcscd). The CTAPHID interface is not taken first, to keep it for the browsers' FIDO use.
+ */
+static int claim_ccid_or_ctaphid(struct Device *dev, libusb_device *usb_dev, libusb_device_handle *handle,
+                                 uint8_t *interface_number) {
+    if (!ctaphid_preferred() && ccid_claim_device(handle) == RET_NO_ERROR) {
+        *interface_number = 0;
+        return RET_NO_ERROR;
+    }
+    if (!find_interface(usb_dev, LIBUSB_CLASS_HID, interface_number)) {
+        return RET_COMM_ERROR;
+    }
+    const int r = hid_libusb_claim_device(handle, *interface_number);
+    if (r != RET_NO_ERROR) {
+        return r;
+    }
+    LOG("Using CTAPHID interface %d\n", *interface_number);
+    dev->usb_ctaphid = true;
+    return RET_NO_ERROR;
+}
+#endif
+
+static int open_usb(struct Device *dev, libusb_context *ctx, libusb_device *usb_dev, ConnectionType connection_type,
+                    uint8_t interface_number) {
+    libusb_device_handle *handle = nullptr;
+    int r = libusb_open(usb_dev, &handle);
+    if (r != LIBUSB_SUCCESS) {
+        LOG("Error opening device: %s\n", libusb_strerror(r));
+        return RET_COMM_ERROR;
+    }
+    if (connection_type == CONNECTION_CCID) {
+#ifdef FEATURE_USE_CTAPHID
+        r = claim_ccid_or_ctaphid(dev, usb_dev, handle, &interface_number);
+#else
+        r = ccid_claim_device(handle);
+#endif
+    } else {
+        r = hid_libusb_claim_device(handle, interface_number);
+    }
+    if (r != RET_NO_ERROR) {
+        libusb_close(handle);
+        return RET_COMM_ERROR;
+    }
+    dev->ctx_usb = ctx;
+    dev->mp_devhandle_usb = handle;
+    dev->usb_interface = interface_number;
+    return RET_NO_ERROR;
+}
+
+static bool opened_with_libusb(ConnectionType connection_type) {
+#ifdef FEATURE_HID_LIBUSB
+    if (connection_type == CONNECTION_HID) {
+        return true;
+    }
+#endif
+#ifdef FEATURE_USE_CCID
+    if (connection_type == CONNECTION_CCID) {
+        return true;
+    }
+#endif
+    return false;
+}
+
+static int use_device(struct Device *dev, libusb_context *ctx, libusb_device *usb_dev,
+                      const VidPid *vid_pid, ConnectionType connection_type, uint8_t interface_number) {
+    LOG("Found %s device: %s\n", connection_type == CONNECTION_CCID ? "CCID" : "HID", vid_pid->name);
+    if (opened_with_libusb(connection_type)) {
+        const int r = open_usb(dev, ctx, usb_dev, connection_type, interface_number);
+        if (r != RET_NO_ERROR) {
+            return r;
+        }
+    }
+    dev->dev_info = *vid_pid;
+    dev->connection_type = connection_type;
+    discovery_read_location(usb_dev, &dev->location);
+    return RET_NO_ERROR;
+}
+
+static int list_devices(libusb_context **ctx, libusb_device ***devs, ssize_t *count) {
+    *ctx = usb_context_get();
+    if (*ctx == nullptr) {
+        return RET_COMM_ERROR;
+    }
+    *count = libusb_get_device_list(*ctx, devs);
+    if (*count < 0) {
+        printf("Error getting device list: %s\n", libusb_strerror((int) *count));
+        return RET_COMM_ERROR;
+    }
+    return RET_NO_ERROR;
+}
+
+static void release_devices(libusb_device **devs) {
+    libusb_free_device_list(devs, 1);
+}
+
+int discover_device_at(struct Device *dev, uint16_t vid, uint16_t pid, ConnectionType connection_type,
+                       const DeviceLocation *location) {
+    const VidPid *table;
+    size_t table_size;
+    if (connection_type == CONNECTION_HID) {
+        table = devices;
+        table_size = devices_size;
+    }
+#ifdef FEATURE_USE_CCID
+    else if (connection_type == CONNECTION_CCID) {
+        table = devices_ccid;
+        table_size = devices_ccid_size;
+    }
+#endif
+    else {
+        return RET_COMM_ERROR;
+    }
+
+    libusb_context *ctx;
+    libusb_device **devs;
+    ssize_t count;
+    int r = list_devices(&ctx, &devs, &count);
+    if (r != RET_NO_ERROR) {
+        return r;
+    }
+
+    r = RET_COMM_ERROR;
+    for (ssize_t i = 0; i < count; ++i) {
+        DeviceLocation candidate;
+        discovery_read_location(devs[i], &candidate);
+        if (memcmp(&candidate, location, sizeof candidate) != 0) {
+            continue;
+        }
+        // only the device at the expected location is inspected
+        struct libusb_device_descriptor desc;
+        if (libusb_get_device_descriptor(devs[i], &desc) != LIBUSB_SUCCESS ||
+            desc.idVendor != vid || desc.idProduct != pid) {
+            break;
+        }
+        const VidPid *vid_pid = find_vid_pid(table, table_size, &desc);
+        uint8_t interface_number;
+        const uint8_t interface_class = connection_type == CONNECTION_CCID ? LIBUSB_CLASS_SMART_CARD : LIBUSB_CLASS_HID;
+        if (vid_pid != nullptr && find_interface(devs[i], interface_class, &interface_number)) {
+            r = use_device(dev, ctx, devs[i], vid_pid, connection_type, interface_number);
+        }
+        break;
+    }
+    release_devices(devs);
+    return r;
+}
+
+int discover_device(struct Device *dev, ConnectionType connection_type) {
+    libusb_context *ctx;
+    libusb_device **devs;
+    ssize_t count;
+    int r = list_devices(&ctx, &devs, &count);
+    if (r != RET_NO_ERROR) {
+        return r;
+    }
+
+    const VidPid *hid_match = nullptr;
+    libusb_device *hid_usb_dev = nullptr;
+    uint8_t hid_interface = 0;
+    const VidPid *ccid_match = nullptr;
+    libusb_device *ccid_usb_dev = nullptr;
+    uint8_t ccid_interface = 0;
+    // the first match of each kind is kept, as the fallback for the other
+    for (ssize_t i = 0; i < count && (hid_match == nullptr || ccid_match == nullptr); ++i) {
+        struct libusb_device_descriptor desc;
+        if (libusb_get_device_descriptor(devs[i], &desc) != LIBUSB_SUCCESS) {
+            continue;
+        }
+        const VidPid *vid_pid = find_vid_pid(devices, devices_size, &desc);
+        if (vid_pid != nullptr) {
+            if (hid_match == nullptr && connection_type != CONNECTION_CCID &&
+                find_interface(devs[i], LIBUSB_CLASS_HID, &hid_interface)) {
+                hid_match = vid_pid;
+                hid_usb_dev = devs[i];
+            }
+            continue;
+        }
+#ifdef FEATURE_USE_CCID
+        vid_pid = find_vid_pid(devices_ccid, devices_ccid_size, &desc);
+        if (vid_pid != nullptr && ccid_match == nullptr && find_interface(devs[i], LIBUSB_CLASS_SMART_CARD, &ccid_interface)) {
+            ccid_match = vid_pid;
+            ccid_usb_dev = devs[i];
+        }
+#endif
+    }
+
+    r = RET_COMM_ERROR;
+    if (hid_match != nullptr) {
+        r = use_device(dev, ctx, hid_usb_dev, hid_match, CONNECTION_HID, hid_interface);
+    }
+#ifdef FEATURE_USE_CCID
+    // e.g. the HID interface is busy, or not permitted
+    if (r != RET_NO_ERROR && ccid_match != nullptr) {
+        r = use_device(dev, ctx, ccid_usb_dev, ccid_match, CONNECTION_CCID, ccid_interface);
+    }
+#endif
+    release_devices(devs);
+    return r;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#ifndef NITROKEY_HOTP_VERIFICATION_DISCOVERY_H
+#define NITROKEY_HOTP_VERIFICATION_DISCOVERY_H
+
+#include "device.h"
+#include <libusb.h>
+
+/**
+ * Enumerate the USB bus once, and look up the connected devices in the devices[] and devices_ccid[] tables.
+ * The transport is chosen from the class of the interfaces listed in the configuration descriptor.
+ * On success dev->dev_info, dev->connection_type and dev->location describe the found device. The devices served
+ * through libusb (CCID, and HID with FEATURE_HID_LIBUSB) are additionally opened and claimed, and their libusb handle
+ * is left in dev for the transport to use.
+ * HID devices are preferred, when devices of both kinds are connected. The CCID device is used if the HID one
+ * could not be opened.
+ * @param connection_type CONNECTION_UNKNOWN for the devices of both kinds, or CONNECTION_CCID for the CCID ones only
+ * @return RET_NO_ERROR when a known device was found, RET_COMM_ERROR otherwise.
+ */
+int discover_device(struct Device *dev, ConnectionType connection_type);
+
+/**
+ * Use the device at the given USB location, if it is still the expected model.
+ * Only the device at that location is inspected. The results are stored as in discover_device().
+ * @return RET_NO_ERROR when the device was found, RET_COMM_ERROR otherwise.
+ */
+int discover_device_at(struct Device *dev, uint16_t vid, uint16_t pid, ConnectionType connection_type,
+                       const DeviceLocation *location);
+
+// Find the model with the given USB IDs in the devices[] and devices_ccid[] tables
+const VidPid *discovery_find_model(uint16_t vid, uint16_t pid, ConnectionType *connection_type);
+
+// Read the bus and port path of the USB device
+void discovery_read_location(libusb_device *usb_dev, DeviceLocation *location);
+
+#endif//NITROKEY_HOTP_VERIFICATION_DISCOVERY_H
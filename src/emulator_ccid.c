@@ -0,0 +1,450 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "emulator_ccid.h"
+#include "ccid.h"
+#include "device.h"
+#include "hotp.h"
+#include "return_codes.h"
+#include "settings.h"
+#include "utils.h"
+#include <string.h>
+#include <sys/param.h>
+#include <unistd.h>
+
+static const int VERIFICATION_WINDOW = 10;
+static const uint8_t PIN_ATTEMPT_COUNTER_DEFAULT = 8;
+static const uint8_t PROPERTY_TOUCH_REQUIRED = 0x02;
+
+static const uint8_t PC_TO_RDR_XFR_BLOCK = 0x6F;
+static const uint8_t RDR_TO_PC_DATA_BLOCK = 0x80;
+
+static const uint8_t SECRETS_APP_AID[] = {0xA0, 0x00, 0x00, 0x05, 0x27, 0x21, 0x01};
+
+enum {
+    SW_OK = 0x9000,
+    SW_VERIFICATION_FAILED = 0x6300,
+    SW_WRONG_LENGTH = 0x6700,
+    SW_SECURITY_STATUS_NOT_SATISFIED = 0x6982,
+    SW_OPERATION_BLOCKED = 0x6983,
+    SW_CONDITIONS_OF_USE_NOT_SATISFIED = 0x6985,
+    SW_INCORRECT_DATA = 0x6A80,
+    SW_NOT_FOUND = 0x6A82,
+    SW_NOT_ENOUGH_MEMORY = 0x6A84,
+    SW_INS_NOT_SUPPORTED = 0x6D00,
+};
+
+typedef struct Apdu {
+    uint8_t cls;
+    uint8_t ins;
+    uint8_t p1;
+    uint8_t p2;
+    const uint8_t *data;
+    size_t data_length;
+} Apdu;
+
+typedef struct EmulatorTlv {
+    const uint8_t *value;
+    size_t length;
+    bool present;
+} EmulatorTlv;
+
+static const EmulatorCcidConfig default_config = {
+        .touch_time_extensions = 3,
+};
+
+void emulator_ccid_init(EmulatorCcid *emu, const EmulatorCcidConfig *config) {
+    rassert(emu != nullptr);
+    memset(emu, 0, sizeof *emu);
+    emu->config = config != nullptr ? *config : default_config;
+    emu->serial = 0x1A2B3C4D;
+    emu->version[0] = 4;
+    emu->version[1] = 11;
+    emu->version[2] = 0;
+}
+
+static bool parse_apdu(const uint8_t *buf, size_t length, Apdu *apdu) {
+    if (length < 4) {
+        return false;
+    }
+    memset(apdu, 0, sizeof *apdu);
+    apdu->cls = buf[0];
+    apdu->ins = buf[1];
+    apdu->p1 = buf[2];
+    apdu->p2 = buf[3];
+    if (length <= 5) {
+        // No data, with optional Le only
+        return true;
+    }
+    size_t offset = 5;
+    size_t lc = buf[4];
+    if (lc == 0) {
+        // Extended length encoding
+        if (length < 7) {
+            return false;
+        }
+        lc = ((size_t) buf[5] << 8) | buf[6];
+        offset = 7;
+    }
+    if (offset + lc > length) {
+        return false;
+    }
+    apdu->data = buf + offset;
+    apdu->data_length = lc;
+    return true;
+}
+
+/**
+ * Find the tag in the Secrets App command data. Properties tag is an exception,
+ * as it is followed by its value directly, without the length byte.
+ */
+static EmulatorTlv find_tlv(const Apdu *apdu, uint8_t tag) {
+    EmulatorTlv tlv = {0};
+    size_t i = 0;
+    while (i + 1 < apdu->data_length) {
+        const uint8_t t = apdu->data[i++];
+        size_t length = 1;
+        if (t != Tag_Properties) {
+            length = apdu->data[i++];
+        }
+        if (i + length > apdu->data_length) {
+            break;
+        }
+        if (t == tag) {
+            tlv.value = apdu->data + i;
+            tlv.length = length;
+            tlv.present = true;
+            return tlv;
+        }
+        i += length;
+    }
+    return tlv;
+}
+
+static size_t put_tlv(uint8_t *buf, uint8_t tag, const uint8_t *value, uint8_t length) {
+    buf[0] = tag;
+    buf[1] = length;
+    memcpy(buf + 2, value, length);
+    return 2 + (size_t) length;
+}
+
+static uint32_t read_be32(const uint8_t *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static EmulatorCredential *find_credential(EmulatorCcid *emu, const EmulatorTlv *name) {
+    for (size_t i = 0; i < EMULATOR_CCID_CREDENTIALS_COUNT; ++i) {
+        EmulatorCredential *c = &emu->credentials[i];
+        if (c->present && c->name_length == name->length && memcmp(c->name, name->value, name->length) == 0) {
+            return c;
+        }
+    }
+    return nullptr;
+}
+
+static bool PIN_matches(const EmulatorCcid *emu, const EmulatorTlv *given) {
+    return given->length == strlen(emu->PIN) && memcmp(emu->PIN, given->value, given->length) == 0;
+}
+
+static uint16_t cmd_select(EmulatorCcid *emu, const Apdu *apdu, uint8_t *out, size_t *out_length) {
+    if (apdu->data_length != sizeof SECRETS_APP_AID || memcmp(apdu->data, SECRETS_APP_AID, sizeof SECRETS_APP_AID) != 0) {
+        emu->selected = false;
+        return SW_NOT_FOUND;
+    }
+    emu->selected = true;
+    emu->PIN_verified = false;
+
+    size_t i = 0;
+    i += put_tlv(out + i, Tag_Version, emu->version, sizeof emu->version);
+    if (emu->PIN_set) {
+        i += put_tlv(out + i, Tag_PINCounter, &emu->PIN_counter, 1);
+    }
+    const uint8_t serial[4] = {emu->serial >> 24, emu->serial >> 16, emu->serial >> 8, emu->serial};
+    i += put_tlv(out + i, Tag_SerialNumber, serial, sizeof serial);
+    if (emu->config.select_extra_length > 0) {
+        // TLV of an unknown tag, with the two bytes length
+        const uint16_t length = emu->config.select_extra_length;
+        out[i++] = EMULATOR_CCID_UNKNOWN_TAG;
+        out[i++] = 0x82;
+        out[i++] = length >> 8;
+        out[i++] = length & 0xFF;
+        memset(out + i, 0xA5, length);
+        i += length;
+    }
+    *out_length = i;
+    return SW_OK;
+}
+
+static uint16_t cmd_put(EmulatorCcid *emu, const Apdu *apdu) {
+    if (emu->PIN_set && !emu->PIN_verified) {
+        return SW_SECURITY_STATUS_NOT_SATISFIED;
+    }
+    const EmulatorTlv name = find_tlv(apdu, Tag_CredentialId);
+    const EmulatorTlv key = find_tlv(apdu, Tag_Key);
+    if (!name.present || !key.present || name.length == 0 || name.length > EMULATOR_CCID_NAME_SIZE ||
+        key.length < 2 || key.length - 2 > EMULATOR_CCID_SECRET_SIZE) {
+        return SW_INCORRECT_DATA;
+    }
+
+    EmulatorCredential *c = find_credential(emu, &name);
+    for (size_t i = 0; c == nullptr && i < EMULATOR_CCID_CREDENTIALS_COUNT; ++i) {
+        if (!emu->credentials[i].present) {
+            c = &emu->credentials[i];
+        }
+    }
+    if (c == nullptr) {
+        return SW_NOT_ENOUGH_MEMORY;
+    }
+
+    memset(c, 0, sizeof *c);
+    c->present = true;
+    memcpy(c->name, name.value, name.length);
+    c->name_length = (uint8_t) name.length;
+    c->kind = key.value[0] & 0xF0;
+    c->algorithm = key.value[0] & 0x0F;
+    c->digits = key.value[1];
+    c->secret_length = (uint8_t) (key.length - 2);
+    memcpy(c->secret, key.value + 2, c->secret_length);
+
+    const EmulatorTlv properties = find_tlv(apdu, Tag_Properties);
+    if (properties.present) {
+        c->properties = properties.value[0];
+    }
+    const EmulatorTlv counter = find_tlv(apdu, Tag_InitialCounter);
+    if (counter.present && counter.length == 4) {
+        c->counter = read_be32(counter.value);
+    }
+    return SW_OK;
+}
+
+static uint16_t cmd_verify_code(EmulatorCcid *emu, const Apdu *apdu) {
+    const EmulatorTlv name = find_tlv(apdu, Tag_CredentialId);
+    const EmulatorTlv response = find_tlv(apdu, Tag_Response);
+    if (!name.present || !response.present || response.length != 4) {
+        return SW_INCORRECT_DATA;
+    }
+    EmulatorCredential *c = find_credential(emu, &name);
+    if (c == nullptr) {
+        return SW_NOT_FOUND;
+    }
+    if (c->kind != Kind_HotpReverse || c->algorithm != Algo_Sha1) {
+        return SW_CONDITIONS_OF_USE_NOT_SATISFIED;
+    }
+    if (c->properties & PROPERTY_TOUCH_REQUIRED) {
+        emu->time_extensions_left += emu->config.touch_time_extensions;
+    }
+
+    const uint32_t code = read_be32(response.value);
+    for (int i = 0; i < VERIFICATION_WINDOW; ++i) {
+        if (hotp_code(c->secret, c->secret_length, c->counter + i, c->digits) == code) {
+            c->counter += i + 1;
+            return SW_OK;
+        }
+    }
+    return SW_VERIFICATION_FAILED;
+}
+
+static uint16_t cmd_verify_PIN(EmulatorCcid *emu, const Apdu *apdu) {
+    const EmulatorTlv password = find_tlv(apdu, Tag_Password);
+    if (!password.present) {
+        return SW_INCORRECT_DATA;
+    }
+    if (!emu->PIN_set) {
+        return SW_CONDITIONS_OF_USE_NOT_SATISFIED;
+    }
+    if (emu->PIN_counter == 0) {
+        return SW_OPERATION_BLOCKED;
+    }
+    if (!PIN_matches(emu, &password)) {
+        emu->PIN_counter--;
+        emu->PIN_verified = false;
+        return SW_VERIFICATION_FAILED;
+    }
+    emu->PIN_counter = PIN_ATTEMPT_COUNTER_DEFAULT;
+    emu->PIN_verified = true;
+    return SW_OK;
+}
+
+static uint16_t cmd_set_PIN(EmulatorCcid *emu, const Apdu *apdu) {
+    const EmulatorTlv password = find_tlv(apdu, Tag_Password);
+    if (!password.present || password.length == 0 || password.length > EMULATOR_CCID_PIN_SIZE) {
+        return SW_INCORRECT_DATA;
+    }
+    if (emu->PIN_set) {
+        return SW_SECURITY_STATUS_NOT_SATISFIED;
+    }
+    memcpy(emu->PIN, password.value, password.length);
+    emu->PIN[password.length] = 0;
+    emu->PIN_set = true;
+    emu->PIN_counter = PIN_ATTEMPT_COUNTER_DEFAULT;
+    return SW_OK;
+}
+
+static uint16_t cmd_get_response(EmulatorCcid *emu, uint8_t *out, size_t *out_length) {
+    if (emu->remaining_length == 0) {
+        return SW_CONDITIONS_OF_USE_NOT_SATISFIED;
+    }
+    memcpy(out, emu->remaining, emu->remaining_length);
+    *out_length = emu->remaining_length;
+    emu->remaining_length = 0;
+    return SW_OK;
+}
+
+static uint16_t process_apdu(EmulatorCcid *emu, const Apdu *apdu, uint8_t *out, size_t *out_length) {
+    *out_length = 0;
+    switch (apdu->ins) {
+        case Ins_Select:
+            if (apdu->p1 != 0x04) {
+                return SW_INS_NOT_SUPPORTED;
+            }
+            return cmd_select(emu, apdu, out, out_length);
+        case Ins_GetResponse:
+            return cmd_get_response(emu, out, out_length);
+        default:
+            break;
+    }
+    if (!emu->selected) {
+        return SW_CONDITIONS_OF_USE_NOT_SATISFIED;
+    }
+    switch (apdu->ins) {
+        case Ins_Put:
+            return cmd_put(emu, apdu);
+        case Ins_VerifyCode:
+            return cmd_verify_code(emu, apdu);
+        case Ins_VerifyPIN:
+            return cmd_verify_PIN(emu, apdu);
+        case Ins_SetPIN:
+            return cmd_set_PIN(emu, apdu);
+        default:
+            return SW_INS_NOT_SUPPORTED;
+    }
+}
+
+static void write_icc_header(uint8_t *buf, uint32_t data_length, uint8_t slot, uint8_t seq, uint8_t status) {
+    buf[0] = RDR_TO_PC_DATA_BLOCK;
+    buf[1] = data_length >> 0;
+    buf[2] = data_length >> 8;
+    buf[3] = data_length >> 16;
+    buf[4] = data_length >> 24;
+    buf[5] = slot;
+    buf[6] = seq;
+    buf[7] = status;
+    buf[8] = 0;
+    buf[9] = 0;
+}
+
+static int emulator_ccid_on_send(void *ctx, const uint8_t *data, size_t length) {
+    EmulatorCcid *emu = ctx;
+    if (emu->config.transfer_time_us > 0) {
+        usleep(emu->config.transfer_time_us);
+    }
+    if (length < ICC_HEADER_SIZE) {
+        return RET_CONNECTION_LOST;
+    }
+    const uint32_t data_length = data[1] | (data[2] << 8) | (data[3] << 16) | ((uint32_t) data[4] << 24);
+    emu->slot = data[5];
+    emu->seq = data[6];
+
+    uint8_t *out = emu->response + ICC_HEADER_SIZE;
+    size_t out_length = 0;
+    if (data[0] == PC_TO_RDR_XFR_BLOCK) {
+        uint16_t sw;
+        Apdu apdu = {0};
+        if (ICC_HEADER_SIZE + data_length > length || !parse_apdu(data + ICC_HEADER_SIZE, data_length, &apdu)) {
+            sw = SW_WRONG_LENGTH;
+        } else {
+            emu->apdus_processed++;
+            sw = process_apdu(emu, &apdu, out, &out_length);
+        }
+        if (emu->config.use_get_response && sw == SW_OK && out_length > 0 && apdu.ins != Ins_GetResponse) {
+            // Keep the data for the GET RESPONSE command, and answer with the status only
+            memcpy(emu->remaining, out, out_length);
+            emu->remaining_length = out_length;
+            sw = (uint16_t) ((DATA_REMAINING_STATUS_CODE << 8) | MIN(out_length, 0xFF));
+            out_length = 0;
+        }
+        out[out_length++] = sw >> 8;
+        out[out_length++] = sw & 0xFF;
+    }
+    // Other CCID messages get an empty data block
+    rassert(ICC_HEADER_SIZE + out_length <= sizeof emu->response);
+    write_icc_header(emu->response, (uint32_t) out_length, emu->slot, emu->seq, 0);
+    emu->response_length = ICC_HEADER_SIZE + out_length;
+    emu->response_pending = true;
+    emu->ready_at_us = micros() + emu->config.processing_time_us;
+    return RET_NO_ERROR;
+}
+
+static int emulator_ccid_on_receive(void *ctx, uint8_t *data, size_t length, size_t *actual_length) {
+    EmulatorCcid *emu = ctx;
+    if (emu->config.transfer_time_us > 0) {
+        usleep(emu->config.transfer_time_us);
+    }
+    if (length < emu->response_length) {
+        return RET_CONNECTION_LOST;
+    }
+    if (!emu->response_pending) {
+        // Nothing to read, the bulk IN transfer would time out
+        return RET_COMM_ERROR;
+    }
+    emu->frames_read++;
+
+    if (emu->time_extensions_left > 0) {
+        emu->time_extensions_left--;
+        emu->time_extensions_sent++;
+        write_icc_header(data, 0, emu->slot, emu->seq, AWAITING_FOR_TOUCH_STATUS_CODE);
+        *actual_length = ICC_HEADER_SIZE;
+        return RET_NO_ERROR;
+    }
+
+    // Bulk IN transfer blocks until the reader has the response
+    const int64_t wait_us = emu->ready_at_us - micros();
+    if (wait_us > 0) {
+        usleep((useconds_t) wait_us);
+    }
+    memcpy(data, emu->response, emu->response_length);
+    *actual_length = emu->response_length;
+    emu->response_pending = false;
+    return RET_NO_ERROR;
+}
+
+static int emulator_ccid_on_poll(void *ctx, uint32_t timeout_ms) {
+    EmulatorCcid *emu = ctx;
+    if (emu->config.realistic_polling) {
+        usleep(timeout_ms * 1000);
+    }
+    return RET_NO_ERROR;
+}
+
+LoopbackPeer emulator_ccid_peer(EmulatorCcid *emu) {
+    const LoopbackPeer peer = {
+            .on_send = emulator_ccid_on_send,
+            .on_receive = emulator_ccid_on_receive,
+            .on_poll = emulator_ccid_on_poll,
+            .ctx = emu,
+    };
+    return peer;
+}
+
+int emulator_ccid_connect(struct Device *dev, LoopbackState *state, EmulatorCcid *emu) {
+    const LoopbackPeer peer = emulator_ccid_peer(emu);
+    return loopback_connect(dev, state, &peer, CONNECTION_CCID, devices_ccid[0]);
+}
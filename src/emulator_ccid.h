@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#ifndef NITROKEY_HOTP_VERIFICATION_EMULATOR_CCID_H
+#define NITROKEY_HOTP_VERIFICATION_EMULATOR_CCID_H
+
+#include "device.h"
+#include "loopback.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Software model of a CCID reader with the Nitrokey 3 Secrets App behind it.
+ * Parses the PC_to_RDR_XfrBlock frames and the ISO 7816 APDUs sent by the tool,
+ * and answers with RDR_to_PC_DataBlock frames. The object holds no pointers,
+ * so it can be copied or stored to a file as a whole.
+ */
+
+#define EMULATOR_CCID_CREDENTIALS_COUNT (8)
+#define EMULATOR_CCID_NAME_SIZE (64)
+#define EMULATOR_CCID_SECRET_SIZE (64)
+#define EMULATOR_CCID_PIN_SIZE (128)
+#define EMULATOR_CCID_RESPONSE_SIZE (1024)
+// Tag not used by the Secrets App, for the additional data in the replies
+#define EMULATOR_CCID_UNKNOWN_TAG (0x7F)
+
+typedef struct EmulatorCcidConfig {
+    // Time needed by the Secrets App to process an APDU, before the response is available
+    uint32_t processing_time_us;
+    // Time spent on each bulk transfer
+    uint32_t transfer_time_us;
+    // Count of the time extension frames sent before the response for the touch-requiring credential
+    uint32_t touch_time_extensions;
+    // Answer with the 0x61 status first, and return the data only on GET RESPONSE
+    bool use_get_response;
+    // Sleep for the whole poll period, instead of returning immediately
+    bool realistic_polling;
+    // Length of the unknown TLV added to the SELECT reply, e.g. to answer with more than 255 bytes
+    uint16_t select_extra_length;
+} EmulatorCcidConfig;
+
+typedef struct EmulatorCredential {
+    bool present;
+    uint8_t name[EMULATOR_CCID_NAME_SIZE];
+    uint8_t name_length;
+    uint8_t kind;
+    uint8_t algorithm;
+    uint8_t digits;
+    uint8_t properties;
+    uint8_t secret[EMULATOR_CCID_SECRET_SIZE];
+    uint8_t secret_length;
+    uint32_t counter;
+} EmulatorCredential;
+
+typedef struct EmulatorCcid {
+    EmulatorCcidConfig config;
+
+    // Persistent device state
+    uint32_t serial;
+    uint8_t version[3];
+    bool PIN_set;
+    char PIN[EMULATOR_CCID_PIN_SIZE + 1];
+    uint8_t PIN_counter;
+    EmulatorCredential credentials[EMULATOR_CCID_CREDENTIALS_COUNT];
+
+    // Session state
+    bool selected;
+    bool PIN_verified;
+    // Count of the time extension frames to send before the next response. Can be set by the user.
+    uint32_t time_extensions_left;
+
+    // Response state
+    uint8_t response[EMULATOR_CCID_RESPONSE_SIZE];
+    uint32_t response_length;
+    // Response not read yet by the host
+    bool response_pending;
+    uint8_t remaining[EMULATOR_CCID_RESPONSE_SIZE];
+    uint32_t remaining_length;
+    uint8_t slot;
+    uint8_t seq;
+    int64_t ready_at_us;
+
+    // Statistics
+    uint64_t apdus_processed;
+    uint64_t frames_read;
+    uint64_t time_extensions_sent;
+} EmulatorCcid;
+
+// Reset the emulator to the factory state: no PIN set, no credentials. Uses default configuration if config is NULL.
+void emulator_ccid_init(EmulatorCcid *emu, const EmulatorCcidConfig *config);
+LoopbackPeer emulator_ccid_peer(EmulatorCcid *emu);
+// Connect the device object to the emulator over the loopback transport
+int emulator_ccid_connect(struct Device *dev, LoopbackState *state, EmulatorCcid *emu);
+
+#endif//NITROKEY_HOTP_VERIFICATION_EMULATOR_CCID_H
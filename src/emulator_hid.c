@@ -0,0 +1,387 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "emulator_hid.h"
+#include "command_id.h"
+#include "crc32.h"
+#include "device.h"
+#include "hotp.h"
+#include "min.h"
+#include "return_codes.h"
+#include "settings.h"
+#include "structs.h"
+#include "utils.h"
+#include <string.h>
+#include <sys/param.h>
+#include <unistd.h>
+
+// Slot checked by VERIFY_OTP_CODE, the same as used by set_secret_on_device()
+static const int VERIFICATION_SLOT = 3;
+static const int VERIFICATION_WINDOW = 10;
+static const uint8_t HOTP_SLOT_FIRST = 0x10;
+static const uint8_t DEVICE_STATUS_BUSY = 1;
+// Offset of the Storage status structure in the GET_DEVICE_STATUS response payload, as read by device_get_status()
+static const size_t STORAGE_STATUS_PAYLOAD_OFFSET = 22;
+
+static const EmulatorHidConfig default_config = {
+        .model = 'P',
+};
+
+void emulator_hid_init(EmulatorHid *emu, const EmulatorHidConfig *config) {
+    rassert(emu != nullptr);
+    memset(emu, 0, sizeof *emu);
+    emu->config = config != nullptr ? *config : default_config;
+    rassert(emu->config.model == 'P' || emu->config.model == 'L' || emu->config.model == 'S');
+
+    strcpy(emu->admin_PIN, "12345678");
+    strcpy(emu->user_PIN, "123456");
+    emu->retry_admin = MAX_PIN_ATTEMPT_COUNTER_HID;
+    emu->retry_user = MAX_PIN_ATTEMPT_COUNTER_HID;
+    emu->serial = 0x5F11;
+    if (emu->config.model == 'S') {
+        emu->firmware_major = 0;
+        emu->firmware_minor = 54;
+    } else {
+        emu->firmware_major = 0;
+        emu->firmware_minor = 15;
+    }
+    emu->storage_device_status = EMULATOR_STORAGE_IDLE;
+}
+
+VidPid emulator_hid_dev_info(const EmulatorHid *emu) {
+    for (size_t i = 0; i < devices_size; ++i) {
+        if (devices[i].name_short == emu->config.model) {
+            return devices[i];
+        }
+    }
+    rassert(false);
+    return devices[0];
+}
+
+static bool PIN_matches(const char *PIN, const uint8_t *given, size_t given_size) {
+    const size_t length = strnlen((const char *) given, given_size);
+    return length == strlen(PIN) && memcmp(PIN, given, length) == 0;
+}
+
+static bool admin_session_valid(const EmulatorHid *emu, const uint8_t *temporary_password) {
+    return emu->admin_authenticated && memcmp(emu->temporary_admin_password, temporary_password, sizeof emu->temporary_admin_password) == 0;
+}
+
+static uint8_t check_PIN(const char *PIN, uint8_t *retry_counter, const uint8_t *given, size_t given_size) {
+    if (*retry_counter == 0) {
+        return dev_wrong_password;
+    }
+    if (!PIN_matches(PIN, given, given_size)) {
+        (*retry_counter)--;
+        return dev_wrong_password;
+    }
+    *retry_counter = MAX_PIN_ATTEMPT_COUNTER_HID;
+    return dev_ok;
+}
+
+static uint8_t cmd_first_authenticate(EmulatorHid *emu, const uint8_t *payload) {
+    struct FirstAuthenticate auth;
+    memcpy(&auth, payload, sizeof auth);
+    emu->admin_authenticated = false;
+    const uint8_t status = check_PIN(emu->admin_PIN, &emu->retry_admin, auth.card_password, sizeof auth.card_password);
+    if (status == dev_ok) {
+        emu->admin_authenticated = true;
+        memcpy(emu->temporary_admin_password, auth.temporary_password, sizeof emu->temporary_admin_password);
+    }
+    return status;
+}
+
+static uint8_t cmd_user_authenticate(EmulatorHid *emu, const uint8_t *payload) {
+    struct UserAuthenticate auth;
+    memcpy(&auth, payload, sizeof auth);
+    return check_PIN(emu->user_PIN, &emu->retry_user, auth.card_password, sizeof auth.card_password);
+}
+
+static uint8_t cmd_send_otp_data(EmulatorHid *emu, const uint8_t *payload) {
+    struct SendOTPData data;
+    memcpy(&data, payload, sizeof data);
+    if (!admin_session_valid(emu, data.temporary_admin_password)) {
+        return not_authorized;
+    }
+    switch (data.type) {
+        case 'S':
+            if (data.id == 0) {
+                memcpy(emu->pending_secret, data.data, sizeof emu->pending_secret);
+            }
+            return dev_ok;
+        case 'N':
+            memcpy(emu->pending_name, data.data, sizeof emu->pending_name);
+            return dev_ok;
+        default:
+            return not_supported;
+    }
+}
+
+static uint8_t cmd_write_to_slot(EmulatorHid *emu, const uint8_t *payload) {
+    struct WriteToOTPSlot data;
+    memcpy(&data, payload, sizeof data);
+    if (!admin_session_valid(emu, data.temporary_admin_password)) {
+        return not_authorized;
+    }
+    if (data.slot_number < HOTP_SLOT_FIRST || data.slot_number >= HOTP_SLOT_FIRST + EMULATOR_HOTP_SLOTS_COUNT) {
+        return wrong_slot;
+    }
+    EmulatorHotpSlot *slot = &emu->hotp_slots[data.slot_number - HOTP_SLOT_FIRST];
+    slot->programmed = true;
+    slot->use_8_digits = data.use_8_digits;
+    slot->counter = data.slot_counter_or_interval;
+    memcpy(slot->secret, emu->pending_secret, sizeof slot->secret);
+    memcpy(slot->name, emu->pending_name, sizeof slot->name);
+    memset(emu->pending_secret, 0, sizeof emu->pending_secret);
+    memset(emu->pending_name, 0, sizeof emu->pending_name);
+    return dev_ok;
+}
+
+static uint8_t cmd_verify_code(EmulatorHid *emu, const uint8_t *payload, uint8_t *response_payload) {
+    cmd_query_verify_code data;
+    memcpy(&data, payload, sizeof data);
+    EmulatorHotpSlot *slot = &emu->hotp_slots[VERIFICATION_SLOT];
+    if (!slot->programmed) {
+        return dev_slot_not_programmed;
+    }
+    const int digits = slot->use_8_digits ? 8 : 6;
+    for (int i = 0; i < VERIFICATION_WINDOW; ++i) {
+        if (hotp_code(slot->secret, sizeof slot->secret, slot->counter + i, digits) == data.otp_code_to_verify) {
+            slot->counter += i + 1;
+            response_payload[0] = 1;
+            response_payload[1] = (uint8_t) i;
+            return dev_ok;
+        }
+    }
+    response_payload[0] = 0;
+    return dev_ok;
+}
+
+static uint8_t cmd_get_status(EmulatorHid *emu, uint8_t *response_payload) {
+    struct ResponseStatus status = {0};
+    if (emu->config.model == 'S') {
+        // Storage reports its version and serial with GET_DEVICE_STATUS
+        status.firmware_version_st.major = 0;
+        status.firmware_version_st.minor = 1;
+    } else {
+        status.firmware_version_st.major = emu->firmware_major;
+        status.firmware_version_st.minor = emu->firmware_minor;
+        status.card_serial_u32 = emu->serial;
+    }
+    memset(status.general_config, 0xFF, 3);
+    memcpy(response_payload, &status, sizeof status - 2);
+    return dev_ok;
+}
+
+static uint8_t cmd_get_device_status(EmulatorHid *emu, uint8_t *response_payload) {
+    if (emu->config.model != 'S') {
+        return dev_unknown_command;
+    }
+    struct StatusResponsePayloadStorage status = {0};
+    status.MagicNumber_StickConfig_u16 = 0x3577;
+    status.versionInfo.major = emu->firmware_major;
+    status.versionInfo.minor = emu->firmware_minor;
+    status.UserPwRetryCount = emu->retry_user;
+    status.AdminPwRetryCount = emu->retry_admin;
+    status.ActiveSmartCardID_u32 = emu->serial;
+    memcpy(response_payload + STORAGE_STATUS_PAYLOAD_OFFSET, &status, sizeof status);
+    return dev_ok;
+}
+
+static uint8_t cmd_new_aes_key(EmulatorHid *emu, const uint8_t *payload) {
+    if (emu->config.model == 'S') {
+        return dev_unknown_command;
+    }
+    struct cmd_createNewKeys_Pro data;
+    memcpy(&data, payload, sizeof data);
+    return check_PIN(emu->admin_PIN, &emu->retry_admin, data.admin_password, sizeof data.admin_password);
+}
+
+static uint8_t cmd_generate_new_keys(EmulatorHid *emu, const uint8_t *payload) {
+    if (emu->config.model != 'S') {
+        return dev_unknown_command;
+    }
+    struct cmd_createNewKeys_Storage data;
+    memcpy(&data, payload, sizeof data);
+    if (check_PIN(emu->admin_PIN, &emu->retry_admin, data.admin_password, sizeof data.admin_password) != dev_ok) {
+        emu->storage_device_status = EMULATOR_STORAGE_WRONG_PASSWORD;
+        return dev_ok;
+    }
+    emu->storage_busy_reads_left = emu->config.storage_busy_reads;
+    emu->storage_progress = 0;
+    emu->storage_device_status = emu->storage_busy_reads_left > 0 ? EMULATOR_STORAGE_BUSY : EMULATOR_STORAGE_OK;
+    return dev_ok;
+}
+
+static void update_storage_status(EmulatorHid *emu, struct DeviceResponse *response) {
+    if (emu->config.model != 'S') {
+        return;
+    }
+    response->response_st.storage_status.command_counter = emu->command_counter;
+    response->response_st.storage_status.command_id = response->response_st.command_id;
+    response->response_st.storage_status.device_status = emu->storage_device_status;
+    response->response_st.storage_status.progress_bar_value = emu->storage_progress;
+}
+
+static void update_response_crc(struct DeviceResponse *response) {
+    response->response_st.crc = stm_crc32(response->as_data + 1, HID_REPORT_SIZE_CONST - 5);
+}
+
+static int emulator_hid_on_send(void *ctx, const uint8_t *data, size_t length) {
+    EmulatorHid *emu = ctx;
+    if (emu->config.transfer_time_us > 0) {
+        usleep(emu->config.transfer_time_us);
+    }
+    if (length != HID_REPORT_SIZE_CONST) {
+        return RET_CONNECTION_LOST;
+    }
+
+    struct DeviceQuery query;
+    memcpy(query.as_data, data, sizeof query.as_data);
+
+    struct DeviceResponse *response = &emu->response;
+    memset(response, 0, sizeof *response);
+    response->response_st.command_id = query.command_id;
+    response->response_st.last_command_crc = query.crc;
+    emu->commands_processed++;
+    emu->command_counter++;
+    if (emu->config.model == 'S' && emu->storage_device_status != EMULATOR_STORAGE_BUSY) {
+        emu->storage_device_status = EMULATOR_STORAGE_IDLE;
+    }
+
+    uint8_t status;
+    if (stm_crc32(query.as_data + 1, HID_REPORT_SIZE_CONST - 5) != query.crc) {
+        emu->crc_errors++;
+        status = wrong_CRC;
+    } else {
+        uint8_t *response_payload = response->response_st.payload;
+        switch (query.command_id) {
+            case FIRST_AUTHENTICATE:
+                status = cmd_first_authenticate(emu, query.payload);
+                break;
+            case USER_AUTHENTICATE:
+                status = cmd_user_authenticate(emu, query.payload);
+                break;
+            case SEND_OTP_DATA:
+                status = cmd_send_otp_data(emu, query.payload);
+                break;
+            case WRITE_TO_SLOT:
+                status = cmd_write_to_slot(emu, query.payload);
+                break;
+            case VERIFY_OTP_CODE:
+                status = cmd_verify_code(emu, query.payload, response_payload);
+                break;
+            case GET_STATUS:
+                status = cmd_get_status(emu, response_payload);
+                break;
+            case GET_PASSWORD_RETRY_COUNT:
+                response_payload[0] = emu->retry_admin;
+                status = dev_ok;
+                break;
+            case GET_USER_PASSWORD_RETRY_COUNT:
+                response_payload[0] = emu->retry_user;
+                status = dev_ok;
+                break;
+            case GET_DEVICE_STATUS:
+                status = cmd_get_device_status(emu, response_payload);
+                break;
+            case NEW_AES_KEY:
+                status = cmd_new_aes_key(emu, query.payload);
+                break;
+            case GENERATE_NEW_KEYS:
+                status = cmd_generate_new_keys(emu, query.payload);
+                break;
+            default:
+                status = dev_unknown_command;
+                break;
+        }
+    }
+    response->response_st.last_command_status = status;
+    update_storage_status(emu, response);
+    update_response_crc(response);
+    emu->ready_at_us = micros() + emu->config.processing_time_us;
+    return RET_NO_ERROR;
+}
+
+static int emulator_hid_on_receive(void *ctx, uint8_t *data, size_t length, size_t *actual_length) {
+    EmulatorHid *emu = ctx;
+    if (emu->config.transfer_time_us > 0) {
+        usleep(emu->config.transfer_time_us);
+    }
+    if (length < HID_REPORT_SIZE_CONST) {
+        return RET_CONNECTION_LOST;
+    }
+    emu->reports_read++;
+
+    if (micros() < emu->ready_at_us) {
+        // Still processing, report busy device
+        struct DeviceResponse busy = emu->response;
+        busy.response_st.device_status = DEVICE_STATUS_BUSY;
+        update_response_crc(&busy);
+        memcpy(data, busy.as_data, HID_REPORT_SIZE_CONST);
+        *actual_length = HID_REPORT_SIZE_CONST;
+        return RET_NO_ERROR;
+    }
+
+    if (emu->storage_device_status == EMULATOR_STORAGE_BUSY) {
+        if (emu->storage_busy_reads_left > 0) {
+            const uint32_t total = emu->config.storage_busy_reads;
+            emu->storage_progress = (uint8_t) (100 - (100 * emu->storage_busy_reads_left) / total);
+            emu->storage_busy_reads_left--;
+        } else {
+            emu->storage_device_status = EMULATOR_STORAGE_OK;
+            emu->storage_progress = 100;
+        }
+        update_storage_status(emu, &emu->response);
+        update_response_crc(&emu->response);
+    }
+
+    memcpy(data, emu->response.as_data, HID_REPORT_SIZE_CONST);
+    *actual_length = HID_REPORT_SIZE_CONST;
+    return RET_NO_ERROR;
+}
+
+static int emulator_hid_on_poll(void *ctx, uint32_t timeout_ms) {
+    EmulatorHid *emu = ctx;
+    int64_t wait_us = (int64_t) timeout_ms * 1000;
+    if (!emu->config.realistic_polling) {
+        wait_us = MIN(wait_us, emu->ready_at_us - micros());
+    }
+    if (wait_us > 0) {
+        usleep((useconds_t) wait_us);
+    }
+    return RET_NO_ERROR;
+}
+
+LoopbackPeer emulator_hid_peer(EmulatorHid *emu) {
+    const LoopbackPeer peer = {
+            .on_send = emulator_hid_on_send,
+            .on_receive = emulator_hid_on_receive,
+            .on_poll = emulator_hid_on_poll,
+            .ctx = emu,
+    };
+    return peer;
+}
+
+int emulator_hid_connect(struct Device *dev, LoopbackState *state, EmulatorHid *emu) {
+    const LoopbackPeer peer = emulator_hid_peer(emu);
+    return loopback_connect(dev, state, &peer, CONNECTION_HID, emulator_hid_dev_info(emu));
+}
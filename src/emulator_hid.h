@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#ifndef NITROKEY_HOTP_VERIFICATION_EMULATOR_HID_H
+#define NITROKEY_HOTP_VERIFICATION_EMULATOR_HID_H
+
+#include "device.h"
+#include "loopback.h"
+#include "structs.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Software model of the Nitrokey Pro, Librem Key and Nitrokey Storage firmware,
+ * speaking the feature report protocol from structs.h and command_id.h.
+ * Meant for benchmarking and testing the HID path without hardware. The object
+ * holds no pointers, so it can be copied or stored to a file as a whole.
+ */
+
+#define EMULATOR_HOTP_SLOTS_COUNT (4)
+#define EMULATOR_HOTP_SECRET_SIZE (20)
+#define EMULATOR_SLOT_NAME_SIZE (15)
+#define EMULATOR_PIN_SIZE (25)
+
+typedef struct EmulatorHidConfig {
+    // Emulated model, as in VidPid.name_short: 'P', 'L' or 'S'
+    char model;
+    // Time needed by the firmware to process a command, before the response is available
+    uint32_t processing_time_us;
+    // Time spent on each feature report transfer
+    uint32_t transfer_time_us;
+    // Count of the response reads, for which Storage stays busy after GENERATE_NEW_KEYS
+    uint32_t storage_busy_reads;
+    // Sleep for the whole poll period like real HID, instead of returning as soon as the response is ready
+    bool realistic_polling;
+} EmulatorHidConfig;
+
+typedef struct EmulatorHotpSlot {
+    bool programmed;
+    bool use_8_digits;
+    uint8_t secret[EMULATOR_HOTP_SECRET_SIZE];
+    uint8_t name[EMULATOR_SLOT_NAME_SIZE];
+    uint64_t counter;
+} EmulatorHotpSlot;
+
+typedef struct EmulatorHid {
+    EmulatorHidConfig config;
+
+    // Persistent device state
+    char admin_PIN[EMULATOR_PIN_SIZE + 1];
+    char user_PIN[EMULATOR_PIN_SIZE + 1];
+    uint8_t retry_admin;
+    uint8_t retry_user;
+    uint32_t serial;
+    uint8_t firmware_major;
+    uint8_t firmware_minor;
+    EmulatorHotpSlot hotp_slots[EMULATOR_HOTP_SLOTS_COUNT];
+
+    // Session state
+    bool admin_authenticated;
+    uint8_t temporary_admin_password[EMULATOR_PIN_SIZE];
+    uint8_t pending_secret[EMULATOR_HOTP_SECRET_SIZE];
+    uint8_t pending_name[EMULATOR_SLOT_NAME_SIZE];
+
+    // Response state
+    struct DeviceResponse response;
+    int64_t ready_at_us;
+    uint32_t storage_busy_reads_left;
+    uint8_t storage_device_status;
+    uint8_t storage_progress;
+    uint8_t command_counter;
+
+    // Statistics
+    uint64_t commands_processed;
+    uint64_t reports_read;
+    uint64_t crc_errors;
+} EmulatorHid;
+
+enum {
+    // Nitrokey Storage device status values, as reported in the storage_status field
+    EMULATOR_STORAGE_IDLE = 0,
+    EMULATOR_STORAGE_OK = 1,
+    EMULATOR_STORAGE_BUSY = 2,
+    EMULATOR_STORAGE_WRONG_PASSWORD = 3,
+};
+
+/**
+ * Reset the emulator to the factory state: PINs 12345678 (admin) and 123456 (user), no slots programmed.
+ * Uses default configuration of the Nitrokey Pro if config is NULL.
+ */
+void emulator_hid_init(EmulatorHid *emu, const EmulatorHidConfig *config);
+LoopbackPeer emulator_hid_peer(EmulatorHid *emu);
+VidPid emulator_hid_dev_info(const EmulatorHid *emu);
+// Connect the device object to the emulator over the loopback transport
+int emulator_hid_connect(struct Device *dev, LoopbackState *state, EmulatorHid *emu);
+
+#endif//NITROKEY_HOTP_VERIFICATION_EMULATOR_HID_H
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+/**
+ * HID transport using the Linux hidraw feature report ioctls. Works next to the bound
+ * kernel driver, without setting up libusb.
+ */
+
+#include "hid_hidraw.h"
+#include "settings.h"
+
+#ifdef FEATURE_HID_HIDRAW
+
+#include "discovery.h"
+#include "return_codes.h"
+#include "transport.h"
+#include "utils.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/hidraw.h>
+#include <linux/input.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#ifndef HIDRAW_SYSFS_DIR
+#define HIDRAW_SYSFS_DIR "/sys/class/hidraw"
+#endif
+#ifndef HIDRAW_DEV_DIR
+#define HIDRAW_DEV_DIR "/dev"
+#endif
+
+// Read the bus type and the USB IDs from the HID_ID entry of the node's uevent file
+static bool read_hid_id(const char *node, uint16_t *vid, uint16_t *pid) {
+    char path[512];
+    snprintf(path, sizeof path, HIDRAW_SYSFS_DIR "/%s/device/uevent", node);
+    FILE *f = fopen(path, "r");
+    if (f == nullptr) {
+        return false;
+    }
+    bool found = false;
+    char line[256];
+    while (!found && fgets(line, sizeof line, f) != nullptr) {
+        unsigned int bus, vendor, product;
+        if (sscanf(line, "HID_ID=%x:%x:%x", &bus, &vendor, &product) == 3 && bus == BUS_USB) {
+            *vid = (uint16_t) vendor;
+            *pid = (uint16_t) product;
+            found = true;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+int hidraw_discover(struct Device *dev) {
+    // fd 0 is a valid descriptor, when stdin is closed
+    dev->hidraw_fd = -1;
+    const char *enabled = getenv("HOTP_VERIFICATION_HIDRAW");
+    if (enabled != nullptr && strcmp(enabled, "0") == 0) {
+        return RET_COMM_ERROR;
+    }
+    DIR *dir = opendir(HIDRAW_SYSFS_DIR);
+    if (dir == nullptr) {
+        return RET_COMM_ERROR;
+    }
+    int r = RET_COMM_ERROR;
+    const struct dirent *entry;
+    while (r != RET_NO_ERROR && (entry = readdir(dir)) != nullptr) {
+        uint16_t vid, pid;
+        if (strncmp(entry->d_name, "hidraw", 6) != 0 || !read_hid_id(entry->d_name, &vid, &pid)) {
+            continue;
+        }
+        ConnectionType connection_type;
+        const VidPid *model = discovery_find_model(vid, pid, &connection_type);
+        if (model == nullptr || connection_type != CONNECTION_HID) {
+            continue;
+        }
+        char path[512];
+        snprintf(path, sizeof path, HIDRAW_DEV_DIR "/%s", entry->d_name);
+        const int fd = open(path, O_RDWR | O_CLOEXEC);
+        if (fd < 0) {
+            LOG("Cannot open %s\n", path);
+            continue;
+        }
+        LOG("Found HID device: %s at %s\n", model->name, path);
+        dev->hidraw_fd = fd;
+        dev->dev_info = *model;
+        r = RET_NO_ERROR;
+    }
+    closedir(dir);
+    return r;
+}
+
+static int hidraw_open(struct Device *dev) {
+    if (dev->hidraw_fd < 0) {
+        // opened only through hidraw_discover()
+        return RET_COMM_ERROR;
+    }
+    dev->connection_type = CONNECTION_HID;
+    return RET_NO_ERROR;
+}
+
+static int hidraw_send(struct Device *dev, const uint8_t *data, size_t length) {
+    // the first byte holds the report ID, as expected by the ioctl
+    const int r = ioctl(dev->hidraw_fd, HIDIOCSFEATURE(length), data);
+    return r == (int) length ? RET_NO_ERROR : RET_CONNECTION_LOST;
+}
+
+static int hidraw_receive(struct Device *dev, uint8_t *data, size_t length, size_t *actual_length) {
+    data[0] = 0;
+    const int r = ioctl(dev->hidraw_fd, HIDIOCGFEATURE(length), data);
+    if (r < 0) {
+        return RET_CONNECTION_LOST;
+    }
+    *actual_length = (size_t) r;
+    return RET_NO_ERROR;
+}
+
+static int hidraw_poll(struct Device *dev, uint32_t timeout_ms) {
+    unused(dev);
+    usleep(timeout_ms * 1000);
+    return RET_NO_ERROR;
+}
+
+static int hidraw_close(struct Device *dev) {
+    if (dev->hidraw_fd < 0) return RET_UNKNOWN_DEVICE;
+    close(dev->hidraw_fd);
+    dev->hidraw_fd = -1;
+    return RET_NO_ERROR;
+}
+
+const Transport transport_hid_hidraw = {
+        .name = "hid-hidraw",
+        .open = hidraw_open,
+        .send = hidraw_send,
+        .receive = hidraw_receive,
+        .poll = hidraw_poll,
+        .close = hidraw_close,
+};
+
+#endif
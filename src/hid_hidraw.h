@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#ifndef NITROKEY_HOTP_VERIFICATION_HID_HIDRAW_H
+#define NITROKEY_HOTP_VERIFICATION_HID_HIDRAW_H
+
+#include "device.h"
+
+/**
+ * Find the hidraw node of a device listed in devices[] through sysfs, and open it.
+ * On success dev->dev_info and dev->hidraw_fd are set, for use with transport_hid_hidraw.
+ * Disabled with HOTP_VERIFICATION_HIDRAW=0 in the environment.
+ * @return RET_NO_ERROR when a device was opened, RET_COMM_ERROR otherwise
+ */
+int hidraw_discover(struct Device *dev);
+
+#endif//NITROKEY_HOTP_VERIFICATION_HID_HIDRAW_H
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+/**
+ * HID transport issuing the feature report requests as libusb control transfers,
+ * on the device handle opened and claimed by the device discovery.
+ */
+
+#include "hid_libusb.h"
+#include "device.h"
+#include "return_codes.h"
+#include "structs.h"
+#include "transport.h"
+#include "utils.h"
+#include <libusb.h>
+#include <stdio.h>
+#include <unistd.h>
+
+static const uint8_t HID_REQUEST_TYPE_SET = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE;
+static const uint8_t HID_REQUEST_TYPE_GET = LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE;
+static const uint8_t HID_SET_REPORT = 0x09;
+static const uint8_t HID_GET_REPORT = 0x01;
+static const uint16_t HID_REPORT_TYPE_FEATURE = 0x03;
+static const unsigned int HID_TRANSFER_TIMEOUT_MS = 1000;
+
+int hid_libusb_claim_device(libusb_device_handle *handle, uint8_t interface_number) {
+    // not supported on all platforms, where no kernel driver is bound anyway
+    libusb_set_auto_detach_kernel_driver(handle, 1);
+    const int r = libusb_claim_interface(handle, interface_number);
+    if (r < 0) {
+        printf("Error claiming interface: %s\n", libusb_strerror(r));
+        return RET_COMM_ERROR;
+    }
+    return RET_NO_ERROR;
+}
+
+static int hid_libusb_open(struct Device *dev) {
+    if (dev->mp_devhandle_usb == nullptr) {
+        // opened only through the device discovery
+        return RET_COMM_ERROR;
+    }
+    dev->connection_type = CONNECTION_HID;
+    return RET_NO_ERROR;
+}
+
+static int hid_libusb_send(struct Device *dev, const uint8_t *data, size_t length) {
+    // the first byte holds the report ID, which is passed in the request value instead
+    const int r = libusb_control_transfer(dev->mp_devhandle_usb, HID_REQUEST_TYPE_SET, HID_SET_REPORT,
+                                          (HID_REPORT_TYPE_FEATURE << 8) | data[0], dev->usb_interface,
+                                          (unsigned char *) data + 1, (uint16_t) (length - 1), HID_TRANSFER_TIMEOUT_MS);
+    return r == (int) length - 1 ? RET_NO_ERROR : RET_CONNECTION_LOST;
+}
+
+static int hid_libusb_receive(struct Device *dev, uint8_t *data, size_t length, size_t *actual_length) {
+    data[0] = 0;
+    const int r = libusb_control_transfer(dev->mp_devhandle_usb, HID_REQUEST_TYPE_GET, HID_GET_REPORT,
+                                          (HID_REPORT_TYPE_FEATURE << 8) | data[0], dev->usb_interface,
+                                          data + 1, (uint16_t) (length - 1), HID_TRANSFER_TIMEOUT_MS);
+    if (r < 0) {
+        return RET_CONNECTION_LOST;
+    }
+    *actual_length = (size_t) r + 1;
+    return RET_NO_ERROR;
+}
+
+static int hid_libusb_poll(struct Device *dev, uint32_t timeout_ms) {
+    unused(dev);
+    usleep(timeout_ms * 1000);
+    return RET_NO_ERROR;
+}
+
+static int hid_libusb_close(struct Device *dev) {
+    if (dev->mp_devhandle_usb == nullptr) return RET_UNKNOWN_DEVICE;
+    libusb_release_interface(dev->mp_devhandle_usb, dev->usb_interface);
+    libusb_close(dev->mp_devhandle_usb);
+    dev->mp_devhandle_usb = nullptr;
+    dev->ctx_usb = nullptr;
+    return RET_NO_ERROR;
+}
+
+const Transport transport_hid_libusb = {
+        .name = "hid-libusb",
+        .open = hid_libusb_open,
+        .send = hid_libusb_send,
+        .receive = hid_libusb_receive,
+        .poll = hid_libusb_poll,
+        .close = hid_libusb_close,
+};
@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#ifndef NITROKEY_HOTP_VERIFICATION_HID_LIBUSB_H
+#define NITROKEY_HOTP_VERIFICATION_HID_LIBUSB_H
+
+#include <libusb.h>
+#include <stdint.h>
+
+// Detach the kernel HID driver and claim the HID interface of the opened device
+int hid_libusb_claim_device(libusb_device_handle *handle, uint8_t interface_number);
+
+#endif//NITROKEY_HOTP_VERIFICATION_HID_LIBUSB_H
@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "hotp.h"
+#include <string.h>
+
+#define SHA1_BLOCK_SIZE (64)
+
+typedef struct {
+    uint32_t h[5];
+    uint64_t length;
+    uint8_t block[SHA1_BLOCK_SIZE];
+    size_t block_used;
+} sha1_ctx;
+
+static uint32_t rol32(uint32_t x, int n) { return (x << n) | (x >> (32 - n)); }
+
+static void sha1_transform(sha1_ctx *ctx, const uint8_t *block) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++) {
+        w[i] = ((uint32_t) block[4 * i] << 24) | ((uint32_t) block[4 * i + 1] << 16) | ((uint32_t) block[4 * i + 2] << 8) | block[4 * i + 3];
+    }
+    for (int i = 16; i < 80; i++) {
+        w[i] = rol32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+
+    uint32_t a = ctx->h[0], b = ctx->h[1], c = ctx->h[2], d = ctx->h[3], e = ctx->h[4];
+    for (int i = 0; i < 80; i++) {
+        uint32_t f, k;
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+        const uint32_t t = rol32(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rol32(b, 30);
+        b = a;
+        a = t;
+    }
+    ctx->h[0] += a;
+    ctx->h[1] += b;
+    ctx->h[2] += c;
+    ctx->h[3] += d;
+    ctx->h[4] += e;
+}
+
+static void sha1_init(sha1_ctx *ctx) {
+    const uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    memcpy(ctx->h, h, sizeof h);
+    ctx->length = 0;
+    ctx->block_used = 0;
+}
+
+static void sha1_update(sha1_ctx *ctx, const uint8_t *data, size_t length) {
+    ctx->length += length;
+    while (length > 0) {
+        size_t chunk = SHA1_BLOCK_SIZE - ctx->block_used;
+        if (chunk > length) chunk = length;
+        memcpy(ctx->block + ctx->block_used, data, chunk);
+        ctx->block_used += chunk;
+        data += chunk;
+        length -= chunk;
+        if (ctx->block_used == SHA1_BLOCK_SIZE) {
+            sha1_transform(ctx, ctx->block);
+            ctx->block_used = 0;
+        }
+    }
+}
+
+static void sha1_final(sha1_ctx *ctx, uint8_t digest[SHA1_DIGEST_SIZE]) {
+    const uint64_t bit_length = ctx->length * 8;
+    const uint8_t padding_start = 0x80;
+    const uint8_t zero = 0;
+    sha1_update(ctx, &padding_start, 1);
+    while (ctx->block_used != SHA1_BLOCK_SIZE - 8) {
+        sha1_update(ctx, &zero, 1);
+    }
+    uint8_t length_be[8];
+    for (int i = 0; i < 8; i++) {
+        length_be[i] = (uint8_t) (bit_length >> (56 - 8 * i));
+    }
+    sha1_update(ctx, length_be, sizeof length_be);
+    for (int i = 0; i < 5; i++) {
+        digest[4 * i] = (uint8_t) (ctx->h[i] >> 24);
+        digest[4 * i + 1] = (uint8_t) (ctx->h[i] >> 16);
+        digest[4 * i + 2] = (uint8_t) (ctx->h[i] >> 8);
+        digest[4 * i + 3] = (uint8_t) ctx->h[i];
+    }
+}
+
+void sha1(const uint8_t *data, size_t length, uint8_t digest[SHA1_DIGEST_SIZE]) {
+    sha1_ctx ctx;
+    sha1_init(&ctx);
+    sha1_update(&ctx, data, length);
+    sha1_final(&ctx, digest);
+}
+
+void hmac_sha1(const uint8_t *key, size_t key_length, const uint8_t *data, size_t length, uint8_t digest[SHA1_DIGEST_SIZE]) {
+    uint8_t key_block[SHA1_BLOCK_SIZE] = {0};
+    if (key_length > SHA1_BLOCK_SIZE) {
+        sha1(key, key_length, key_block);
+    } else {
+        memcpy(key_block, key, key_length);
+    }
+
+    uint8_t pad[SHA1_BLOCK_SIZE];
+    uint8_t inner_digest[SHA1_DIGEST_SIZE];
+    sha1_ctx ctx;
+
+    for (int i = 0; i < SHA1_BLOCK_SIZE; i++) pad[i] = key_block[i] ^ 0x36;
+    sha1_init(&ctx);
+    sha1_update(&ctx, pad, sizeof pad);
+    sha1_update(&ctx, data, length);
+    sha1_final(&ctx, inner_digest);
+
+    for (int i = 0; i < SHA1_BLOCK_SIZE; i++) pad[i] = key_block[i] ^ 0x5c;
+    sha1_init(&ctx);
+    sha1_update(&ctx, pad, sizeof pad);
+    sha1_update(&ctx, inner_digest, sizeof inner_digest);
+    sha1_final(&ctx, digest);
+}
+
+uint32_t hotp_code(const uint8_t *secret, size_t secret_length, uint64_t counter, int digits) {
+    uint8_t counter_be[8];
+    for (int i = 0; i < 8; i++) {
+        counter_be[i] = (uint8_t) (counter >> (56 - 8 * i));
+    }
+    uint8_t digest[SHA1_DIGEST_SIZE];
+    hmac_sha1(secret, secret_length, counter_be, sizeof counter_be, digest);
+
+    // dynamic truncation
+    const int offset = digest[SHA1_DIGEST_SIZE - 1] & 0x0F;
+    const uint32_t binary = ((uint32_t) (digest[offset] & 0x7F) << 24) | ((uint32_t) digest[offset + 1] << 16) | ((uint32_t) digest[offset + 2] << 8) | digest[offset + 3];
+    return binary % (digits == 8 ? 100000000 : 1000000);
+}
@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "hotplug.h"
+#include "discovery.h"
+#include "return_codes.h"
+#include "usb_context.h"
+#include "utils.h"
+#include <libusb.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef struct HotplugWatch {
+    HotplugHandler handler;
+    void *ctx;
+    // set by the callback, and checked by libusb_handle_events_timeout_completed
+    int stop;
+} HotplugWatch;
+
+static int LIBUSB_CALL on_hotplug(libusb_context *usb_ctx, libusb_device *usb_dev, libusb_hotplug_event event,
+                                  void *user_data) {
+    unused(usb_ctx);
+    HotplugWatch *watch = user_data;
+    struct libusb_device_descriptor desc;
+    if (libusb_get_device_descriptor(usb_dev, &desc) != LIBUSB_SUCCESS) {
+        return 0;
+    }
+    ConnectionType connection_type;
+    const VidPid *model = discovery_find_model(desc.idVendor, desc.idProduct, &connection_type);
+    if (model == nullptr || watch->stop) {
+        return 0;
+    }
+    DeviceLocation location;
+    discovery_read_location(usb_dev, &location);
+    const HotplugEvent hotplug_event = event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED ? HOTPLUG_ARRIVED : HOTPLUG_LEFT;
+    if (watch->handler(watch->ctx, hotplug_event, model, connection_type, &location)) {
+        watch->stop = 1;
+    }
+    // keep the callback registered, it is removed when the watch ends
+    return 0;
+}
+
+int hotplug_watch(uint32_t timeout_ms, bool report_present, HotplugHandler handler, void *ctx) {
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        return RET_COMM_ERROR;
+    }
+    libusb_context *usb_ctx = usb_context_get();
+    if (usb_ctx == nullptr) {
+        return RET_COMM_ERROR;
+    }
+
+    HotplugWatch watch = {.handler = handler, .ctx = ctx, .stop = 0};
+    libusb_hotplug_callback_handle callback_handle;
+    int r = libusb_hotplug_register_callback(usb_ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+                                         report_present ? LIBUSB_HOTPLUG_ENUMERATE : LIBUSB_HOTPLUG_NO_FLAGS,
+                                         LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+                                         on_hotplug, &watch, &callback_handle);
+    if (r != LIBUSB_SUCCESS) {
+        LOG("Error registering hotplug callback: %s\n", libusb_strerror(r));
+        return RET_COMM_ERROR;
+    }
+
+    const int64_t deadline_us = micros() + (int64_t) timeout_ms * 1000;
+    while (!watch.stop) {
+        // without a time limit wake up once a second only
+        int64_t wait_us = 1000 * 1000;
+        if (timeout_ms != 0) {
+            wait_us = deadline_us - micros();
+            if (wait_us <= 0) {
+                break;
+            }
+        }
+        struct timeval tv = {.tv_sec = wait_us / (1000 * 1000), .tv_usec = wait_us % (1000 * 1000)};
+        r = libusb_handle_events_timeout_completed(usb_ctx, &tv, &watch.stop);
+        if (r != LIBUSB_SUCCESS && r != LIBUSB_ERROR_INTERRUPTED) {
+            LOG("Error handling hotplug events: %s\n", libusb_strerror(r));
+            break;
+        }
+    }
+
+    libusb_hotplug_deregister_callback(usb_ctx, callback_handle);
+    if (watch.stop) {
+        return RET_NO_ERROR;
+    }
+    return r == LIBUSB_SUCCESS || r == LIBUSB_ERROR_INTERRUPTED ? RET_NOT_FOUND : RET_COMM_ERROR;
+}
+
+static int LIBUSB_CALL on_arrival(libusb_context *usb_ctx, libusb_device *usb_dev, libusb_hotplug_event event,
+                                  void *user_data) {
+    unused(usb_ctx);
+    unused(event);
+    HotplugWaiter *waiter = user_data;
+    struct libusb_device_descriptor desc;
+    ConnectionType connection_type;
+    if (libusb_get_device_descriptor(usb_dev, &desc) == LIBUSB_SUCCESS &&
+        discovery_find_model(desc.idVendor, desc.idProduct, &connection_type) != nullptr) {
+        waiter->arrived = 1;
+    }
+    return 0;
+}
+
+int hotplug_waiter_start(HotplugWaiter *waiter) {
+    memset(waiter, 0, sizeof *waiter);
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        return RET_COMM_ERROR;
+    }
+    libusb_context *usb_ctx = usb_context_get();
+    if (usb_ctx == nullptr) {
+        return RET_COMM_ERROR;
+    }
+    const int r = libusb_hotplug_register_callback(usb_ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_NO_FLAGS,
+                                                   LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+                                                   LIBUSB_HOTPLUG_MATCH_ANY, on_arrival, waiter, &waiter->handle);
+    if (r != LIBUSB_SUCCESS) {
+        LOG("Error registering hotplug callback: %s\n", libusb_strerror(r));
+        return RET_COMM_ERROR;
+    }
+    waiter->registered = true;
+    return RET_NO_ERROR;
+}
+
+int hotplug_waiter_wait(HotplugWaiter *waiter, uint32_t timeout_ms) {
+    rassert(waiter->registered);
+    libusb_context *usb_ctx = usb_context_get();
+    const int64_t deadline_us = micros() + (int64_t) timeout_ms * 1000;
+    while (!waiter->arrived) {
+        const int64_t wait_us = deadline_us - micros();
+        if (wait_us <= 0) {
+            return RET_NOT_FOUND;
+        }
+        struct timeval tv = {.tv_sec = wait_us / (1000 * 1000), .tv_usec = wait_us % (1000 * 1000)};
+        const int r = libusb_handle_events_timeout_completed(usb_ctx, &tv, &waiter->arrived);
+        if (r != LIBUSB_SUCCESS && r != LIBUSB_ERROR_INTERRUPTED) {
+            LOG("Error handling hotplug events: %s\n", libusb_strerror(r));
+            return RET_COMM_ERROR;
+        }
+    }
+    waiter->arrived = 0;
+    return RET_NO_ERROR;
+}
+
+void hotplug_waiter_stop(HotplugWaiter *waiter) {
+    if (waiter->registered) {
+        libusb_hotplug_deregister_callback(usb_context_get(), waiter->handle);
+        waiter->registered = false;
+    }
+}
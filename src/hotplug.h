@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#ifndef NITROKEY_HOTP_VERIFICATION_HOTPLUG_H
+#define NITROKEY_HOTP_VERIFICATION_HOTPLUG_H
+
+#include "device.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum {
+    HOTPLUG_ARRIVED,
+    HOTPLUG_LEFT,
+} HotplugEvent;
+
+/**
+ * Called for each arrival or removal of a device listed in devices[] or devices_ccid[].
+ * @return true to stop watching
+ */
+typedef bool (*HotplugHandler)(void *ctx, HotplugEvent event, const VidPid *model, ConnectionType connection_type,
+                               const DeviceLocation *location);
+
+/**
+ * Watch for the known devices being connected and disconnected, using the libusb hotplug notifications.
+ * Nothing is polled while idle.
+ * @param timeout_ms time limit, 0 to watch until stopped by the handler
+ * @param report_present report the devices connected already as arrived
+ * @return RET_NO_ERROR when stopped by the handler, RET_NOT_FOUND on timeout,
+ * RET_COMM_ERROR if the hotplug notifications are not available on this platform
+ */
+int hotplug_watch(uint32_t timeout_ms, bool report_present, HotplugHandler handler, void *ctx);
+
+/**
+ * Collects the arrivals of the known devices between the calls of hotplug_waiter_wait().
+ * The devices connected before hotplug_waiter_start() are not reported, so a device which is present,
+ * but cannot be opened, does not end the wait.
+ */
+typedef struct HotplugWaiter {
+    libusb_hotplug_callback_handle handle;
+    // set by the callback, and checked by libusb_handle_events_timeout_completed
+    int arrived;
+    bool registered;
+} HotplugWaiter;
+
+/**
+ * @return RET_NO_ERROR, or RET_COMM_ERROR if the hotplug notifications are not available on this platform
+ */
+int hotplug_waiter_start(HotplugWaiter *waiter);
+
+/**
+ * Wait for a known device arriving since the start, or since the previous call.
+ * @return RET_NO_ERROR on an arrival, RET_NOT_FOUND on timeout, RET_COMM_ERROR on the event handling error
+ */
+int hotplug_waiter_wait(HotplugWaiter *waiter, uint32_t timeout_ms);
+
+void hotplug_waiter_stop(HotplugWaiter *waiter);
+
+#endif//NITROKEY_HOTP_VERIFICATION_HOTPLUG_H
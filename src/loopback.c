@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "loopback.h"
+#include "device.h"
+#include "min.h"
+#include "return_codes.h"
+#include "transport.h"
+#include "utils.h"
+#include <string.h>
+
+
+static int echo_on_send(void *ctx, const uint8_t *data, size_t length) {
+    LoopbackState *state = ctx;
+    state->frame_length = min(length, sizeof state->frame);
+    memmove(state->frame, data, state->frame_length);
+    return RET_NO_ERROR;
+}
+
+static int echo_on_receive(void *ctx, uint8_t *data, size_t length, size_t *actual_length) {
+    LoopbackState *state = ctx;
+    *actual_length = min(length, state->frame_length);
+    memmove(data, state->frame, *actual_length);
+    return RET_NO_ERROR;
+}
+
+int loopback_connect(struct Device *dev, LoopbackState *state, const LoopbackPeer *peer,
+                     ConnectionType protocol, VidPid dev_info) {
+    rassert(dev != nullptr);
+    rassert(state != nullptr);
+    rassert(protocol == CONNECTION_HID || protocol == CONNECTION_CCID);
+
+    memset(state, 0, sizeof *state);
+    if (peer != nullptr) {
+        state->peer = *peer;
+    } else {
+        state->peer.on_send = echo_on_send;
+        state->peer.on_receive = echo_on_receive;
+        state->peer.ctx = state;
+    }
+    state->protocol = protocol;
+    state->dev_info = dev_info;
+    dev->transport_state = state;
+    return device_connect_transport(dev, &transport_loopback);
+}
+
+static int loopback_open(struct Device *dev) {
+    LoopbackState *state = dev->transport_state;
+    if (state == nullptr) {
+        return RET_COMM_ERROR;
+    }
+    dev->dev_info = state->dev_info;
+    dev->connection_type = state->protocol;
+    return RET_NO_ERROR;
+}
+
+static int loopback_send(struct Device *dev, const uint8_t *data, size_t length) {
+    LoopbackState *state = dev->transport_state;
+    return state->peer.on_send(state->peer.ctx, data, length);
+}
+
+static int loopback_receive(struct Device *dev, uint8_t *data, size_t length, size_t *actual_length) {
+    LoopbackState *state = dev->transport_state;
+    return state->peer.on_receive(state->peer.ctx, data, length, actual_length);
+}
+
+static int loopback_poll(struct Device *dev, uint32_t timeout_ms) {
+    LoopbackState *state = dev->transport_state;
+    if (state->peer.on_poll == nullptr) {
+        return RET_NO_ERROR;
+    }
+    return state->peer.on_poll(state->peer.ctx, timeout_ms);
+}
+
+static int loopback_close(struct Device *dev) {
+    dev->transport_state = nullptr;
+    return RET_NO_ERROR;
+}
+
+const Transport transport_loopback = {
+        .name = "loopback",
+        .open = loopback_open,
+        .send = loopback_send,
+        .receive = loopback_receive,
+        .poll = loopback_poll,
+        .close = loopback_close,
+};
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#ifndef NITROKEY_HOTP_VERIFICATION_LOOPBACK_H
+#define NITROKEY_HOTP_VERIFICATION_LOOPBACK_H
+
+#include "device.h"
+#include "settings.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * In-process counterpart of the loopback transport. Gets every frame sent by the host,
+ * and produces the frames read back. All callbacks return RET_NO_ERROR on success.
+ */
+typedef struct LoopbackPeer {
+    int (*on_send)(void *ctx, const uint8_t *data, size_t length);
+    int (*on_receive)(void *ctx, uint8_t *data, size_t length, size_t *actual_length);
+    // Optional. Wait up to timeout_ms for the response to be ready. Returns immediately if not set.
+    int (*on_poll)(void *ctx, uint32_t timeout_ms);
+    void *ctx;
+} LoopbackPeer;
+
+typedef struct LoopbackState {
+    LoopbackPeer peer;
+    // Protocol carried over the transport, CONNECTION_HID or CONNECTION_CCID
+    ConnectionType protocol;
+    VidPid dev_info;
+    // Last sent frame, returned back by the echo peer
+    uint8_t frame[MAX_CCID_BUFFER_SIZE];
+    size_t frame_length;
+} LoopbackState;
+
+/**
+ * Connect the device object over the loopback transport.
+ * When peer is NULL, each received frame is the copy of the last sent one.
+ * The state object has to outlive the connection.
+ */
+int loopback_connect(struct Device *dev, LoopbackState *state, const LoopbackPeer *peer,
+                     ConnectionType protocol, VidPid dev_info);
+
+#endif//NITROKEY_HOTP_VERIFICATION_LOOPBACK_H
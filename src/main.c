@@ -20,16 +20,24 @@
  */
 
 #include "ccid.h"
+#include "hotplug.h"
 #include "operations.h"
 #include "return_codes.h"
+#include "server.h"
+#include "status_board.h"
+#include "usb_context.h"
 #include "utils.h"
 #include "version.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 static struct Device dev = {};
 
 int parse_cmd_and_run(int argc, char *const *argv);
+void print_result(int res);
+static int run_command(int argc, char *const *argv);
 
 void print_help(char *app_name) {
     printf("Available commands: \n"
@@ -38,30 +46,46 @@ void print_help(char *app_name) {
            "\t%s version\n"
            "\t%s check <HOTP CODE>\n"
            "\t%s regenerate <ADMIN PIN>\n"
-           "\t%s set <BASE32 HOTP SECRET> <ADMIN PIN> [COUNTER]\n",
-           app_name, app_name, app_name, app_name, app_name, app_name);
+           "\t%s set <BASE32 HOTP SECRET> <ADMIN PIN> [COUNTER]\n"
+           "\t%s watch [SECONDS]\n"
+           "\t%s daemon\n"
+           "\t%s status\n"
+           "\t%s script <FILE | -> [stop | continue]\n",
+           app_name, app_name, app_name, app_name, app_name, app_name, app_name, app_name, app_name, app_name);
 }
 
 
 int main(int argc, char *argv[]) {
+    const bool print_timings = getenv("HOTP_VERIFICATION_TIMINGS") != NULL;
+    if (print_timings) {
+        dev.timings.main_us = micros();
+        dev.timings.process_start_us = process_start_micros();
+    }
     printf("HOTP code verification application, version %s\n", VERSION);
 
     int res;
 
-    if (argc != 1 && argv[1][0] != 'v') {
+    // status is read from the board published by the daemon, and script runs its commands by itself
+    const bool local_command = argc != 1 && (strcmp(argv[1], "status") == 0 || strcmp(argv[1], "script") == 0);
+    if (argc != 1 && !local_command) {
+        // served by the running daemon, if there is one
+        res = server_forward(argc - 1, argv + 1);
+        if (res >= 0) {
+            return res;
+        }
+    }
+
+    if (argc != 1 && argv[1][0] != 'v' && argv[1][0] != 'w' && argv[1][0] != 'd' && !local_command) {
         res = device_connect(&dev);
         if (res != RET_NO_ERROR) {
             printf("Could not connect to the device\n");
+            usb_context_release();
             return EXIT_CONNECTION_ERROR;
         }
     }
 
     res = parse_cmd_and_run(argc, argv);
-    if (res != dev_ok && res != RET_NO_ERROR && res != RET_VALIDATION_PASSED && res != RET_VALIDATION_FAILED) {
-        printf("Error occurred, status code %d: %s\n", res, res_to_error_string(res));
-    } else {
-        printf("%s\n", res_to_error_string(res));
-    }
+    print_result(res);
 
 #ifdef _DEBUG
     if (res < dev_command_status_range && res != dev_ok) {
@@ -69,12 +93,24 @@ int main(int argc, char *argv[]) {
     }
 #endif
 
+    if (print_timings) {
+        device_print_timings(&dev);
+    }
     device_disconnect(&dev);
+    usb_context_release();
 
     res = res_to_exit_code(res);
     return res;
 }
 
+void print_result(int res) {
+    if (res != dev_ok && res != RET_NO_ERROR && res != RET_VALIDATION_PASSED && res != RET_VALIDATION_FAILED) {
+        printf("Error occurred, status code %d: %s\n", res, res_to_error_string(res));
+    } else {
+        printf("%s\n", res_to_error_string(res));
+    }
+}
+
 void print_card_serial(struct ResponseStatus *status) {
     if ((*status).card_serial_u32 != 0) {
         printf("0x%X\n", (*status).card_serial_u32);
@@ -83,7 +119,183 @@ void print_card_serial(struct ResponseStatus *status) {
     }
 }
 
+static void print_time(int64_t seconds) {
+    char text[32];
+    const time_t t = (time_t) seconds;
+    struct tm local;
+    strftime(text, sizeof text, "%Y-%m-%d %H:%M:%S", localtime_r(&t, &local));
+    printf("%s\n", text);
+}
+
+static int print_published_status(void) {
+    StatusBoard board;
+    if (status_board_open(&board, nullptr) != RET_NO_ERROR) {
+        printf("No device status published, the daemon is not running\n");
+        return RET_NOT_FOUND;
+    }
+    StatusSnapshot snapshot;
+    const bool read = status_board_read(&board, &snapshot);
+    status_board_close(&board);
+    check_ret(!read, RET_COMM_ERROR);
+
+    printf("Published device status:\n");
+    printf("\tConnected: %s\n", snapshot.connected ? snapshot.model : "no");
+    if (snapshot.status_time != 0) {
+        printf("\tCard serial: ");
+        if (snapshot.card_serial != 0) {
+            printf("0x%X\n", snapshot.card_serial);
+        } else {
+            printf("N/A\n");
+        }
+        printf("\tFirmware: v%d.%d\n", snapshot.firmware_major, snapshot.firmware_minor);
+        if (snapshot.pin_set) {
+            printf("\tCard counters: Admin %d, User %d\n", snapshot.retry_admin, snapshot.retry_user);
+        } else {
+            printf("\tCard counters: PIN is not set - set PIN before the first use\n");
+        }
+        printf("\tStatus read at: ");
+        print_time(snapshot.status_time);
+    }
+    if (snapshot.check_time != 0) {
+        printf("\tLast check: %s, at ", res_to_error_string(snapshot.check_result));
+        print_time(snapshot.check_time);
+    }
+    return RET_NO_ERROR;
+}
+
+static bool print_hotplug_event(void *ctx, HotplugEvent event, const VidPid *model, ConnectionType connection_type,
+                                const DeviceLocation *location) {
+    unused(ctx);
+    printf("%s: %s (%04x:%04x, %s) at %d-", event == HOTPLUG_ARRIVED ? "arrived" : "removed", model->name,
+           model->vid, model->pid, connection_type == CONNECTION_CCID ? "CCID" : "HID", location->bus);
+    for (int i = 0; i < location->ports_count; ++i) {
+        printf(i == 0 ? "%d" : ".%d", location->ports[i]);
+    }
+    printf("\n");
+    fflush(stdout);
+    return false;
+}
+
+#define SCRIPT_LINE_SIZE 1024
+#define SCRIPT_MAX_WORDS 6
+
+/**
+ * Run a single script line, over the daemon when it is running, otherwise over the connection made
+ * for the first command needing the device.
+ * @return the command exit code
+ */
+static int run_script_command(const char *app_name, int argc, char **words) {
+    const char command = words[0][0];
+    if (command == 'd' || strcmp(words[0], "script") == 0 || argc > SCRIPT_MAX_WORDS) {
+        return res_to_exit_code(RET_INVALID_PARAMS);
+    }
+    const int forwarded = server_forward(argc, words);
+    if (forwarded >= 0) {
+        return forwarded;
+    }
+    if (dev.transport == nullptr && command != 'v' && command != 'w' && strcmp(words[0], "status") != 0) {
+        const int64_t start = micros();
+        if (device_connect(&dev) != RET_NO_ERROR) {
+            printf("Could not connect to the device\n");
+            return EXIT_CONNECTION_ERROR;
+        }
+        printf("Connected in %.1f ms\n", (micros() - start) / 1000.0);
+    }
+    char *argv[SCRIPT_MAX_WORDS + 1] = {(char *) app_name};
+    memcpy(argv + 1, words, argc * sizeof *words);
+    const int res = run_command(argc + 1, argv);
+    print_result(res);
+    return res_to_exit_code(res);
+}
+
+/**
+ * Run the commands listed in the file one per line, over a single device connection, printing the result
+ * and the time of each. Empty lines and the ones starting with # are skipped. A command starting with !
+ * is expected to fail, like in the shell.
+ * @param keep_going continue after a failed command, instead of stopping
+ * @return RET_NO_ERROR, or RET_SCRIPT_FAILED if any of the commands failed
+ */
+static int run_script(const char *app_name, const char *path, bool keep_going) {
+    const bool from_stdin = strcmp(path, "-") == 0;
+    FILE *f = from_stdin ? stdin : fopen(path, "r");
+    if (f == nullptr) {
+        printf("Cannot open the script %s\n", path);
+        return RET_INVALID_PARAMS;
+    }
+    const int64_t start = micros();
+    char line[SCRIPT_LINE_SIZE];
+    int line_number = 0, commands = 0, failures = 0;
+    while (fgets(line, sizeof line, f) != nullptr) {
+        line_number++;
+        if (strchr(line, '\n') == nullptr) {
+            // the rest of a longer line is dropped, rather than run as another command
+            int c, dropped = 0;
+            while ((c = getc(f)) != EOF && c != '\n') {
+                dropped++;
+            }
+            if (dropped > 0) {
+                commands++;
+                failures++;
+                printf("[%d] line longer than %d characters: exit code %d, FAILED\n", line_number,
+                       SCRIPT_LINE_SIZE - 2, res_to_exit_code(RET_INVALID_PARAMS));
+                fflush(stdout);
+                if (!keep_going) break;
+                continue;
+            }
+        }
+        // with the room for the leading !
+        char *words[SCRIPT_MAX_WORDS + 1];
+        int argc = 0;
+        char *save = nullptr;
+        for (char *word = strtok_r(line, " \t\r\n", &save); word != nullptr; word = strtok_r(nullptr, " \t\r\n", &save)) {
+            // too many words are counted only, and rejected
+            if (argc < (int) LEN_ARR(words)) words[argc] = word;
+            argc++;
+        }
+        if (argc == 0 || words[0][0] == '#') {
+            continue;
+        }
+        const bool expect_failure = strcmp(words[0], "!") == 0;
+        char **command = expect_failure ? words + 1 : words;
+        const int command_argc = expect_failure ? argc - 1 : argc;
+        if (command_argc == 0) {
+            continue;
+        }
+
+        commands++;
+        const int64_t command_start = micros();
+        const int exit_code = run_script_command(app_name, command_argc, command);
+        const bool failed = (exit_code != EXIT_NO_ERROR) != expect_failure;
+        // the arguments are not printed, as they hold the PINs and secrets
+        printf("[%d] %s%s: exit code %d%s, %.1f ms\n", line_number, expect_failure ? "! " : "", command[0],
+               exit_code, failed ? ", FAILED" : "", (micros() - command_start) / 1000.0);
+        fflush(stdout);
+        if (failed) {
+            failures++;
+            if (!keep_going) break;
+        }
+    }
+    if (!from_stdin) {
+        fclose(f);
+    }
+    printf("Script: %d commands, %d failed, %.1f ms\n", commands, failures, (micros() - start) / 1000.0);
+    return failures == 0 ? RET_NO_ERROR : RET_SCRIPT_FAILED;
+}
+
 int parse_cmd_and_run(int argc, char *const *argv) {
+    const int res = run_command(argc, argv);
+    if (argc == 1) {
+        print_help(argv[0]);
+        return RET_NO_ERROR;
+    }
+    if (res == RET_INVALID_PARAMS) {
+        print_help(argv[0]);
+    }
+    return res;
+}
+
+// Run a single command on the connected device, with the application name in argv[0]
+static int run_command(int argc, char *const *argv) {
     int res = RET_INVALID_PARAMS;
     if (argc > 1) {
         switch (argv[1][0]) {
@@ -124,6 +336,16 @@ int parse_cmd_and_run(int argc, char *const *argv) {
                 res = check_code_on_device(&dev, argv[2]);
                 break;
             case 's':
+                if (strcmp(argv[1], "status") == 0) {
+                    if (argc == 2) res = print_published_status();
+                    break;
+                }
+                if (strcmp(argv[1], "script") == 0) {
+                    if (argc != 3 && argc != 4) break;
+                    if (argc == 4 && strcmp(argv[3], "stop") != 0 && strcmp(argv[3], "continue") != 0) break;
+                    res = run_script(argv[0], argv[2], argc == 4 && strcmp(argv[3], "continue") == 0);
+                    break;
+                }
                 if (argc != 4 && argc != 5) break;
                 {
                     uint64_t counter = 0;
@@ -137,15 +359,29 @@ int parse_cmd_and_run(int argc, char *const *argv) {
                 if (argc != 3) break;
                 res = regenerate_AES_key(&dev, argv[2]);
                 break;
+            case 'w':
+                if (argc != 2 && argc != 3) break;
+                {
+                    long seconds = 0;
+                    if (argc == 3) {
+                        if (argv[2][0] == 0 || !validate_number(argv[2])) break;
+                        seconds = strtol10_s(argv[2]);
+                        if (seconds < 0 || seconds > UINT32_MAX / 1000) break;
+                    }
+                    res = hotplug_watch((uint32_t) seconds * 1000, true, print_hotplug_event, nullptr);
+                    if (res == RET_NOT_FOUND) {
+                        // watch time has passed
+                        res = RET_NO_ERROR;
+                    }
+                }
+                break;
+            case 'd':
+                if (argc != 2) break;
+                res = server_run();
+                break;
             default:
                 break;
         }
     }
-    if (argc == 1) {
-        print_help(argv[0]);
-        res = RET_NO_ERROR;
-    } else if (res == RET_INVALID_PARAMS) {
-        print_help(argv[0]);
-    }
     return res;
 }
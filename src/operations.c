@@ -21,6 +21,7 @@
 
 #include "operations.h"
 #include "base32.h"
+#include "base32_decoder.h"
 #include "command_id.h"
 #include "dev_commands.h"
 #include "device.h"
@@ -51,16 +52,32 @@ bool verify_base32(const char *string, size_t len) {
     return true;
 }
 
+// The decoding stopped on a character not valid in its place, and not on the data exceeding the secret size
+static bool is_unexpected_base32_character(const char *coded, size_t position) {
+    const char c = coded[position];
+    const bool is_data = (c >= 'A' && c <= 'Z') || (c >= '2' && c <= '7');
+    return !is_data || memchr(coded, '=', position) != nullptr;
+}
+
 int set_secret_on_device(struct Device *dev, const char *OTP_secret_base32, const char *admin_PIN, const uint64_t hotp_counter) {
     rassert(OTP_secret_base32 != nullptr);
     rassert(dev != nullptr);
     rassert(admin_PIN != nullptr);
     int res;
-    //Make sure secret is parsable
+    //Make sure secret is parsable, and decode it to binary
     const size_t base32_string_length_limit = BASE32_LEN(HOTP_SECRET_SIZE_BYTES);
-    const size_t OTP_secret_base32_length = strnlen(OTP_secret_base32, base32_string_length_limit);
-    if (!(OTP_secret_base32 != nullptr && OTP_secret_base32_length > 0 && OTP_secret_base32_length <= base32_string_length_limit && verify_base32(OTP_secret_base32, OTP_secret_base32_length))) {
+    const size_t OTP_secret_base32_length = strnlen(OTP_secret_base32, base32_string_length_limit + 1);
+    uint8_t binary_secret_buf[HOTP_SECRET_SIZE_BYTES] = {0};//handling 40 bytes -> 320 bits
+    size_t decoded_length = 0;
+    size_t error_position = 0;
+    if (OTP_secret_base32_length == 0 || OTP_secret_base32_length > base32_string_length_limit ||
+        base32_decode_checked(OTP_secret_base32, OTP_secret_base32_length, binary_secret_buf, sizeof(binary_secret_buf),
+                              &decoded_length, &error_position) != RET_NO_ERROR) {
         printf("ERR: Too long or badly formatted base32 string. It should be not longer than %lu characters.\n", base32_string_length_limit);
+        if (OTP_secret_base32_length > 0 && OTP_secret_base32_length <= base32_string_length_limit &&
+            is_unexpected_base32_character(OTP_secret_base32, error_position)) {
+            printf("ERR: Unexpected character at position %zu.\n", error_position + 1);
+        }
         return RET_BADLY_FORMATTED_BASE32_STRING;
     }
 
@@ -71,15 +88,9 @@ int set_secret_on_device(struct Device *dev, const char *OTP_secret_base32, cons
             check_ret(authenticate_ccid(dev, admin_PIN), RET_WRONG_PIN);
         }
 #endif
-        return set_secret_on_device_ccid(dev, OTP_secret_base32, hotp_counter);
+        return set_decoded_secret_on_device_ccid(dev, binary_secret_buf, decoded_length, hotp_counter);
     }
 
-
-    //Decode base32 to binary
-    uint8_t binary_secret_buf[HOTP_SECRET_SIZE_BYTES] = {0};//handling 40 bytes -> 320 bits
-    const size_t decoded_length = base32_decode((const unsigned char *) OTP_secret_base32, binary_secret_buf);
-    rassert(decoded_length <= HOTP_SECRET_SIZE_BYTES);
-
     rassert(dev->connection_type == CONNECTION_HID);
     //Write binary secret to the Device's HOTP#3 slot
     //But authenticate first
@@ -170,9 +181,9 @@ int check_code_on_device_ccid(struct Device *dev, uint32_t HOTP_code_to_verify)
             input_admin_PIN[r - 1] = 0;// remove the final \n character
             printf("\n");
 
-            res = authenticate_ccid(dev->mp_devhandle_ccid, input_admin_PIN);
+            res = authenticate_ccid(dev, input_admin_PIN);
         }
-        return verify_code_ccid(dev->mp_devhandle_ccid, HOTP_code_to_verify);
+        return verify_code_ccid(dev, HOTP_code_to_verify);
     }
 #endif
 
@@ -237,6 +248,7 @@ int regenerate_AES_key_Pro(struct Device *dev, const char *const admin_password)
     usleep(1 * 1000 * 1000);
     uint16_t errors_cnt = 20;
     while (status == 1) {
+        device_yield(dev);
         usleep(1 * 1000 * 1000);
         fprintf(stderr, ".");
         fflush(stderr);
@@ -278,6 +290,7 @@ int regenerate_AES_key_Storage(struct Device *dev, const char *const admin_passw
     }
     uint8_t status = dev->packet_response.response_st.storage_status.device_status;
     while (status == NK_STORAGE_BUSY) {
+        device_yield(dev);
         usleep(100 * 1000);
         fprintf(stderr, ".");
         fflush(stderr);
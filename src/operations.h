@@ -38,6 +38,7 @@ int check_code_on_device(struct Device *dev, const char *HOTP_code_to_verify);
 bool verify_base32(const char *string, size_t len);
 
 long strtol10_s(const char *string);
+bool validate_number(const char *buf);
 
 int regenerate_AES_key(struct Device *dev, const char *const admin_password);
 
@@ -21,6 +21,7 @@
 
 #include "operations_ccid.h"
 #include "base32.h"
+#include "base32_decoder.h"
 #include "ccid.h"
 #include "device.h"
 #include "return_codes.h"
@@ -44,13 +45,17 @@ int set_pin_ccid(struct Device *dev, const char *admin_PIN) {
 
     clean_buffers(dev);
     // encode
-    uint32_t icc_actual_length = icc_pack_tlvs_for_sending(dev->ccid_buffer_out, sizeof dev->ccid_buffer_out,
-                                                           tlvs, ARR_LEN(tlvs), Ins_SetPIN);
+    uint32_t icc_actual_length = 0;
+    int r = icc_pack_tlvs_for_sending(dev->ccid_buffer_out, sizeof dev->ccid_buffer_out,
+                                      tlvs, ARR_LEN(tlvs), Ins_SetPIN, &icc_actual_length);
+    if (r != RET_NO_ERROR) {
+        return r;
+    }
 
     // send
     IccResult iccResult;
-    int r = ccid_process_single(dev->mp_devhandle_ccid, dev->ccid_buffer_in, sizeof dev->ccid_buffer_in,
-                                dev->ccid_buffer_out, icc_actual_length, &iccResult);
+    r = ccid_process_single(dev, dev->ccid_buffer_in, sizeof dev->ccid_buffer_in,
+                            dev->ccid_buffer_out, icc_actual_length, &iccResult);
 
     if (r != 0) {
         return r;
@@ -76,12 +81,16 @@ int authenticate_ccid(struct Device *dev, const char *admin_PIN) {
 
     clean_buffers(dev);
     // encode
-    uint32_t icc_actual_length = icc_pack_tlvs_for_sending(dev->ccid_buffer_out, sizeof dev->ccid_buffer_out,
-                                                           tlvs, ARR_LEN(tlvs), Ins_VerifyPIN);
+    uint32_t icc_actual_length = 0;
+    int r = icc_pack_tlvs_for_sending(dev->ccid_buffer_out, sizeof dev->ccid_buffer_out,
+                                      tlvs, ARR_LEN(tlvs), Ins_VerifyPIN, &icc_actual_length);
+    if (r != RET_NO_ERROR) {
+        return r;
+    }
     // send
     IccResult iccResult;
-    int r = ccid_process_single(dev->mp_devhandle_ccid, dev->ccid_buffer_in, sizeof dev->ccid_buffer_in,
-                                dev->ccid_buffer_out, icc_actual_length, &iccResult);
+    r = ccid_process_single(dev, dev->ccid_buffer_in, sizeof dev->ccid_buffer_in,
+                            dev->ccid_buffer_out, icc_actual_length, &iccResult);
     if (r != 0) {
         return r;
     }
@@ -101,10 +110,21 @@ int authenticate_ccid(struct Device *dev, const char *admin_PIN) {
 
 
 int set_secret_on_device_ccid(struct Device *dev, const char *OTP_secret_base32, const uint64_t hotp_counter) {
-    // Decode base32 secret
+    uint8_t secret[HOTP_SECRET_SIZE_BYTES];
+    size_t secret_length = 0;
+    if (base32_decode_checked(OTP_secret_base32, strnlen(OTP_secret_base32, BASE32_LEN(HOTP_SECRET_SIZE_BYTES) + 1),
+                              secret, sizeof(secret), &secret_length, nullptr) != RET_NO_ERROR) {
+        return RET_BADLY_FORMATTED_BASE32_STRING;
+    }
+    return set_decoded_secret_on_device_ccid(dev, secret, secret_length, hotp_counter);
+}
+
+int set_decoded_secret_on_device_ccid(struct Device *dev, const uint8_t *secret, const size_t secret_length, const uint64_t hotp_counter) {
+    // Prefix the secret with the kind and digits bytes
     uint8_t binary_secret_buf[HOTP_SECRET_SIZE_BYTES + 2] = {0};
-    const size_t decoded_length = base32_decode((const unsigned char *) OTP_secret_base32, binary_secret_buf + 2) + 2;
+    const size_t decoded_length = secret_length + 2;
     rassert(decoded_length <= HOTP_SECRET_SIZE_BYTES);
+    memcpy(binary_secret_buf + 2, secret, secret_length);
 
     binary_secret_buf[0] = Kind_HotpReverse | Algo_Sha1;
     binary_secret_buf[1] = (HOTP_CODE_USE_8_DIGITS) ? 8 : 6;
@@ -145,13 +165,17 @@ int set_secret_on_device_ccid(struct Device *dev, const char *OTP_secret_base32,
 
     clean_buffers(dev);
     // encode
-    uint32_t icc_actual_length = icc_pack_tlvs_for_sending(dev->ccid_buffer_out, sizeof dev->ccid_buffer_out,
-                                                           tlvs, ARR_LEN(tlvs), Ins_Put);
+    uint32_t icc_actual_length = 0;
+    int r = icc_pack_tlvs_for_sending(dev->ccid_buffer_out, sizeof dev->ccid_buffer_out,
+                                      tlvs, ARR_LEN(tlvs), Ins_Put, &icc_actual_length);
+    if (r != RET_NO_ERROR) {
+        return r;
+    }
 
     // send
     IccResult iccResult;
-    int r = ccid_process_single(dev->mp_devhandle_ccid, dev->ccid_buffer_in, sizeof dev->ccid_buffer_in,
-                                dev->ccid_buffer_out, icc_actual_length, &iccResult);
+    r = ccid_process_single(dev, dev->ccid_buffer_in, sizeof dev->ccid_buffer_in,
+                            dev->ccid_buffer_out, icc_actual_length, &iccResult);
 
 
     if (r != 0) {
@@ -171,9 +195,7 @@ int set_secret_on_device_ccid(struct Device *dev, const char *OTP_secret_base32,
     return RET_NO_ERROR;
 }
 
-int verify_code_ccid(struct Device *dev, const uint32_t code_to_verify) {
-    int r;
-
+int verify_code_ccid_prepare(PreparedCommand *command) {
     TLV tlvs[] = {
             {
                     .tag = Tag_CredentialId,
@@ -185,20 +207,16 @@ int verify_code_ccid(struct Device *dev, const uint32_t code_to_verify) {
                     .tag = Tag_Response,
                     .length = 4,
                     .type = 'I',
-                    .v_raw = code_to_verify,
+                    .v_raw = 0,
             },
     };
+    return ccid_prepare_command(command, tlvs, ARR_LEN(tlvs), Ins_VerifyCode, Tag_Response);
+}
 
-
-    clean_buffers(dev);
-    // encode
-    uint32_t icc_actual_length = icc_pack_tlvs_for_sending(dev->ccid_buffer_out, sizeof dev->ccid_buffer_out,
-                                                           tlvs, ARR_LEN(tlvs), Ins_VerifyCode);
-
+int verify_code_ccid_prepared(struct Device *dev, PreparedCommand *command, const uint32_t code_to_verify) {
     // send
     IccResult iccResult;
-    r = ccid_process_single(dev->mp_devhandle_ccid, dev->ccid_buffer_in, sizeof dev->ccid_buffer_in,
-                            dev->ccid_buffer_out, icc_actual_length, &iccResult);
+    int r = ccid_execute_prepared(dev, command, code_to_verify, &iccResult);
     if (r != 0) {
         return r;
     }
@@ -215,14 +233,25 @@ int verify_code_ccid(struct Device *dev, const uint32_t code_to_verify) {
     return RET_VALIDATION_PASSED;
 }
 
-int status_ccid(libusb_device_handle *handle, int *attempt_counter, uint16_t *firmware_version, uint32_t *serial_number) {
-    rassert(handle != NULL);
+int verify_code_ccid(struct Device *dev, const uint32_t code_to_verify) {
+    // encoded on the first call, the next ones patch in the code only
+    if (dev->verify_command.length == 0) {
+        int r = verify_code_ccid_prepare(&dev->verify_command);
+        if (r != RET_NO_ERROR) {
+            return r;
+        }
+    }
+    return verify_code_ccid_prepared(dev, &dev->verify_command, code_to_verify);
+}
+
+int status_ccid(struct Device *dev, int *attempt_counter, uint16_t *firmware_version, uint32_t *serial_number) {
+    rassert(dev != NULL);
     rassert(attempt_counter != NULL);
     rassert(firmware_version != NULL);
     rassert(serial_number != NULL);
     uint8_t buf[1024] = {};
     IccResult iccResult = {};
-    int r = send_select_ccid(handle, buf, sizeof buf, &iccResult);
+    int r = send_select_ccid(dev, buf, sizeof buf, &iccResult);
     if (r != RET_NO_ERROR) {
         return r;
     }
@@ -230,31 +259,36 @@ int status_ccid(libusb_device_handle *handle, int *attempt_counter, uint16_t *fi
         return RET_COMM_ERROR;
     }
 
-    TLV counter_tlv = {};
-    r = get_tlv(iccResult.data, iccResult.data_len, Tag_PINCounter, &counter_tlv);
-    if (!(r == RET_NO_ERROR && counter_tlv.tag == Tag_PINCounter)) {
-        // PIN counter not found - comm error (ignore) or PIN not set
+    // a single pass over the response, validating all of it
+    TlvIndex index;
+    r = tlv_index_parse(&index, iccResult.data, iccResult.data_len);
+    if (r != RET_NO_ERROR) {
+        return RET_COMM_ERROR;
+    }
+
+    const TlvView *counter = tlv_index_find(&index, Tag_PINCounter);
+    if (counter == NULL || counter->length < 1) {
+        // PIN counter not found - PIN not set
         *attempt_counter = -1;
     } else {
-        *attempt_counter = counter_tlv.v_data[0];
+        *attempt_counter = counter->value[0];
     }
 
-    TLV serial_tlv = {};
-    r = get_tlv(iccResult.data, iccResult.data_len, Tag_SerialNumber, &serial_tlv);
-    if (r == RET_NO_ERROR && serial_tlv.tag == Tag_SerialNumber) {
-        *serial_number = be32toh(*(uint32_t *) serial_tlv.v_data);
+    const TlvView *serial = tlv_index_find(&index, Tag_SerialNumber);
+    if (serial != NULL && serial->length == 4) {
+        *serial_number = ((uint32_t) serial->value[0] << 24) | ((uint32_t) serial->value[1] << 16) |
+                         ((uint32_t) serial->value[2] << 8) | serial->value[3];
     } else {
-        // ignore errors - unsupported or hidden serial_tlv number
+        // ignore errors - unsupported or hidden serial number
         *serial_number = 0;
     }
 
-    TLV version_tlv = {};
-    r = get_tlv(iccResult.data, iccResult.data_len, Tag_Version, &version_tlv);
-    if (!(r == RET_NO_ERROR && version_tlv.tag == Tag_Version)) {
+    const TlvView *version = tlv_index_find(&index, Tag_Version);
+    if (version == NULL || version->length < 2) {
         *firmware_version = 0;
         return RET_COMM_ERROR;
     }
-    *firmware_version = be16toh(*(uint16_t *) version_tlv.v_data);
+    *firmware_version = (uint16_t) ((version->value[0] << 8) | version->value[1]);
 
     if (*attempt_counter == -1) {
         return RET_NO_PIN_ATTEMPTS;
@@ -2,14 +2,20 @@
 #ifndef NITROKEY_HOTP_VERIFICATION_OPERATIONS_CCID_H
 #define NITROKEY_HOTP_VERIFICATION_OPERATIONS_CCID_H
 
+#include "ccid.h"
 #include "device.h"
 #include <libusb.h>
 
 int set_pin_ccid(struct Device *dev, const char *admin_PIN);
 int authenticate_ccid(struct Device *dev, const char *admin_PIN);
 int set_secret_on_device_ccid(struct Device *dev, const char *OTP_secret_base32, const uint64_t hotp_counter);
+// The same with the secret already decoded from base32
+int set_decoded_secret_on_device_ccid(struct Device *dev, const uint8_t *secret, const size_t secret_length, const uint64_t hotp_counter);
 int verify_code_ccid(struct Device *dev, const uint32_t code_to_verify);
-int status_ccid(libusb_device_handle *handle, int *attempt_counter, uint16_t *firmware_version, uint32_t *serial_number);
+// Encode the verification command for the SLOT_NAME credential, to be sent with verify_code_ccid_prepared
+int verify_code_ccid_prepare(PreparedCommand *command);
+int verify_code_ccid_prepared(struct Device *dev, PreparedCommand *command, const uint32_t code_to_verify);
+int status_ccid(struct Device *dev, int *attempt_counter, uint16_t *firmware_version, uint32_t *serial_number);
 
 
 #endif//NITROKEY_HOTP_VERIFICATION_OPERATIONS_CCID_H
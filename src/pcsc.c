@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+/**
+ * CCID transport through the PC/SC (winscard) API, sharing the card with pcscd and its other clients.
+ * The CCID XfrBlock frames composed in ccid.c are unwrapped to the APDUs for SCardTransmit,
+ * and the responses are wrapped back into the DataBlock frames, so ccid_process_single() works unchanged.
+ * Each command exchange runs in its own PC/SC transaction, so the other clients (like GnuPG) keep access
+ * to the card between the commands. Another client may select a different applet meanwhile, so every
+ * transaction starts with selecting the Secrets App again.
+ * Compiled with FEATURE_USE_PCSC, set by the build system together with the pcsc-lite link flags.
+ */
+
+#include "settings.h"
+
+#ifdef FEATURE_USE_PCSC
+
+#include "ccid.h"
+#include "device.h"
+#include "return_codes.h"
+#include "transport.h"
+#include "utils.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __APPLE__
+#include <PCSC/winscard.h>
+#include <PCSC/wintypes.h>
+#else
+#include <winscard.h>
+#endif
+
+// Part of the reader name to look for, overridden with HOTP_VERIFICATION_PCSC_READER (e.g. for vpcd)
+static const char DEFAULT_READER_NAME[] = "Nitrokey 3";
+
+typedef struct PcscState {
+    SCARDCONTEXT context;
+    SCARDHANDLE card;
+    DWORD protocol;
+    bool in_transaction;
+    // SELECT of the Secrets App, sent first in each transaction
+    uint8_t select_frame[32];
+    const uint8_t *select_apdu;
+    size_t select_apdu_length;
+    // DataBlock frame with the last response, waiting for the receive call
+    uint8_t response[MAX_CCID_BUFFER_SIZE];
+    size_t response_length;
+} PcscState;
+
+static void pcsc_release(PcscState *s) {
+    if (s->in_transaction) {
+        SCardEndTransaction(s->card, SCARD_LEAVE_CARD);
+    }
+    if (s->card != 0) {
+        SCardDisconnect(s->card, SCARD_LEAVE_CARD);
+    }
+    SCardReleaseContext(s->context);
+    free(s);
+}
+
+// Connect to the first reader with the expected name, which has a card present
+static LONG pcsc_connect_reader(PcscState *s, const char *reader_name) {
+    DWORD readers_length = 0;
+    LONG r = SCardListReaders(s->context, NULL, NULL, &readers_length);
+    if (r != SCARD_S_SUCCESS) {
+        return r;
+    }
+    char *readers = calloc(1, readers_length + 1);
+    if (readers == NULL) {
+        return SCARD_E_NO_MEMORY;
+    }
+    r = SCardListReaders(s->context, NULL, readers, &readers_length);
+    if (r == SCARD_S_SUCCESS) {
+        r = SCARD_E_UNKNOWN_READER;
+        // the list is a sequence of NUL terminated strings, ending with an empty one
+        for (const char *reader = readers; *reader != 0; reader += strlen(reader) + 1) {
+            if (strstr(reader, reader_name) == NULL) {
+                continue;
+            }
+            r = SCardConnect(s->context, reader, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1,
+                             &s->card, &s->protocol);
+            if (r == SCARD_S_SUCCESS) {
+                LOG("Connected to the PC/SC reader: %s\n", reader);
+                break;
+            }
+        }
+    }
+    free(readers);
+    return r;
+}
+
+static int pcsc_open(struct Device *dev) {
+    const char *reader_name = getenv("HOTP_VERIFICATION_PCSC_READER");
+    if (reader_name == NULL || reader_name[0] == 0) {
+        reader_name = DEFAULT_READER_NAME;
+    }
+
+    PcscState *s = calloc(1, sizeof *s);
+    if (s == NULL) {
+        return RET_COMM_ERROR;
+    }
+    const uint32_t select_length = compose_select(s->select_frame, sizeof s->select_frame);
+    rassert(icc_unwrap_apdu(s->select_frame, select_length, &s->select_apdu, &s->select_apdu_length) == RET_NO_ERROR);
+    LONG r = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &s->context);
+    if (r != SCARD_S_SUCCESS) {
+        // no PC/SC service running
+        free(s);
+        return RET_COMM_ERROR;
+    }
+    r = pcsc_connect_reader(s, reader_name);
+    if (r != SCARD_S_SUCCESS) {
+        LOG("PC/SC connection failed: 0x%lx\n", (unsigned long) r);
+        pcsc_release(s);
+        return RET_COMM_ERROR;
+    }
+
+    dev->transport_state = s;
+    dev->dev_info = devices_ccid[0];
+    dev->connection_type = CONNECTION_CCID;
+    return RET_NO_ERROR;
+}
+
+static LONG pcsc_begin_transaction(PcscState *s) {
+    LONG r = SCardBeginTransaction(s->card);
+    if (r == SCARD_W_RESET_CARD) {
+        // reset by another application since the last command
+        r = SCardReconnect(s->card, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, SCARD_LEAVE_CARD,
+                           &s->protocol);
+        if (r == SCARD_S_SUCCESS) {
+            r = SCardBeginTransaction(s->card);
+        }
+    }
+    s->in_transaction = r == SCARD_S_SUCCESS;
+    return r;
+}
+
+static void pcsc_end_transaction(PcscState *s) {
+    if (s->in_transaction) {
+        SCardEndTransaction(s->card, SCARD_LEAVE_CARD);
+        s->in_transaction = false;
+    }
+}
+
+static LONG pcsc_transmit(PcscState *s, const uint8_t *apdu, size_t apdu_length, DWORD *response_length) {
+    const SCARD_IO_REQUEST *pci = s->protocol == SCARD_PROTOCOL_T0 ? SCARD_PCI_T0 : SCARD_PCI_T1;
+    *response_length = sizeof s->response - ICC_HEADER_SIZE;
+    return SCardTransmit(s->card, pci, apdu, apdu_length, NULL, s->response + ICC_HEADER_SIZE, response_length);
+}
+
+static int pcsc_send(struct Device *dev, const uint8_t *data, size_t length) {
+    PcscState *s = dev->transport_state;
+    const uint8_t *apdu;
+    size_t apdu_length;
+    if (icc_unwrap_apdu(data, length, &apdu, &apdu_length) != RET_NO_ERROR || apdu_length < APDU_HEADER_SIZE) {
+        return RET_COMM_ERROR;
+    }
+
+    DWORD response_length;
+    LONG r = SCARD_S_SUCCESS;
+    if (!s->in_transaction) {
+        r = pcsc_begin_transaction(s);
+        if (r == SCARD_S_SUCCESS && apdu[1] != Ins_Select) {
+            r = pcsc_transmit(s, s->select_apdu, s->select_apdu_length, &response_length);
+        }
+    }
+    if (r == SCARD_S_SUCCESS) {
+        r = pcsc_transmit(s, apdu, apdu_length, &response_length);
+    }
+    if (r != SCARD_S_SUCCESS) {
+        LOG("SCardTransmit failed: 0x%lx\n", (unsigned long) r);
+        pcsc_end_transaction(s);
+        return RET_CONNECTION_LOST;
+    }
+    // Keep the transaction while the rest of the response waits for GET RESPONSE
+    const bool data_remaining = response_length >= 2 &&
+                                s->response[ICC_HEADER_SIZE + response_length - 2] == DATA_REMAINING_STATUS_CODE;
+    if (!data_remaining) {
+        pcsc_end_transaction(s);
+    }
+
+    icc_write_data_block_header(s->response, (uint32_t) response_length, data[ICC_SEQ_OFFSET], 0);
+    s->response_length = ICC_HEADER_SIZE + response_length;
+    return RET_NO_ERROR;
+}
+
+static int pcsc_receive(struct Device *dev, uint8_t *data, size_t length, size_t *actual_length) {
+    PcscState *s = dev->transport_state;
+    if (s->response_length == 0 || s->response_length > length) {
+        return RET_COMM_ERROR;
+    }
+    memcpy(data, s->response, s->response_length);
+    *actual_length = s->response_length;
+    s->response_length = 0;
+    return RET_NO_ERROR;
+}
+
+static int pcsc_poll(struct Device *dev, uint32_t timeout_ms) {
+    // SCardTransmit returns with the complete response
+    unused(dev);
+    unused(timeout_ms);
+    return RET_NO_ERROR;
+}
+
+static int pcsc_close(struct Device *dev) {
+    if (dev->transport_state == NULL) return RET_UNKNOWN_DEVICE;
+    pcsc_release(dev->transport_state);
+    dev->transport_state = NULL;
+    return RET_NO_ERROR;
+}
+
+const Transport transport_pcsc = {
+        .name = "pcsc",
+        .open = pcsc_open,
+        .send = pcsc_send,
+        .receive = pcsc_receive,
+        .poll = pcsc_poll,
+        .close = pcsc_close,
+};
+
+#endif
@@ -38,6 +38,8 @@ const char *res_to_error_string(int res) {
     if (res == RET_NO_PIN_ATTEMPTS) return "Device does not show PIN attempts counter";
     if (res == RET_SLOT_NOT_CONFIGURED) return "HOTP slot is not configured";
     if (res == RET_SECURITY_STATUS_NOT_SATISFIED) return "Touch was not recognized, or there was other problem with the authentication";
+    if (res == RET_NOT_FOUND) return "Not found";
+    if (res == RET_SCRIPT_FAILED) return "Some of the script commands failed";
     return "Unknown error";
 }
 
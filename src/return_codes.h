@@ -40,6 +40,7 @@ enum {
     RET_SECURITY_STATUS_NOT_SATISFIED,
     RET_SLOT_NOT_CONFIGURED,
     RET_NOT_FOUND,
+    RET_SCRIPT_FAILED,
 };
 
 enum {
@@ -0,0 +1,679 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "server.h"
+#include "device.h"
+#include "operations.h"
+#include "return_codes.h"
+#include "settings.h"
+#include "status_board.h"
+#include "structs.h"
+#include "utils.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SOCKET_FILE_NAME "nitrokey_hotp_verification.sock"
+#define SERVER_MAX_CLIENTS 16
+#define SERVER_LINE_SIZE 256
+#define SERVER_MAX_WORDS 5
+#define SERVER_TEXT_SIZE 128
+// First descriptor passed with the systemd socket activation
+#define SD_LISTEN_FDS_START 3
+
+typedef struct ServerClient {
+    // -1 when the slot is unused
+    int fd;
+    // Received data, not taken as requests yet
+    char line[SERVER_LINE_SIZE];
+    size_t line_length;
+    // Request waiting to be served, split into words
+    bool pending;
+    uint64_t arrival;
+    int64_t received_us;
+    // Time by which the request should be served, ordering the queue
+    int64_t deadline_us;
+    char request[SERVER_LINE_SIZE];
+    char *argv[SERVER_MAX_WORDS];
+    int argc;
+} ServerClient;
+
+typedef struct Server {
+    int listen_fd;
+    // Socket path, set if the socket was created by this process, and has to be removed at the end
+    char created_path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+    ServerClient clients[SERVER_MAX_CLIENTS];
+    struct Device dev;
+    // Counter of the requests taken, giving their arrival order
+    uint64_t arrivals;
+    uint64_t requests_served;
+    uint64_t transactions;
+    // Bounds of the last device transaction
+    int64_t transaction_start_us;
+    int64_t transaction_end_us;
+    // Totals of the time spent by the device transactions, and by the requests waiting for them
+    int64_t device_us;
+    int64_t queue_wait_us;
+    // Print the queue wait and the device time of each request
+    bool print_timings;
+    // Latest known device state, published to the readers not talking to the device
+    StatusBoard board;
+    StatusSnapshot published;
+    // Interval of the device status refresh for the board, 0 when not refreshed
+    int64_t refresh_interval_us;
+    int64_t next_refresh_us;
+} Server;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static bool socket_path(char *path, size_t path_size) {
+    const char *file = getenv("HOTP_VERIFICATION_SOCKET");
+    if (file != nullptr) {
+        if (file[0] == 0) {
+            return false;
+        }
+        return (size_t) snprintf(path, path_size, "%s", file) < path_size;
+    }
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    if (dir == nullptr || dir[0] == 0) {
+        dir = "/run";
+    }
+    return (size_t) snprintf(path, path_size, "%s/%s", dir, SOCKET_FILE_NAME) < path_size;
+}
+
+static bool socket_address(struct sockaddr_un *address) {
+    memset(address, 0, sizeof *address);
+    address->sun_family = AF_UNIX;
+    return socket_path(address->sun_path, sizeof address->sun_path);
+}
+
+static int connect_to(const struct sockaddr_un *address) {
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (const struct sockaddr *) address, sizeof *address) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int activated_socket(void) {
+    const char *pid = getenv("LISTEN_PID");
+    const char *fds = getenv("LISTEN_FDS");
+    if (pid == nullptr || fds == nullptr || strtol(pid, nullptr, 10) != getpid() || strtol(fds, nullptr, 10) < 1) {
+        return -1;
+    }
+    return SD_LISTEN_FDS_START;
+}
+
+static int open_listener(Server *s) {
+    s->listen_fd = activated_socket();
+    if (s->listen_fd >= 0) {
+        printf("Serving on the socket passed by systemd\n");
+        return RET_NO_ERROR;
+    }
+
+    struct sockaddr_un address;
+    if (!socket_address(&address)) {
+        printf("Socket path not set\n");
+        return RET_COMM_ERROR;
+    }
+    s->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s->listen_fd < 0) {
+        printf("Could not create the socket: %s\n", strerror(errno));
+        return RET_COMM_ERROR;
+    }
+    // the requests can advance the HOTP counter, or carry the admin PIN - allow the owner only
+    const mode_t old_umask = umask(0177);
+    int r = bind(s->listen_fd, (const struct sockaddr *) &address, sizeof address);
+    if (r != 0 && errno == EADDRINUSE) {
+        const int other = connect_to(&address);
+        if (other >= 0) {
+            close(other);
+            printf("Another instance is serving on %s already\n", address.sun_path);
+        } else {
+            // left behind by a process which did not exit cleanly
+            unlink(address.sun_path);
+            r = bind(s->listen_fd, (const struct sockaddr *) &address, sizeof address);
+        }
+    }
+    umask(old_umask);
+    if (r != 0 || listen(s->listen_fd, SERVER_MAX_CLIENTS) != 0) {
+        printf("Could not listen on %s: %s\n", address.sun_path, strerror(errno));
+        close(s->listen_fd);
+        return RET_COMM_ERROR;
+    }
+    memcpy(s->created_path, address.sun_path, sizeof s->created_path);
+    printf("Serving on %s\n", address.sun_path);
+    return RET_NO_ERROR;
+}
+
+static void on_stop_signal(int signal) {
+    unused(signal);
+    stop_requested = 1;
+}
+
+static void install_signal_handlers(void) {
+    struct sigaction action = {0};
+    // no SA_RESTART, to have poll() interrupted
+    action.sa_handler = on_stop_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+}
+
+static void format_serial(char *text, size_t text_size, uint32_t serial) {
+    if (serial != 0) {
+        snprintf(text, text_size, "0x%X", serial);
+    } else {
+        snprintf(text, text_size, "N/A");
+    }
+}
+
+// id and info read the same device status, and can share one device transaction
+static bool is_status_query(int argc, char *const *argv) {
+    return argc == 1 && (strcmp(argv[0], "id") == 0 || strcmp(argv[0], "info") == 0);
+}
+
+static int format_status(const char *command, int res, const struct ResponseStatus *status, char *text,
+                         size_t text_size) {
+    text[0] = 0;
+    check_ret((res != RET_NO_ERROR) && (res != RET_NO_PIN_ATTEMPTS), res);
+    char serial[16];
+    format_serial(serial, sizeof serial, status->card_serial_u32);
+    if (command[1] == 'd') {
+        snprintf(text, text_size, "%s", serial);
+    } else if (res == RET_NO_PIN_ATTEMPTS) {
+        snprintf(text, text_size, "serial=%s firmware=v%d.%d pin=unset", serial,
+                 status->firmware_version_st.major, status->firmware_version_st.minor);
+    } else {
+        snprintf(text, text_size, "serial=%s firmware=v%d.%d admin=%d user=%d", serial,
+                 status->firmware_version_st.major, status->firmware_version_st.minor,
+                 status->retry_admin, status->retry_user);
+    }
+    return RET_NO_ERROR;
+}
+
+/**
+ * Time budget of a request, from its arrival. The queue is served by the earliest deadline, so the
+ * verifications go ahead of the configuration changes, and the status polling yields to both,
+ * while none of them waits without a limit.
+ */
+static int64_t request_budget_ms(int argc, char *const *argv) {
+    if (is_status_query(argc, argv)) return 5000;
+    if (strcmp(argv[0], "check") == 0) return 50;
+    if (strcmp(argv[0], "set") == 0 || strcmp(argv[0], "regenerate") == 0) return 1000;
+    // invalid, answered without the device
+    return 0;
+}
+
+typedef struct CommandContext {
+    int argc;
+    char *const *argv;
+} CommandContext;
+
+// Run a single modifying command on the connected device
+static int execute_command(struct Device *dev, void *ctx) {
+    const CommandContext *command = ctx;
+    const int argc = command->argc;
+    char *const *argv = command->argv;
+    if (strcmp(argv[0], "check") == 0) {
+        if (argc != 2) return RET_INVALID_PARAMS;
+        return check_code_on_device(dev, argv[1]);
+    }
+    if (strcmp(argv[0], "set") == 0) {
+        if (argc != 3 && argc != 4) return RET_INVALID_PARAMS;
+        const uint64_t counter = argc == 4 ? strtol10_s(argv[3]) : 0;
+        return set_secret_on_device(dev, argv[1], argv[2], counter);
+    }
+    if (strcmp(argv[0], "regenerate") == 0) {
+        if (argc != 2) return RET_INVALID_PARAMS;
+        return regenerate_AES_key(dev, argv[1]);
+    }
+    return RET_INVALID_PARAMS;
+}
+
+static int query_status(struct Device *dev, void *ctx) {
+    return device_get_status(dev, ctx);
+}
+
+static bool is_connection_failure(int res) {
+    return res == RET_CONNECTION_LOST || res == RET_COMM_ERROR;
+}
+
+/**
+ * Run the operation as a single device transaction, connecting first if needed.
+ * @param repeatable the operation does not modify the device, and can be repeated over a new connection
+ */
+static int run_connected(Server *s, bool repeatable, int (*operation)(struct Device *dev, void *ctx), void *ctx,
+                         bool *not_connected) {
+    const int attempts = repeatable ? 2 : 1;
+    int res = RET_COMM_ERROR;
+    s->transactions++;
+    s->transaction_start_us = micros();
+    for (int i = 0; i < attempts; ++i) {
+        if (s->dev.transport == nullptr && device_connect(&s->dev) != RET_NO_ERROR) {
+            *not_connected = true;
+            break;
+        }
+        res = operation(&s->dev, ctx);
+        if (!is_connection_failure(res)) {
+            break;
+        }
+        // e.g. unplugged, reconnect on the next attempt or request
+        LOG("Connection failure, status code %d\n", res);
+        device_disconnect(&s->dev);
+    }
+    s->transaction_end_us = micros();
+    s->device_us += s->transaction_end_us - s->transaction_start_us;
+    return res;
+}
+
+static void publish_status(Server *s) {
+    if (s->board.shared == nullptr) {
+        return;
+    }
+    StatusSnapshot *published = &s->published;
+    published->connected = s->dev.transport != nullptr;
+    if (published->connected && s->dev.dev_info.name != nullptr) {
+        snprintf(published->model, sizeof published->model, "%s", s->dev.dev_info.name);
+    }
+    published->update_time = time(nullptr);
+    status_board_publish(&s->board, published);
+}
+
+static void publish_device_status(Server *s, int res, const struct ResponseStatus *status) {
+    if (res == RET_NO_ERROR || res == RET_NO_PIN_ATTEMPTS) {
+        StatusSnapshot *published = &s->published;
+        published->card_serial = status->card_serial_u32;
+        published->firmware_major = status->firmware_version_st.major;
+        published->firmware_minor = status->firmware_version_st.minor;
+        published->retry_admin = status->retry_admin;
+        published->retry_user = status->retry_user;
+        published->pin_set = res != RET_NO_PIN_ATTEMPTS;
+        published->status_time = time(nullptr);
+    }
+    s->next_refresh_us = micros() + s->refresh_interval_us;
+    publish_status(s);
+}
+
+static void respond(Server *s, ServerClient *c, bool not_connected, int res, const char *text) {
+    char response[SERVER_TEXT_SIZE + 80];
+    const int exit_code = not_connected ? EXIT_CONNECTION_ERROR : res_to_exit_code(res);
+    int length;
+    if (not_connected) {
+        length = snprintf(response, sizeof response, "%d Could not connect to the device\n", exit_code);
+    } else if (text[0] != 0) {
+        length = snprintf(response, sizeof response, "%d %s\n", exit_code, text);
+    } else if (res != dev_ok && res != RET_NO_ERROR && res != RET_VALIDATION_PASSED && res != RET_VALIDATION_FAILED) {
+        length = snprintf(response, sizeof response, "%d Error occurred, status code %d: %s\n", exit_code,
+                          res, res_to_error_string(res));
+    } else {
+        length = snprintf(response, sizeof response, "%d %s\n", exit_code, res_to_error_string(res));
+    }
+    c->pending = false;
+    s->requests_served++;
+    // a request joining the transaction in flight did not wait for it
+    const int64_t started_us = MAX(s->transaction_start_us, c->received_us);
+    const int64_t queue_wait_us = started_us - c->received_us;
+    s->queue_wait_us += queue_wait_us;
+    if (s->print_timings) {
+        fprintf(stderr, "%s: queued %.1f ms, device %.1f ms\n", c->argv[0], queue_wait_us / 1000.0,
+                MAX(s->transaction_end_us - started_us, 0) / 1000.0);
+    }
+    // a client gone in the meantime is noticed on its next read
+    if (send(c->fd, response, MIN((size_t) length, sizeof response - 1), MSG_NOSIGNAL) < 0) {
+        LOG("Could not send the response: %s\n", strerror(errno));
+    }
+}
+
+static void close_client(ServerClient *c) {
+    close(c->fd);
+    c->fd = -1;
+    c->line_length = 0;
+    c->pending = false;
+}
+
+static void accept_client(Server *s) {
+    const int fd = accept(s->listen_fd, nullptr, nullptr);
+    if (fd < 0) {
+        return;
+    }
+    for (int i = 0; i < SERVER_MAX_CLIENTS; ++i) {
+        if (s->clients[i].fd < 0) {
+            s->clients[i].fd = fd;
+            s->clients[i].line_length = 0;
+            s->clients[i].pending = false;
+            return;
+        }
+    }
+    LOG("Too many clients\n");
+    close(fd);
+}
+
+// Take the next request line of the client, if it has none pending. The next lines wait in the buffer.
+static void take_request(Server *s, ServerClient *c) {
+    char *newline;
+    while (!c->pending && (newline = memchr(c->line, '\n', c->line_length)) != nullptr) {
+        const size_t consumed = (size_t) (newline - c->line) + 1;
+        memcpy(c->request, c->line, consumed - 1);
+        c->request[consumed - 1] = 0;
+        c->line_length -= consumed;
+        memmove(c->line, newline + 1, c->line_length);
+
+        c->argc = 0;
+        bool too_long = false;
+        char *save = nullptr;
+        for (char *word = strtok_r(c->request, " \t\r", &save); word != nullptr; word = strtok_r(nullptr, " \t\r", &save)) {
+            if (c->argc == SERVER_MAX_WORDS) {
+                too_long = true;
+                break;
+            }
+            c->argv[c->argc++] = word;
+        }
+        c->received_us = micros();
+        if (too_long) {
+            respond(s, c, false, RET_INVALID_PARAMS, "");
+        } else if (c->argc > 0) {
+            c->pending = true;
+            c->arrival = ++s->arrivals;
+            c->deadline_us = c->received_us + request_budget_ms(c->argc, c->argv) * 1000;
+        }
+    }
+    if (!c->pending && c->line_length == sizeof c->line) {
+        LOG("Request line too long\n");
+        close_client(c);
+    }
+}
+
+static void read_client(ServerClient *c) {
+    const ssize_t received = recv(c->fd, c->line + c->line_length, sizeof c->line - c->line_length, 0);
+    if (received <= 0) {
+        close_client(c);
+        return;
+    }
+    c->line_length += (size_t) received;
+}
+
+/**
+ * Accept the new clients and read the requests sent.
+ * @param timeout_ms time to wait for the first event, -1 to wait without a limit
+ * @return false on a fatal error
+ */
+static bool receive_requests(Server *s, int timeout_ms) {
+    struct pollfd fds[1 + SERVER_MAX_CLIENTS];
+    ServerClient *polled[1 + SERVER_MAX_CLIENTS];
+    nfds_t count = 0;
+    fds[count++] = (struct pollfd){.fd = s->listen_fd, .events = POLLIN};
+    for (int i = 0; i < SERVER_MAX_CLIENTS; ++i) {
+        ServerClient *c = &s->clients[i];
+        // a client is read again after its pending request is served, so it stays in place until then
+        if (c->fd >= 0 && !c->pending) {
+            polled[count] = c;
+            fds[count++] = (struct pollfd){.fd = c->fd, .events = POLLIN};
+        }
+    }
+    if (poll(fds, count, timeout_ms) < 0) {
+        if (errno == EINTR) return true;
+        printf("Error waiting for the requests: %s\n", strerror(errno));
+        return false;
+    }
+    for (nfds_t i = 1; i < count; ++i) {
+        if (fds[i].revents != 0) {
+            read_client(polled[i]);
+        }
+    }
+    if (fds[0].revents & POLLIN) {
+        accept_client(s);
+    }
+    for (int i = 0; i < SERVER_MAX_CLIENTS; ++i) {
+        if (s->clients[i].fd >= 0) {
+            take_request(s, &s->clients[i]);
+        }
+    }
+    return true;
+}
+
+// Take in the new requests between the polling steps of a long device operation, so their queue wait is
+// measured from their arrival. The device is serial, so they are served after the operation completes.
+static void yield_to_clients(void *ctx) {
+    receive_requests(ctx, 0);
+}
+
+static bool is_served_before(const ServerClient *a, const ServerClient *b) {
+    if (a->deadline_us != b->deadline_us) {
+        return a->deadline_us < b->deadline_us;
+    }
+    return a->arrival < b->arrival;
+}
+
+static ServerClient *next_pending(Server *s) {
+    ServerClient *next = nullptr;
+    for (int i = 0; i < SERVER_MAX_CLIENTS; ++i) {
+        ServerClient *c = &s->clients[i];
+        if (c->fd >= 0 && c->pending && (next == nullptr || is_served_before(c, next))) {
+            next = c;
+        }
+    }
+    return next;
+}
+
+/**
+ * Read the device status once for all the pending id and info requests (single-flight).
+ * Only the requests received before the transaction completed join it, the later ones get a fresh read.
+ */
+static void serve_status_queries(Server *s) {
+    struct ResponseStatus status;
+    bool not_connected = false;
+    const int res = run_connected(s, true, query_status, &status, &not_connected);
+    publish_device_status(s, res, &status);
+    for (int i = 0; i < SERVER_MAX_CLIENTS; ++i) {
+        ServerClient *c = &s->clients[i];
+        if (c->fd < 0 || !c->pending || !is_status_query(c->argc, c->argv) ||
+            c->received_us > s->transaction_end_us) {
+            continue;
+        }
+        char text[SERVER_TEXT_SIZE] = {0};
+        const int client_res = not_connected ? res : format_status(c->argv[0], res, &status, text, sizeof text);
+        respond(s, c, not_connected, client_res, text);
+    }
+}
+
+static bool has_pending(const Server *s) {
+    for (int i = 0; i < SERVER_MAX_CLIENTS; ++i) {
+        if (s->clients[i].fd >= 0 && s->clients[i].pending) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void serve_next(Server *s) {
+    ServerClient *c = next_pending(s);
+    if (c == nullptr) {
+        return;
+    }
+    if (is_status_query(c->argc, c->argv)) {
+        serve_status_queries(s);
+        return;
+    }
+    // the modifying commands are never merged, e.g. each check advances the HOTP counter
+    bool not_connected = false;
+    CommandContext command = {.argc = c->argc, .argv = c->argv};
+    const int res = run_connected(s, false, execute_command, &command, &not_connected);
+    if (!not_connected && strcmp(c->argv[0], "check") == 0) {
+        s->published.check_result = res;
+        s->published.check_time = time(nullptr);
+    }
+    publish_status(s);
+    respond(s, c, not_connected, res, "");
+}
+
+// Read the device status for the board, when it was not read for the refresh interval
+static void refresh_status(Server *s) {
+    // not waiting for an absent device, so the requests are not delayed
+    if (s->dev.transport == nullptr && device_connect_once(&s->dev) != RET_NO_ERROR) {
+        s->next_refresh_us = micros() + s->refresh_interval_us;
+        publish_status(s);
+        return;
+    }
+    struct ResponseStatus status;
+    bool not_connected = false;
+    const int res = run_connected(s, true, query_status, &status, &not_connected);
+    publish_device_status(s, res, &status);
+}
+
+// Time to wait for the requests, until the next status refresh
+static int wait_timeout_ms(const Server *s) {
+    if (has_pending(s)) {
+        return 0;
+    }
+    if (s->board.shared == nullptr || s->refresh_interval_us == 0) {
+        return -1;
+    }
+    return (int) MAX((s->next_refresh_us - micros() + 999) / 1000, 0);
+}
+
+int server_run(void) {
+    // holds the Device object, too big for the stack
+    static Server server;
+    Server *s = &server;
+    for (int i = 0; i < SERVER_MAX_CLIENTS; ++i) {
+        s->clients[i].fd = -1;
+    }
+    if (open_listener(s) != RET_NO_ERROR) {
+        return RET_COMM_ERROR;
+    }
+    s->dev.yield = yield_to_clients;
+    s->dev.yield_context = s;
+    s->print_timings = getenv("HOTP_VERIFICATION_TIMINGS") != nullptr;
+    const char *interval = getenv("HOTP_VERIFICATION_STATUS_INTERVAL");
+    s->refresh_interval_us = (interval != nullptr ? MAX(strtol10_s(interval), 0) : 10) * 1000000LL;
+    if (status_board_create(&s->board) == RET_NO_ERROR) {
+        printf("Publishing the device status in %s\n", s->board.path);
+        publish_status(s);
+    }
+    install_signal_handlers();
+    fflush(stdout);
+
+    while (!stop_requested) {
+        if (!receive_requests(s, wait_timeout_ms(s))) {
+            break;
+        }
+        if (has_pending(s)) {
+            serve_next(s);
+        } else if (wait_timeout_ms(s) == 0) {
+            refresh_status(s);
+        }
+        fflush(stdout);
+    }
+
+    printf("Served %" PRIu64 " requests with %" PRIu64 " device transactions, taking %.1f ms of device time;"
+           " the requests waited %.1f ms in the queue\n",
+           s->requests_served, s->transactions, s->device_us / 1000.0, s->queue_wait_us / 1000.0);
+    for (int i = 0; i < SERVER_MAX_CLIENTS; ++i) {
+        if (s->clients[i].fd >= 0) {
+            close_client(&s->clients[i]);
+        }
+    }
+    close(s->listen_fd);
+    if (s->created_path[0] != 0) {
+        unlink(s->created_path);
+    }
+    if (s->dev.transport != nullptr) {
+        device_disconnect(&s->dev);
+    }
+    publish_status(s);
+    status_board_close(&s->board);
+    return RET_NO_ERROR;
+}
+
+static const char *forwarded_command(const char *name) {
+    switch (name[0]) {
+        case 'i':
+            return strnlen(name, 10) == 2 && name[1] == 'd' ? "id" : "info";
+        case 'c':
+            return "check";
+        case 's':
+            return "set";
+        case 'r':
+            return "regenerate";
+        default:
+            return nullptr;
+    }
+}
+
+int server_forward(int argc, char *const *argv) {
+    const char *command = forwarded_command(argv[0]);
+    struct sockaddr_un address;
+    if (command == nullptr || argc > SERVER_MAX_WORDS || !socket_address(&address)) {
+        return -1;
+    }
+    char request[SERVER_LINE_SIZE];
+    size_t length = (size_t) snprintf(request, sizeof request, "%s", command);
+    for (int i = 1; i < argc && length < sizeof request; ++i) {
+        length += (size_t) snprintf(request + length, sizeof request - length, " %s", argv[i]);
+    }
+    if (length + 1 >= sizeof request) {
+        return -1;
+    }
+    request[length++] = '\n';
+
+    const int fd = connect_to(&address);
+    if (fd < 0) {
+        return -1;
+    }
+    char response[SERVER_TEXT_SIZE + 80];
+    size_t received = 0;
+    bool complete = send(fd, request, length, MSG_NOSIGNAL) == (ssize_t) length;
+    while (complete && memchr(response, '\n', received) == nullptr) {
+        const ssize_t r = recv(fd, response + received, sizeof response - 1 - received, 0);
+        complete = r > 0;
+        received += complete ? (size_t) r : 0;
+    }
+    close(fd);
+    int exit_code = 0;
+    int text_offset = 0;
+    if (!complete) {
+        printf("Connection to the service lost\n");
+        return EXIT_CONNECTION_LOST;
+    }
+    response[received] = 0;
+    if (sscanf(response, "%d %n", &exit_code, &text_offset) != 1) {
+        printf("Invalid response from the service\n");
+        return EXIT_OTHER_ERROR;
+    }
+    printf("%s", response + text_offset);
+    return exit_code;
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#ifndef NITROKEY_HOTP_VERIFICATION_SERVER_H
+#define NITROKEY_HOTP_VERIFICATION_SERVER_H
+
+#include <stdbool.h>
+
+/**
+ * Long-running service keeping the device connected, with the Secrets App selected, and serving the
+ * requests of the local clients over a UNIX stream socket. Each request costs the device round trips
+ * of the operation only, instead of a process start and a whole USB session.
+ *
+ * The protocol is line based. A client sends one request per line, and gets one line back for each:
+ *   request:  id | info | check <HOTP CODE> | set <BASE32 HOTP SECRET> <ADMIN PIN> [COUNTER] | regenerate <ADMIN PIN>
+ *   response: <exit code> <text>
+ * The exit code is the one the CLI would return for the same command. The text is the card serial for id,
+ * "serial=0x... firmware=vX.Y admin=N user=N" for info, and the result description otherwise.
+ * Several requests can be sent over one connection.
+ *
+ * The requests are served one device transaction at a time, by the earliest deadline: a check is due 50 ms
+ * after its arrival, set and regenerate in 1 s, and id and info in 5 s. The pending id and info requests
+ * share a single status read, including those arriving while it is in flight. The check, set and regenerate
+ * requests modify the device state, and each runs as its own transaction. During the long operations
+ * (e.g. the busy device, or the touch wait) the new requests are still taken in, and queued.
+ *
+ * The socket path is taken from the HOTP_VERIFICATION_SOCKET environment variable (empty value disables
+ * forwarding the commands to the service), otherwise it is placed in $XDG_RUNTIME_DIR, or in /run.
+ */
+
+/**
+ * Run the service until SIGINT or SIGTERM. Uses the socket passed by systemd socket activation if present,
+ * otherwise listens on the socket path. The device is connected on the first request, and again after it
+ * was lost, e.g. unplugged.
+ * The latest known device state is published on the status board (see status_board.h), with the device
+ * status refreshed at the HOTP_VERIFICATION_STATUS_INTERVAL seconds (10 by default) while idle.
+ * @return RET_NO_ERROR when stopped by a signal, RET_COMM_ERROR if the socket could not be set up
+ */
+int server_run(void);
+
+/**
+ * Send the command to the running service and print its result, if the command is served by it.
+ * @param argc count of the command words, starting with the command name
+ * @return exit code of the command, or -1 if the service is not reachable or does not handle the command
+ */
+int server_forward(int argc, char *const *argv);
+
+#endif//NITROKEY_HOTP_VERIFICATION_SERVER_H
@@ -49,4 +49,21 @@
 // Allow CCID use
 #define FEATURE_USE_CCID
 
+// Use the asynchronous libusb transfers for CCID, with the bulk IN transfer kept posted
+#define FEATURE_CCID_ASYNC_TRANSFERS
+
+// Talk to the HID devices with the libusb control transfers, instead of through hidapi
+#define FEATURE_HID_LIBUSB
+
+// Use the Linux hidraw nodes for the HID devices, when available, before trying libusb
+#ifdef __linux__
+#define FEATURE_HID_HIDRAW
+#endif
+
+// Remember the last connected device in a runtime directory, and try it first on the next start
+#define FEATURE_DEVICE_HINT_CACHE
+
+// Reach the Nitrokey 3 Secrets App over CTAPHID, when its CCID interface is held by another application
+#define FEATURE_USE_CTAPHID
+
 #endif//NITROKEY_HOTP_VERIFICATION_SETTINGS_H
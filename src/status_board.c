@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "status_board.h"
+#include "return_codes.h"
+#include "utils.h"
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define STATUS_FILE_NAME "nitrokey_hotp_verification.status"
+static const char STATUS_MAGIC[8] = "HOTPSTS1";
+// Reads overlapping a write are repeated, this many times at most
+static const int READ_ATTEMPTS = 1000;
+
+typedef struct SharedStatus {
+    char magic[8];
+    uint32_t size;
+    // Odd while the snapshot is being written
+    _Atomic uint32_t sequence;
+    StatusSnapshot snapshot;
+} SharedStatus;
+
+static bool status_path(char *path, size_t path_size) {
+    const char *file = getenv("HOTP_VERIFICATION_STATUS_FILE");
+    if (file != NULL) {
+        if (file[0] == 0) {
+            return false;
+        }
+        return (size_t) snprintf(path, path_size, "%s", file) < path_size;
+    }
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    if (dir == NULL || dir[0] == 0) {
+        dir = "/run";
+    }
+    return (size_t) snprintf(path, path_size, "%s/%s", dir, STATUS_FILE_NAME) < path_size;
+}
+
+int status_board_create(StatusBoard *board) {
+    memset(board, 0, sizeof *board);
+    if (!status_path(board->path, sizeof board->path)) {
+        return RET_NOT_FOUND;
+    }
+    // readable by the UI components running as other users
+    const int fd = open(board->path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0 || ftruncate(fd, sizeof(SharedStatus)) != 0) {
+        printf("Cannot create the status file %s\n", board->path);
+        if (fd >= 0) close(fd);
+        return RET_COMM_ERROR;
+    }
+    SharedStatus *shared = mmap(NULL, sizeof(SharedStatus), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shared == MAP_FAILED) {
+        printf("Cannot map the status file %s\n", board->path);
+        return RET_COMM_ERROR;
+    }
+    // a writer stopped during an update leaves the sequence odd, continue from the next even value
+    const uint32_t sequence = atomic_load_explicit(&shared->sequence, memory_order_relaxed);
+    atomic_store_explicit(&shared->sequence, (sequence | 1) + 1, memory_order_relaxed);
+    memcpy(shared->magic, STATUS_MAGIC, sizeof STATUS_MAGIC);
+    shared->size = sizeof(SharedStatus);
+    board->shared = shared;
+    board->writer = true;
+    return RET_NO_ERROR;
+}
+
+int status_board_open(StatusBoard *board, const char *path) {
+    memset(board, 0, sizeof *board);
+    if (path != NULL) {
+        snprintf(board->path, sizeof board->path, "%s", path);
+    } else if (!status_path(board->path, sizeof board->path)) {
+        return RET_NOT_FOUND;
+    }
+    const int fd = open(board->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return RET_NOT_FOUND;
+    }
+    struct stat file_stat;
+    // a shorter file would fault on access
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size < (off_t) sizeof(SharedStatus)) {
+        close(fd);
+        return RET_NOT_FOUND;
+    }
+    SharedStatus *shared = mmap(NULL, sizeof(SharedStatus), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shared == MAP_FAILED) {
+        return RET_NOT_FOUND;
+    }
+    if (memcmp(shared->magic, STATUS_MAGIC, sizeof STATUS_MAGIC) != 0 || shared->size != sizeof(SharedStatus)) {
+        munmap(shared, sizeof(SharedStatus));
+        return RET_NOT_FOUND;
+    }
+    board->shared = shared;
+    return RET_NO_ERROR;
+}
+
+void status_board_publish(StatusBoard *board, const StatusSnapshot *snapshot) {
+    rassert(board->writer);
+    SharedStatus *shared = board->shared;
+    const uint32_t sequence = atomic_load_explicit(&shared->sequence, memory_order_relaxed);
+    atomic_store_explicit(&shared->sequence, sequence + 1, memory_order_relaxed);
+    // the odd sequence is visible before any of the snapshot bytes
+    atomic_thread_fence(memory_order_release);
+    memcpy(&shared->snapshot, snapshot, sizeof *snapshot);
+    atomic_store_explicit(&shared->sequence, sequence + 2, memory_order_release);
+}
+
+bool status_board_read(const StatusBoard *board, StatusSnapshot *out_snapshot) {
+    SharedStatus *shared = board->shared;
+    for (int i = 0; i < READ_ATTEMPTS; ++i) {
+        const uint32_t before = atomic_load_explicit(&shared->sequence, memory_order_acquire);
+        if (before & 1) {
+            continue;
+        }
+        memcpy(out_snapshot, &shared->snapshot, sizeof *out_snapshot);
+        // the snapshot bytes are read before the sequence is checked again
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&shared->sequence, memory_order_relaxed) == before) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void status_board_close(StatusBoard *board) {
+    if (board->shared == NULL) {
+        return;
+    }
+    munmap(board->shared, sizeof(SharedStatus));
+    board->shared = NULL;
+    if (board->writer) {
+        unlink(board->path);
+    }
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#ifndef NITROKEY_HOTP_VERIFICATION_STATUS_BOARD_H
+#define NITROKEY_HOTP_VERIFICATION_STATUS_BOARD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Latest known device state, published by the daemon into a small shared memory file, for the readers
+ * like the boot UI to show it without touching the device. The daemon is the single writer, and refreshes
+ * the device status at a controlled rate. The updates are guarded by a sequence lock, so the readers get
+ * a consistent snapshot without any system call or lock, once the file is mapped.
+ *
+ * The file location is taken from the HOTP_VERIFICATION_STATUS_FILE environment variable (empty value
+ * disables the publication), otherwise it is placed in $XDG_RUNTIME_DIR, or in /run.
+ * The times are in seconds since the epoch, 0 when not known.
+ */
+typedef struct StatusSnapshot {
+    bool connected;
+    // Short name of the connected device model, e.g. "Nitrokey 3"
+    char model[24];
+    // Device status, as of status_time
+    uint32_t card_serial;
+    uint8_t firmware_major;
+    uint8_t firmware_minor;
+    uint8_t retry_admin;
+    uint8_t retry_user;
+    bool pin_set;
+    int64_t status_time;
+    // RET_* result of the last check command, as of check_time
+    int32_t check_result;
+    int64_t check_time;
+    // Time of the last change of any of the fields
+    int64_t update_time;
+} StatusSnapshot;
+
+typedef struct StatusBoard {
+    // Mapped file, NULL when not opened
+    void *shared;
+    bool writer;
+    char path[4096];
+} StatusBoard;
+
+/**
+ * Create the file, or take over a stale one, and map it for writing.
+ * @return RET_NO_ERROR, RET_NOT_FOUND if the publication is disabled, RET_COMM_ERROR on failure
+ */
+int status_board_create(StatusBoard *board);
+
+/**
+ * Map the file published by the daemon for reading.
+ * @param path file location, or NULL for the default one
+ * @return RET_NO_ERROR, RET_NOT_FOUND if there is no valid file published
+ */
+int status_board_open(StatusBoard *board, const char *path);
+
+// Replace the published snapshot
+void status_board_publish(StatusBoard *board, const StatusSnapshot *snapshot);
+
+/**
+ * Copy the published snapshot. Does not make any system call.
+ * @return false if no consistent snapshot could be read, e.g. the writer stopped during an update
+ */
+bool status_board_read(const StatusBoard *board, StatusSnapshot *out_snapshot);
+
+// Unmap the file. The writer removes it as well.
+void status_board_close(StatusBoard *board);
+
+#endif//NITROKEY_HOTP_VERIFICATION_STATUS_BOARD_H
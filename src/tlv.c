@@ -64,6 +64,11 @@ int process_TLV(uint8_t *buf, const TLV *t) {
 }
 
 
+size_t tlv_encoded_length(const TLV *t) {
+    // the raw bytes are copied without the tag and length
+    return t->type == 'B' ? t->length : 2u + t->length;
+}
+
 int process_all(uint8_t *buf, TLV *data, int count) {
     int idx = 0;
     int idx_old = 0;
@@ -76,23 +81,72 @@ int process_all(uint8_t *buf, TLV *data, int count) {
     return idx;
 }
 
+int tlv_next(const uint8_t *buf, size_t buf_size, size_t *offset, TlvView *out_view) {
+    size_t i = *offset;
+    if (i >= buf_size) {
+        return RET_NOT_FOUND;
+    }
+    // tag and the first length byte
+    check_ret(buf_size - i < 2, RET_COMM_ERROR);
+    const uint8_t tag = buf[i++];
+    uint32_t length = buf[i++];
+    if (length & 0x80) {
+        const size_t length_bytes = length & 0x7F;
+        check_ret(length_bytes == 0 || length_bytes > 2 || buf_size - i < length_bytes, RET_COMM_ERROR);
+        length = 0;
+        for (size_t j = 0; j < length_bytes; ++j) {
+            length = (length << 8) | buf[i++];
+        }
+    }
+    check_ret(buf_size - i < length, RET_COMM_ERROR);
+    out_view->tag = tag;
+    out_view->length = length;
+    out_view->value = buf + i;
+    *offset = i + length;
+    return RET_NO_ERROR;
+}
+
+int tlv_index_parse(TlvIndex *index, const uint8_t *buf, size_t buf_size) {
+    rassert(index != NULL);
+    index->count = 0;
+    index->truncated = false;
+    size_t offset = 0;
+    TlvView view;
+    int r;
+    while ((r = tlv_next(buf, buf_size, &offset, &view)) == RET_NO_ERROR) {
+        if (index->count == TLV_INDEX_SIZE) {
+            index->truncated = true;
+            continue;
+        }
+        index->entries[index->count++] = view;
+    }
+    return r == RET_NOT_FOUND ? RET_NO_ERROR : r;
+}
+
+const TlvView *tlv_index_find(const TlvIndex *index, uint8_t tag) {
+    for (int i = 0; i < index->count; ++i) {
+        if (index->entries[i].tag == tag) {
+            return &index->entries[i];
+        }
+    }
+    return NULL;
+}
+
 int get_tlv(uint8_t *buf, size_t buf_size, int tag, TLV *out_TLV) {
     rassert(buf != NULL);
     rassert(out_TLV != NULL);
-    size_t i = 0;
-
-    while (i < buf_size) {
-        if (buf[i] == tag) {
-            out_TLV->tag = buf[i++];
-            out_TLV->length = buf[i++];
-            out_TLV->v_data = &buf[i];
-            // Return error, if the TLV length goes out of the buffer boundary
-            check_ret(((i + out_TLV->length) > buf_size), RET_COMM_ERROR);
+    size_t offset = 0;
+    TlvView view;
+    int r;
+    while ((r = tlv_next(buf, buf_size, &offset, &view)) == RET_NO_ERROR) {
+        if (view.tag == tag) {
+            // TLV keeps the single byte length
+            check_ret(view.length > UINT8_MAX, RET_COMM_ERROR);
+            out_TLV->tag = view.tag;
+            out_TLV->length = (uint8_t) view.length;
+            out_TLV->v_data = (uint8_t *) view.value;
             return RET_NO_ERROR;
-        } else {
-            i++;            // skip T
-            i += 1 + buf[i];// skip L and V
         }
     }
-    return RET_NOT_FOUND;
+    return r;
 }
@@ -22,6 +22,7 @@
 #ifndef NITROKEY_HOTP_VERIFICATION_TLV_H
 #define NITROKEY_HOTP_VERIFICATION_TLV_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -38,7 +39,45 @@ typedef struct {
 
 } TLV;
 
+// Encode the TLV into the buffer, returning the encoded length
+int process_TLV(uint8_t *buf, const TLV *t);
+// Length of the TLV encoded with process_TLV
+size_t tlv_encoded_length(const TLV *t);
 int process_all(uint8_t *buf, TLV data[], int count);
 int get_tlv(uint8_t *buf, size_t buf_size, int tag, TLV *out_TLV);
 
+// Count of the entries kept by TlvIndex, enough for the Secrets App replies decoded by tag
+#define TLV_INDEX_SIZE 16
+
+// TLV of a parsed buffer, with the value pointing into it
+typedef struct TlvView {
+    uint8_t tag;
+    uint32_t length;
+    const uint8_t *value;
+} TlvView;
+
+// Entries of a buffer, parsed in a single pass
+typedef struct TlvIndex {
+    TlvView entries[TLV_INDEX_SIZE];
+    int count;
+    // More entries were present than kept
+    bool truncated;
+} TlvIndex;
+
+/**
+ * Read the TLV at the offset, with the single byte tag and the BER length (short form, or 0x81 and 0x82
+ * followed by one or two bytes), and advance the offset past it. The whole TLV is checked to be in the buffer.
+ * @return RET_NO_ERROR, RET_NOT_FOUND at the buffer end, RET_COMM_ERROR on a truncated or malformed TLV
+ */
+int tlv_next(const uint8_t *buf, size_t buf_size, size_t *offset, TlvView *out_view);
+
+/**
+ * Walk the whole buffer once, validating all the TLVs, and index them.
+ * @return RET_NO_ERROR, or RET_COMM_ERROR if any of the TLVs is truncated or malformed
+ */
+int tlv_index_parse(TlvIndex *index, const uint8_t *buf, size_t buf_size);
+
+// First entry with the tag, NULL if not present
+const TlvView *tlv_index_find(const TlvIndex *index, uint8_t tag);
+
 #endif// NITROKEY_HOTP_VERIFICATION_TLV_H
\ No newline at end of file
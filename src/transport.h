@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#ifndef NITROKEY_HOTP_VERIFICATION_TRANSPORT_H
+#define NITROKEY_HOTP_VERIFICATION_TRANSPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct Device;
+
+/**
+ * Set of operations moving raw frames between the host and the device.
+ * HID transports carry whole feature reports (including the report ID byte),
+ * CCID transports carry PC_to_RDR / RDR_to_PC messages.
+ * The transport keeps its state in the Device object. All operations return RET_NO_ERROR on success.
+ */
+typedef struct Transport {
+    const char *name;
+    // Find and attach to the device, setting its connection type and description
+    int (*open)(struct Device *dev);
+    int (*send)(struct Device *dev, const uint8_t *data, size_t length);
+    // Read a single frame, actual_length is set to the count of the received bytes
+    int (*receive)(struct Device *dev, uint8_t *data, size_t length, size_t *actual_length);
+    // Wait up to timeout_ms for the response to be ready. Transports without readiness signalling just sleep.
+    int (*poll)(struct Device *dev, uint32_t timeout_ms);
+    int (*close)(struct Device *dev);
+} Transport;
+
+extern const Transport transport_hid;
+extern const Transport transport_hid_libusb;
+extern const Transport transport_hid_hidraw;
+extern const Transport transport_ccid;
+extern const Transport transport_ccid_async;
+extern const Transport transport_pcsc;
+extern const Transport transport_ctaphid;
+extern const Transport transport_loopback;
+
+#endif//NITROKEY_HOTP_VERIFICATION_TRANSPORT_H
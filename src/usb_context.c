@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "usb_context.h"
+#include "utils.h"
+#include <stddef.h>
+#include <stdio.h>
+
+static libusb_context *shared_context = NULL;
+static int64_t init_time_us = 0;
+
+libusb_context *usb_context_get(void) {
+    if (shared_context != NULL) {
+        return shared_context;
+    }
+    const int64_t start_us = micros();
+    const int r = libusb_init(&shared_context);
+    if (r < 0) {
+        printf("Error initializing libusb: %s\n", libusb_strerror(r));
+        shared_context = NULL;
+        return NULL;
+    }
+    init_time_us = micros() - start_us;
+    return shared_context;
+}
+
+void usb_context_release(void) {
+    if (shared_context == NULL) {
+        return;
+    }
+    libusb_exit(shared_context);
+    shared_context = NULL;
+}
+
+int64_t usb_context_init_time_us(void) {
+    return init_time_us;
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#ifndef NITROKEY_HOTP_VERIFICATION_USB_CONTEXT_H
+#define NITROKEY_HOTP_VERIFICATION_USB_CONTEXT_H
+
+#include <libusb.h>
+#include <stdint.h>
+
+/**
+ * Process-wide libusb context, shared by the discovery, the hotplug notifications and the libusb
+ * based transports. Created on the first use, so the runs served by hidraw or PC/SC do not pay
+ * for the libusb initialization at all.
+ * @return the context, or NULL if libusb could not be initialized
+ */
+libusb_context *usb_context_get(void);
+
+// Destroy the context. Call once at the process end, after all the devices were closed.
+void usb_context_release(void);
+
+// Time spent in libusb_init, 0 if the context was not created
+int64_t usb_context_init_time_us(void);
+
+#endif//NITROKEY_HOTP_VERIFICATION_USB_CONTEXT_H
@@ -20,7 +20,48 @@
 */
 
 #include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
+
+int64_t micros() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((int64_t) now.tv_sec) * 1000 * 1000 + ((int64_t) now.tv_nsec) / 1000;
+}
+
+int64_t process_start_resolution_us() {
+    return 1000 * 1000 / sysconf(_SC_CLK_TCK);
+}
+
+int64_t process_start_micros() {
+#ifdef __linux__
+    FILE *f = fopen("/proc/self/stat", "r");
+    if (f == NULL) {
+        return 0;
+    }
+    char stat[1024];
+    const size_t length = fread(stat, 1, sizeof stat - 1, f);
+    fclose(f);
+    stat[length] = 0;
+    // the command name in the second field may contain spaces, the fields are counted after it
+    const char *fields = strrchr(stat, ')');
+    unsigned long long start_ticks;
+    if (fields == NULL || sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu",
+                                 &start_ticks) != 1) {
+        return 0;
+    }
+    // the start time is counted in ticks since the boot, including the time spent in suspend
+    struct timespec boot;
+    clock_gettime(CLOCK_BOOTTIME, &boot);
+    const int64_t boot_us = ((int64_t) boot.tv_sec) * 1000 * 1000 + ((int64_t) boot.tv_nsec) / 1000;
+    const int64_t start_us = (int64_t) start_ticks * process_start_resolution_us();
+    return micros() - (boot_us - start_us);
+#else
+    return 0;
+#endif
+}
 
 int64_t millis() {
     struct timespec now;
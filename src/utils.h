@@ -22,6 +22,7 @@
 #ifndef NITROKEY_HOTP_VERIFICATION_UTILS_H
 #define NITROKEY_HOTP_VERIFICATION_UTILS_H
 
+#include <stdint.h>
 #include <stdio.h> // for printf for rassert
 #include <stdlib.h>// for exit for rassert
 
@@ -52,6 +53,12 @@
 
 int64_t stopwatch_stop();
 void stopwatch_start();
+// Monotonic clock reading in microseconds
+int64_t micros();
+// Start time of this process on the micros() clock, with the kernel tick resolution. 0 if not known.
+int64_t process_start_micros();
+// Resolution of process_start_micros(), in microseconds
+int64_t process_start_resolution_us();
 
 
 #endif//NITROKEY_HOTP_VERIFICATION_UTILS_H
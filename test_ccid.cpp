@@ -1,5 +1,6 @@
 #include "catch.hpp"
 #include <cstdint>
+#include <cstring>
 #include <iostream>
 
 extern "C" {
@@ -46,7 +47,7 @@ TEST_CASE("test ccid status", "[main]") {
     int counter;
     uint16_t firmware_version;
     uint32_t serial;
-    int status_res = status_ccid(dev.mp_devhandle_ccid, &counter, &firmware_version, &serial);
+    int status_res = status_ccid(&dev, &counter, &firmware_version, &serial);
     if (status_res == RET_NO_ERROR) {
         REQUIRE((0 <= counter && counter <= 8));
     } else if (status_res == RET_NO_PIN_ATTEMPTS) {
@@ -84,3 +85,113 @@ TEST_CASE("test tlv valid", "[Helper]") {
     int r = get_tlv(buf, sizeof buf, 0x71, &tlv);
     REQUIRE(r == RET_NO_ERROR);
 }
+
+TEST_CASE("frame writer composes SELECT", "[Helper]") {
+    const uint8_t expected[] = {0x6f, 0x0c, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+                                0xa4, 0x04, 0x00, 0x07, 0xa0, 0x00, 0x00, 0x05, 0x27, 0x21, 0x01};
+    const uint8_t aid[] = {0xa0, 0x00, 0x00, 0x05, 0x27, 0x21, 0x01};
+    uint8_t buf[64];
+    FrameWriter writer;
+    frame_begin(&writer, buf, sizeof buf, 0, Ins_Select, 0x04, 0, false);
+    frame_append(&writer, aid, sizeof aid);
+    REQUIRE(frame_finish(&writer, 0) == sizeof expected);
+    REQUIRE(memcmp(buf, expected, sizeof expected) == 0);
+}
+
+TEST_CASE("frame writer encodes Le without data", "[Helper]") {
+    uint8_t buf[32];
+    FrameWriter writer;
+    frame_begin(&writer, buf, sizeof buf, 0, Ins_GetResponse, 0, 0, false);
+    REQUIRE(frame_finish(&writer, 0xFF) == ICC_HEADER_SIZE + 5);
+    REQUIRE(buf[1] == 5);
+    REQUIRE(buf[ICC_HEADER_SIZE + 4] == 0xFF);
+
+    frame_begin(&writer, buf, sizeof buf, 0, Ins_GetResponse, 0, 0, true);
+    REQUIRE(frame_finish(&writer, 0x10000) == ICC_HEADER_SIZE + 7);
+    REQUIRE(buf[ICC_HEADER_SIZE + 4] == 0);
+    REQUIRE(buf[ICC_HEADER_SIZE + 5] == 0);
+    REQUIRE(buf[ICC_HEADER_SIZE + 6] == 0);
+}
+
+TEST_CASE("frame writer uses extended length for long data", "[Helper]") {
+    static uint8_t buf[MAX_CCID_BUFFER_SIZE];
+    static uint8_t secret[300];
+    TLV tlvs[] = {
+            {.tag = Tag_Key, .length = 200, .type = 'R', .v_data = secret},
+            {.tag = Tag_Challenge, .length = 98, .type = 'R', .v_data = secret},
+    };
+    uint32_t length = 0;
+    REQUIRE(icc_pack_tlvs_for_sending(buf, sizeof buf, tlvs, ARR_LEN(tlvs), Ins_Put, &length) == RET_NO_ERROR);
+    const uint32_t data_length = 2 + 200 + 2 + 98;
+    REQUIRE(length == ICC_HEADER_SIZE + APDU_HEADER_SIZE + 3 + data_length);
+    // dwLength, little endian
+    REQUIRE(buf[1] == ((length - ICC_HEADER_SIZE) & 0xFF));
+    REQUIRE(buf[2] == ((length - ICC_HEADER_SIZE) >> 8));
+    // extended Lc
+    REQUIRE(buf[ICC_HEADER_SIZE + 4] == 0);
+    REQUIRE(buf[ICC_HEADER_SIZE + 5] == (data_length >> 8));
+    REQUIRE(buf[ICC_HEADER_SIZE + 6] == (data_length & 0xFF));
+    REQUIRE(buf[ICC_HEADER_SIZE + 7] == Tag_Key);
+}
+
+TEST_CASE("frame writer reports overflow", "[Helper]") {
+    uint8_t buf[24];
+    const uint8_t data[16] = {};
+    FrameWriter writer;
+    frame_begin(&writer, buf, sizeof buf, 0, Ins_Put, 0, 0, false);
+    frame_append(&writer, data, sizeof data);
+    REQUIRE(writer.overflow);
+    REQUIRE(frame_finish(&writer, 0) == 0);
+}
+
+TEST_CASE("packing TLVs reports the frame not fitting the buffer", "[Helper]") {
+    uint8_t buf[32];
+    static uint8_t secret[40];
+    TLV tlvs[] = {
+            {.tag = Tag_Key, .length = sizeof secret, .type = 'R', .v_data = secret},
+    };
+    uint32_t length = 0;
+    REQUIRE(icc_pack_tlvs_for_sending(buf, sizeof buf, tlvs, ARR_LEN(tlvs), Ins_Put, &length) == RET_INVALID_PARAMS);
+    REQUIRE(length == 0);
+}
+
+TEST_CASE("tlv index walks the response once", "[Helper]") {
+    uint8_t buf[300] = {0x79, 0x03, 0x04, 0x0b, 0x00,
+                        0x82, 0x01, 0x08,
+                        0x8f, 0x04, 0x1a, 0x2b, 0x3c, 0x4d,
+                        // BER lengths, one and two bytes long
+                        0x72, 0x81, 0x80};
+    const size_t short_end = 17 + 0x80;
+    buf[short_end] = 0x72;
+    buf[short_end + 1] = 0x82;
+    buf[short_end + 2] = 0x00;
+    buf[short_end + 3] = 0x10;
+    const size_t size = short_end + 4 + 0x10;
+
+    TlvIndex index;
+    REQUIRE(tlv_index_parse(&index, buf, size) == RET_NO_ERROR);
+    REQUIRE(index.count == 5);
+    REQUIRE_FALSE(index.truncated);
+    const TlvView *serial = tlv_index_find(&index, Tag_SerialNumber);
+    REQUIRE(serial != nullptr);
+    REQUIRE(serial->length == 4);
+    REQUIRE(serial->value == buf + 10);
+    REQUIRE(tlv_index_find(&index, Tag_NameList)->length == 0x80);
+    REQUIRE(index.entries[4].length == 0x10);
+    REQUIRE(tlv_index_find(&index, Tag_Key) == nullptr);
+}
+
+TEST_CASE("tlv index rejects truncated responses", "[Helper]") {
+    TlvIndex index;
+    // length byte missing
+    const uint8_t no_length[] = {0x79, 0x01, 0x04, 0x82};
+    REQUIRE(tlv_index_parse(&index, no_length, sizeof no_length) == RET_COMM_ERROR);
+    // value past the end
+    const uint8_t long_value[] = {0x79, 0x05, 0x04};
+    REQUIRE(tlv_index_parse(&index, long_value, sizeof long_value) == RET_COMM_ERROR);
+    // BER length bytes past the end
+    const uint8_t long_length[] = {0x72, 0x82, 0x01};
+    REQUIRE(tlv_index_parse(&index, long_length, sizeof long_length) == RET_COMM_ERROR);
+    TLV tlv = {};
+    REQUIRE(get_tlv((uint8_t *) no_length, sizeof no_length, Tag_PINCounter, &tlv) == RET_COMM_ERROR);
+}
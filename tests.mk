@@ -1,5 +1,5 @@
 BIN=cmake-build-debug/hotp_verification
-.PHONY: test test-power-cycle
+.PHONY: test test-power-cycle test-sim test-daemon test-script test-script-sim
 test:
 	# Test CLI calls for setup and usage
 	$(BIN) id
@@ -13,6 +13,38 @@ test:
 	# The error in the line above is expected.
 	# Done. All good
 
+test-script:
+	# Run the same sequence as a script, over a single connection
+	printf '%s\n' 'id' 'info' 'set GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ 12345678' 'check 755224' 'check 287082' \
+		'check 359152' '! check 359152' | $(BIN) script -
+
 test-power-cycle:
 	# Test check after power-cycle
 	$(BIN) check 403154 # 10th code
+
+SHIM=cmake-build-debug/libhotp_verification_shim.so
+SIM_DEVICE=pro
+SIM_STATE=/tmp/hotp-sim-state.bin
+test-sim:
+	# Run the CLI tests with the preloaded shim, against the emulated device
+	rm -f $(SIM_STATE)
+	env LD_PRELOAD=$(abspath $(SHIM)) HOTP_SIM_DEVICE=$(SIM_DEVICE) HOTP_SIM_STATE=$(SIM_STATE) HOTP_VERIFICATION_HINT_FILE= HOTP_VERIFICATION_HIDRAW=0 \
+		HOTP_VERIFICATION_SOCKET= ASAN_OPTIONS=verify_asan_link_order=0 $(MAKE) -f tests.mk test BIN=$(BIN)
+
+SIM_SOCKET=/tmp/hotp-sim.sock
+SIM_STATUS=/tmp/hotp-sim.status
+test-daemon:
+	# Run the CLI tests through the daemon, serving the emulated device, then read the status it published
+	rm -f $(SIM_STATE) $(SIM_SOCKET) $(SIM_STATUS)
+	env LD_PRELOAD=$(abspath $(SHIM)) HOTP_SIM_DEVICE=$(SIM_DEVICE) HOTP_VERIFICATION_HINT_FILE= HOTP_VERIFICATION_HIDRAW=0 \
+		HOTP_VERIFICATION_SOCKET=$(SIM_SOCKET) HOTP_VERIFICATION_STATUS_FILE=$(SIM_STATUS) ASAN_OPTIONS=verify_asan_link_order=0 $(BIN) daemon & pid=$$!; \
+	while [ ! -S $(SIM_SOCKET) ]; do sleep 0.1; done; \
+	env HOTP_VERIFICATION_SOCKET=$(SIM_SOCKET) $(MAKE) -f tests.mk test BIN=$(BIN) && \
+		env HOTP_VERIFICATION_STATUS_FILE=$(SIM_STATUS) $(BIN) status | grep "Last check: HOTP code is incorrect"; r=$$?; \
+	kill $$pid; wait $$pid; exit $$r
+
+test-script-sim:
+	# Run the script test against the emulated device
+	rm -f $(SIM_STATE)
+	env LD_PRELOAD=$(abspath $(SHIM)) HOTP_SIM_DEVICE=$(SIM_DEVICE) HOTP_SIM_STATE=$(SIM_STATE) HOTP_VERIFICATION_HINT_FILE= HOTP_VERIFICATION_HIDRAW=0 \
+		HOTP_VERIFICATION_SOCKET= ASAN_OPTIONS=verify_asan_link_order=0 $(MAKE) -f tests.mk test-script BIN=$(BIN)
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "catch.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "../src/base32.h"
+#include "../src/base32_decoder.h"
+#include "../src/return_codes.h"
+#include "../src/utils.h"
+}
+
+static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567";
+
+static std::string random_base32(size_t length) {
+    std::string s;
+    for (size_t i = 0; i < length; i++) {
+        s += alphabet[rand() % 32];
+    }
+    return s;
+}
+
+typedef int (*Decoder)(const char *, size_t, uint8_t *, size_t, size_t *, size_t *);
+
+static const Decoder decoders[] = {base32_decode_checked, base32_decode_checked_scalar};
+
+TEST_CASE("Base32 decoding matches the reference decoder", "[Helper]") {
+    INFO("implementation: " << base32_decoder_implementation());
+    srand(1);
+    for (size_t length = 0; length <= 200; length++) {
+        for (const size_t padding : {0, 6}) {
+            const std::string coded = random_base32(length) + std::string(padding, '=');
+            std::vector<uint8_t> expected(length + 8);
+            const size_t expected_length = base32_decode((const unsigned char *) coded.c_str(), expected.data());
+            for (auto decode : decoders) {
+                std::vector<uint8_t> plain(length + 8);
+                size_t decoded_length = 0;
+                CAPTURE(coded);
+                REQUIRE(decode(coded.c_str(), coded.size(), plain.data(), plain.size(), &decoded_length, nullptr) ==
+                        RET_NO_ERROR);
+                REQUIRE(decoded_length == expected_length);
+                REQUIRE(memcmp(plain.data(), expected.data(), decoded_length) == 0);
+            }
+        }
+    }
+}
+
+TEST_CASE("Base32 decoding reports the first invalid character", "[Helper]") {
+    srand(2);
+    for (size_t length = 1; length <= 100; length++) {
+        for (const char invalid : {'a', '1', '8', '@', '[', ' ', '\0', '\xC4'}) {
+            std::string coded = random_base32(length);
+            const size_t position = rand() % length;
+            coded[position] = invalid;
+            for (auto decode : decoders) {
+                uint8_t plain[100];
+                size_t error_position = 0;
+                CAPTURE(coded, position);
+                REQUIRE(decode(coded.data(), coded.size(), plain, sizeof(plain), nullptr, &error_position) ==
+                        RET_BADLY_FORMATTED_BASE32_STRING);
+                REQUIRE(error_position == position);
+            }
+        }
+    }
+
+    for (auto decode : decoders) {
+        uint8_t plain[10];
+        size_t error_position = 0;
+        size_t decoded_length = 0;
+        // Data after the padding
+        REQUIRE(decode("AA=AAAA", 7, plain, sizeof(plain), &decoded_length, &error_position) ==
+                RET_BADLY_FORMATTED_BASE32_STRING);
+        REQUIRE(error_position == 3);
+        REQUIRE(decoded_length == 1);
+        REQUIRE(decode("NZUXI4TPNNSXSCQ=", 16, plain, sizeof(plain), &decoded_length, nullptr) == RET_NO_ERROR);
+        REQUIRE(decoded_length == 9);
+        REQUIRE(memcmp(plain, "nitrokey\n", 9) == 0);
+    }
+}
+
+TEST_CASE("Base32 decoding reports the first character not fitting the output", "[Helper]") {
+    const std::string coded = random_base32(96);
+    for (auto decode : decoders) {
+        uint8_t plain[60];
+        size_t error_position = 0;
+        size_t decoded_length = 0;
+        // 40 bytes take 64 characters, the 65th adds bits to a 41st byte, which is dropped
+        REQUIRE(decode(coded.data(), 65, plain, 40, &decoded_length, &error_position) == RET_NO_ERROR);
+        REQUIRE(decoded_length == 40);
+        REQUIRE(decode(coded.data(), 96, plain, 40, &decoded_length, &error_position) ==
+                RET_BADLY_FORMATTED_BASE32_STRING);
+        REQUIRE(error_position == 65);
+        REQUIRE(decode(coded.data(), 96, plain, sizeof(plain), &decoded_length, &error_position) == RET_NO_ERROR);
+        REQUIRE(decoded_length == 60);
+    }
+}
+
+TEST_CASE("Base32 decoding throughput", "[.benchmark]") {
+    const size_t length = 1 << 20;
+    const std::string coded = random_base32(length);
+    std::vector<uint8_t> plain(length);
+    const int rounds = 20;
+    {
+        const int64_t start = micros();
+        for (int i = 0; i < rounds; ++i) {
+            base32_decode((const unsigned char *) coded.c_str(), plain.data());
+        }
+        const int64_t elapsed = micros() - start;
+        WARN("base32_decode: " << (double) length * rounds / elapsed << " MB/s");
+    }
+    const struct {
+        const char *name;
+        Decoder decode;
+    } implementations[] = {
+            {"scalar", base32_decode_checked_scalar},
+            {base32_decoder_implementation(), base32_decode_checked},
+    };
+    for (const auto &impl : implementations) {
+        const int64_t start = micros();
+        for (int i = 0; i < rounds; ++i) {
+            REQUIRE(impl.decode(coded.data(), length, plain.data(), plain.size(), nullptr, nullptr) == RET_NO_ERROR);
+        }
+        const int64_t elapsed = micros() - start;
+        WARN(impl.name << ": " << (double) length * rounds / elapsed << " MB/s");
+    }
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "catch.hpp"
+#include <cstdlib>
+#include <vector>
+
+extern "C" {
+#include "../src/crc32.h"
+#include "../src/utils.h"
+}
+
+static std::vector<uint8_t> random_data(size_t size) {
+    std::vector<uint8_t> data(size + 1);
+    for (auto &b : data) {
+        b = (uint8_t) (rand() & 0xFF);
+    }
+    return data;
+}
+
+TEST_CASE("CRC32 of known data", "[Helper]") {
+    // 0x0000001F followed by padding, as in a Storage status query
+    uint8_t report[60] = {0x1F};
+    const uint8_t text[] = "123456789abc";
+    for (auto crc : {stm_crc32_bitwise, stm_crc32_table, stm_crc32_clmul, stm_crc32}) {
+        REQUIRE(crc(report, sizeof(report)) == 0x5A9035CD);
+        REQUIRE(crc(text, 12) == 0x090F8705);
+        REQUIRE(crc(text, 0) == 0xFFFFFFFF);
+    }
+}
+
+TEST_CASE("CRC32 implementations agree", "[Helper]") {
+    INFO("selected implementation: " << stm_crc32_implementation());
+    srand(1);
+    for (size_t size = 0; size <= 300; size++) {
+        const auto data = random_data(size);
+        // Start at an odd offset too, as the callers do with the report buffers
+        for (size_t offset = 0; offset < 2; offset++) {
+            const uint8_t *p = data.data() + offset;
+            const size_t length = size - (offset && size ? 1 : 0);
+            const uint32_t expected = stm_crc32_bitwise(p, length);
+            CAPTURE(size, offset);
+            REQUIRE(stm_crc32_table(p, length) == expected);
+            REQUIRE(stm_crc32_clmul(p, length) == expected);
+            REQUIRE(stm_crc32(p, length) == expected);
+        }
+    }
+    const auto data = random_data(4096);
+    REQUIRE(stm_crc32_clmul(data.data(), 4096) == stm_crc32_bitwise(data.data(), 4096));
+}
+
+TEST_CASE("CRC32 throughput", "[.benchmark]") {
+    const struct {
+        const char *name;
+        uint32_t (*crc)(const uint8_t *, size_t);
+    } implementations[] = {
+            {"bitwise", stm_crc32_bitwise},
+            {"table", stm_crc32_table},
+            {"clmul", stm_crc32_clmul},
+    };
+    for (const size_t size : {(size_t) 60, (size_t) 4096}) {
+        const auto data = random_data(size);
+        const int rounds = (int) (8000000 / size);
+        for (const auto &impl : implementations) {
+            uint32_t sink = 0;
+            const int64_t start = micros();
+            for (int i = 0; i < rounds; ++i) {
+                sink ^= impl.crc(data.data() + 1, size);
+            }
+            const int64_t elapsed = micros() - start;
+            WARN(impl.name << ", " << size << " bytes: " << (double) size * rounds / elapsed << " MB/s, "
+                           << elapsed * 1000.0 / rounds << " ns/call (" << sink << ")");
+        }
+    }
+}
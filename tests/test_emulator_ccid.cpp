@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "catch.hpp"
+#include <cstring>
+
+extern "C" {
+#include "../src/ccid.h"
+#include "../src/device.h"
+#include "../src/emulator_ccid.h"
+#include "../src/loopback.h"
+#include "../src/operations_ccid.h"
+#include "../src/return_codes.h"
+#include "../src/utils.h"
+}
+
+static const char *base32_secret = "GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ";
+static const char *PIN = "123456";
+static const uint32_t RFC_HOTP_codes[] = {
+        755224,//0
+        287082,
+        359152,
+        969429,//3
+        338314,
+        254676,
+        287922,//6
+        162583,
+        399871,
+        520489,//9
+        403154,//10
+        481090,//11
+};
+
+static EmulatorCcid emu;
+static LoopbackState loopback;
+static struct Device dev;
+
+static void connect_emulator(const EmulatorCcidConfig *config) {
+    emulator_ccid_init(&emu, config);
+    dev = {};
+    REQUIRE(emulator_ccid_connect(&dev, &loopback, &emu) == RET_NO_ERROR);
+    REQUIRE(dev.connection_type == CONNECTION_CCID);
+    REQUIRE(emu.selected);
+}
+
+
+TEST_CASE("Emulated Secrets App accepts RFC codes", "[emulator]") {
+    EmulatorCcidConfig config = {};
+    config.use_get_response = GENERATE(false, true);
+    connect_emulator(&config);
+    REQUIRE(set_secret_on_device_ccid(&dev, base32_secret, 0) == RET_NO_ERROR);
+    for (auto c: RFC_HOTP_codes) {
+        if (c == RFC_HOTP_codes[10]) break;
+        REQUIRE(verify_code_ccid(&dev, c) == RET_VALIDATION_PASSED);
+    }
+    REQUIRE(verify_code_ccid(&dev, RFC_HOTP_codes[9]) == RET_VALIDATION_FAILED);
+    REQUIRE(device_disconnect(&dev) == RET_NO_ERROR);
+}
+
+TEST_CASE("Emulated Secrets App verification window", "[emulator]") {
+    connect_emulator(nullptr);
+    REQUIRE(verify_code_ccid(&dev, RFC_HOTP_codes[0]) == RET_SLOT_NOT_CONFIGURED);
+    REQUIRE(set_secret_on_device_ccid(&dev, base32_secret, 0) == RET_NO_ERROR);
+    REQUIRE(verify_code_ccid(&dev, RFC_HOTP_codes[11]) == RET_VALIDATION_FAILED);
+    REQUIRE(verify_code_ccid(&dev, RFC_HOTP_codes[10]) == RET_VALIDATION_FAILED);
+    REQUIRE(verify_code_ccid(&dev, RFC_HOTP_codes[9]) == RET_VALIDATION_PASSED);
+    REQUIRE(verify_code_ccid(&dev, RFC_HOTP_codes[11]) == RET_VALIDATION_PASSED);
+    REQUIRE(device_disconnect(&dev) == RET_NO_ERROR);
+}
+
+TEST_CASE("Prepared verification matches the freshly encoded command", "[emulator]") {
+    PreparedCommand command = {};
+    REQUIRE(verify_code_ccid_prepare(&command) == RET_NO_ERROR);
+    connect_emulator(nullptr);
+    REQUIRE(set_secret_on_device_ccid(&dev, base32_secret, 0) == RET_NO_ERROR);
+    for (int i = 0; i < 10; ++i) {
+        REQUIRE(verify_code_ccid_prepared(&dev, &command, RFC_HOTP_codes[i]) == RET_VALIDATION_PASSED);
+
+        TLV tlvs[] = {
+                {.tag = Tag_CredentialId, .length = SLOT_NAME_LEN, .type = 'S', .v_str = SLOT_NAME},
+                {.tag = Tag_Response, .length = 4, .type = 'I', .v_raw = RFC_HOTP_codes[i]},
+        };
+        uint8_t encoded[MAX_CCID_BUFFER_SIZE] = {};
+        uint32_t length = 0;
+        REQUIRE(icc_pack_tlvs_for_sending(encoded, sizeof encoded, tlvs, ARR_LEN(tlvs), Ins_VerifyCode, &length) ==
+                RET_NO_ERROR);
+        REQUIRE(command.length == length);
+        // the same frame, besides the sequence number
+        REQUIRE(command.frame[ICC_SEQ_OFFSET] == dev.ccid_seq);
+        encoded[ICC_SEQ_OFFSET] = dev.ccid_seq;
+        REQUIRE(memcmp(command.frame, encoded, length) == 0);
+    }
+    REQUIRE(verify_code_ccid_prepared(&dev, &command, RFC_HOTP_codes[9]) == RET_VALIDATION_FAILED);
+    REQUIRE(device_disconnect(&dev) == RET_NO_ERROR);
+}
+
+TEST_CASE("Emulated Secrets App status and PIN counter", "[emulator]") {
+    EmulatorCcidConfig config = {};
+    config.use_get_response = GENERATE(false, true);
+    connect_emulator(&config);
+    int counter = 0;
+    uint16_t version = 0;
+    uint32_t serial = 0;
+    REQUIRE(status_ccid(&dev, &counter, &version, &serial) == RET_NO_PIN_ATTEMPTS);
+    REQUIRE(counter == -1);
+    REQUIRE(serial == emu.serial);
+    REQUIRE(version == ((emu.version[0] << 8) | emu.version[1]));
+
+    REQUIRE(set_pin_ccid(&dev, PIN) == 0);
+    REQUIRE(status_ccid(&dev, &counter, &version, &serial) == RET_NO_ERROR);
+    REQUIRE(counter == 8);
+    REQUIRE(set_secret_on_device_ccid(&dev, base32_secret, 0) == RET_SECURITY_STATUS_NOT_SATISFIED);
+    REQUIRE(authenticate_ccid(&dev, "wrong_PIN") == RET_WRONG_PIN);
+    REQUIRE(status_ccid(&dev, &counter, &version, &serial) == RET_NO_ERROR);
+    REQUIRE(counter == 7);
+
+    REQUIRE(authenticate_ccid(&dev, PIN) == RET_NO_ERROR);
+    REQUIRE(set_secret_on_device_ccid(&dev, base32_secret, 0) == RET_NO_ERROR);
+    REQUIRE(verify_code_ccid(&dev, RFC_HOTP_codes[0]) == RET_VALIDATION_PASSED);
+    REQUIRE(device_disconnect(&dev) == RET_NO_ERROR);
+}
+
+TEST_CASE("Emulated Secrets App time extension", "[emulator]") {
+    connect_emulator(nullptr);
+    REQUIRE(set_secret_on_device_ccid(&dev, base32_secret, 0) == RET_NO_ERROR);
+    emu.time_extensions_left = 3;
+    const uint64_t frames_read = emu.frames_read;
+    REQUIRE(verify_code_ccid(&dev, RFC_HOTP_codes[0]) == RET_VALIDATION_PASSED);
+    REQUIRE(emu.time_extensions_sent == 3);
+    REQUIRE(emu.frames_read - frames_read == 4);
+    REQUIRE(dev.timings.time_extensions == 3);
+    REQUIRE(dev.timings.probes - dev.timings.responses == 3);
+    REQUIRE(device_disconnect(&dev) == RET_NO_ERROR);
+}
+
+TEST_CASE("Emulated Secrets App is read without polling delays", "[emulator]") {
+    EmulatorCcidConfig config = {};
+    config.realistic_polling = true;
+    config.processing_time_us = 1000;
+    connect_emulator(&config);
+    REQUIRE(set_secret_on_device_ccid(&dev, base32_secret, 0) == RET_NO_ERROR);
+    dev.timings = {};
+    const int64_t start = micros();
+    for (int i = 0; i < 10; ++i) {
+        REQUIRE(verify_code_ccid(&dev, RFC_HOTP_codes[i]) == RET_VALIDATION_PASSED);
+    }
+    const int64_t elapsed = micros() - start;
+    // Single bulk IN per APDU, blocking until the response is ready
+    REQUIRE(dev.timings.responses == 10);
+    REQUIRE(dev.timings.probes == 10);
+    REQUIRE(dev.timings.poll_wait_us == 0);
+    REQUIRE(elapsed < 10 * 5 * 1000);
+    REQUIRE(device_disconnect(&dev) == RET_NO_ERROR);
+}
+
+TEST_CASE("Emulated Secrets App rejects malformed frames", "[emulator]") {
+    connect_emulator(nullptr);
+    // XfrBlock declaring more data than sent
+    uint8_t frame[] = {0x6F, 0x20, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0xA4, 0x04, 0x00};
+    REQUIRE(ccid_send(&dev, frame, sizeof frame) == 0);
+    uint8_t buf[64] = {};
+    int actual_length = 0;
+    REQUIRE(ccid_receive(&dev, &actual_length, buf, sizeof buf) == 0);
+    const IccResult result = parse_icc_result(buf, (size_t) actual_length);
+    REQUIRE(result.data_status_code == 0x6700);
+    REQUIRE(device_disconnect(&dev) == RET_NO_ERROR);
+}
+
+TEST_CASE("Emulated Secrets App replies with more than 255 bytes", "[emulator]") {
+    EmulatorCcidConfig config = {};
+    config.use_get_response = GENERATE(false, true);
+    config.select_extra_length = 400;
+    connect_emulator(&config);
+    uint8_t buf[MAX_CCID_BUFFER_SIZE] = {};
+    IccResult result = {};
+    REQUIRE(send_select_ccid(&dev, buf, sizeof buf, &result) == RET_NO_ERROR);
+    REQUIRE(result.data_len > 0xFF);
+    REQUIRE(result.data_status_code == 0x9000);
+    REQUIRE(result.data[result.data_len - 3] == 0xA5);
+
+    int attempt_counter = 0;
+    uint16_t firmware_version = 0;
+    uint32_t serial_number = 0;
+    REQUIRE(status_ccid(&dev, &attempt_counter, &firmware_version, &serial_number) == RET_NO_PIN_ATTEMPTS);
+    REQUIRE(serial_number == emu.serial);
+    REQUIRE(device_disconnect(&dev) == RET_NO_ERROR);
+}
+
+TEST_CASE("Declared data length is bounded by the received frame", "[emulator]") {
+    // DataBlock declaring 0x1002 bytes, with only the status word received
+    uint8_t frame[] = {0x80, 0x02, 0x10, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x90, 0x00};
+    const IccResult result = parse_icc_result(frame, sizeof frame);
+    REQUIRE(result.data_len == 2);
+    REQUIRE(result.data_status_code == 0x9000);
+}
+
+struct StalePeer {
+    LoopbackPeer emulator;
+    int stale_frames_left;
+};
+
+static int stale_peer_on_send(void *ctx, const uint8_t *data, size_t length) {
+    auto *p = static_cast<StalePeer *>(ctx);
+    return p->emulator.on_send(p->emulator.ctx, data, length);
+}
+
+static int stale_peer_on_receive(void *ctx, uint8_t *data, size_t length, size_t *actual_length) {
+    auto *p = static_cast<StalePeer *>(ctx);
+    const int r = p->emulator.on_receive(p->emulator.ctx, data, length, actual_length);
+    if (r == RET_NO_ERROR && p->stale_frames_left > 0) {
+        // Return a response to an earlier request, and keep the current one for the next read
+        p->stale_frames_left--;
+        data[ICC_SEQ_OFFSET]--;
+        emu.response_pending = true;
+    }
+    return r;
+}
+
+TEST_CASE("Stale CCID frames are dropped", "[emulator]") {
+    emulator_ccid_init(&emu, nullptr);
+    StalePeer stale_peer = {emulator_ccid_peer(&emu), 0};
+    const LoopbackPeer peer = {stale_peer_on_send, stale_peer_on_receive, nullptr, &stale_peer};
+    dev = {};
+    REQUIRE(loopback_connect(&dev, &loopback, &peer, CONNECTION_CCID, devices_ccid[0]) == RET_NO_ERROR);
+    REQUIRE(set_secret_on_device_ccid(&dev, base32_secret, 0) == RET_NO_ERROR);
+
+    stale_peer.stale_frames_left = 2;
+    REQUIRE(verify_code_ccid(&dev, RFC_HOTP_codes[0]) == RET_VALIDATION_PASSED);
+    REQUIRE(dev.timings.stale_frames == 2);
+    REQUIRE(verify_code_ccid(&dev, RFC_HOTP_codes[1]) == RET_VALIDATION_PASSED);
+    REQUIRE(dev.timings.stale_frames == 2);
+    REQUIRE(device_disconnect(&dev) == RET_NO_ERROR);
+}
+
+TEST_CASE("Emulated CCID path throughput", "[.benchmark]") {
+    connect_emulator(nullptr);
+    REQUIRE(set_secret_on_device_ccid(&dev, base32_secret, 0) == RET_NO_ERROR);
+    const int operations = 1000;
+    int counter = 0;
+    uint16_t version = 0;
+    uint32_t serial = 0;
+    int64_t start = micros();
+    for (int i = 0; i < operations; ++i) {
+        REQUIRE(status_ccid(&dev, &counter, &version, &serial) == RET_NO_PIN_ATTEMPTS);
+    }
+    int64_t elapsed = micros() - start;
+    WARN("status_ccid: " << operations * 1000000.0 / elapsed << " ops/s, " << elapsed / operations << " us/op");
+
+    start = micros();
+    for (int i = 0; i < operations; ++i) {
+        REQUIRE(verify_code_ccid(&dev, 0) == RET_VALIDATION_FAILED);
+    }
+    elapsed = micros() - start;
+    WARN("verify_code_ccid: " << operations * 1000000.0 / elapsed << " ops/s, " << elapsed / operations << " us/op");
+    REQUIRE(device_disconnect(&dev) == RET_NO_ERROR);
+}
@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "catch.hpp"
+
+extern "C" {
+#include "../src/dev_commands.h"
+#include "../src/device.h"
+#include "../src/emulator_hid.h"
+#include "../src/loopback.h"
+#include "../src/operations.h"
+#include "../src/utils.h"
+}
+
+static const char *base32_secret = "GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ";
+static const char *admin_PIN = "12345678";
+static const char *RFC_HOTP_codes[] = {
+        "755224",//0
+        "287082",
+        "359152",
+        "969429",//3
+        "338314",
+        "254676",
+        "287922",//6
+        "162583",
+        "399871",
+        "520489",//9
+        "403154",//10
+        "481090",//11
+};
+
+static EmulatorHid emu;
+static LoopbackState loopback;
+static struct Device dev;
+
+static void connect_emulator(char model) {
+    EmulatorHidConfig config = {};
+    config.model = model;
+    config.storage_busy_reads = 5;
+    emulator_hid_init(&emu, &config);
+    dev = {};
+    REQUIRE(emulator_hid_connect(&dev, &loopback, &emu) == RET_NO_ERROR);
+    REQUIRE(dev.connection_type == CONNECTION_HID);
+    REQUIRE(dev.dev_info.name_short == model);
+}
+
+
+TEST_CASE("Emulated device accepts RFC codes", "[emulator]") {
+    const char model = GENERATE('P', 'L', 'S');
+    connect_emulator(model);
+    REQUIRE(set_secret_on_device(&dev, base32_secret, admin_PIN, 0) == RET_NO_ERROR);
+    for (auto c: RFC_HOTP_codes) {
+        REQUIRE(check_code_on_device(&dev, c) == RET_VALIDATION_PASSED);
+    }
+    REQUIRE(check_code_on_device(&dev, RFC_HOTP_codes[11]) == RET_VALIDATION_FAILED);
+    REQUIRE(device_disconnect(&dev) == RET_NO_ERROR);
+}
+
+TEST_CASE("Emulated device verification window", "[emulator]") {
+    connect_emulator('P');
+    REQUIRE(set_secret_on_device(&dev, base32_secret, admin_PIN, 0) == RET_NO_ERROR);
+    REQUIRE(check_code_on_device(&dev, RFC_HOTP_codes[11]) == RET_VALIDATION_FAILED);
+    REQUIRE(check_code_on_device(&dev, RFC_HOTP_codes[10]) == RET_VALIDATION_FAILED);
+    REQUIRE(check_code_on_device(&dev, RFC_HOTP_codes[9]) == RET_VALIDATION_PASSED);
+    REQUIRE(check_code_on_device(&dev, RFC_HOTP_codes[11]) == RET_VALIDATION_PASSED);
+    REQUIRE(device_disconnect(&dev) == RET_NO_ERROR);
+}
+
+TEST_CASE("Emulated device status and PIN counters", "[emulator]") {
+    const char model = GENERATE('P', 'S');
+    connect_emulator(model);
+    struct ResponseStatus status = {};
+    REQUIRE(device_get_status(&dev, &status) == RET_NO_ERROR);
+    REQUIRE(status.card_serial_u32 == emu.serial);
+    REQUIRE(status.firmware_version_st.minor == emu.firmware_minor);
+    REQUIRE(status.retry_admin == MAX_PIN_ATTEMPT_COUNTER_HID);
+
+    REQUIRE(set_secret_on_device(&dev, base32_secret, "wrong_PIN", 0) == dev_wrong_password);
+    REQUIRE(device_get_status(&dev, &status) == RET_NO_ERROR);
+    REQUIRE(status.retry_admin == MAX_PIN_ATTEMPT_COUNTER_HID - 1);
+    REQUIRE(check_code_on_device(&dev, RFC_HOTP_codes[0]) == dev_slot_not_programmed);
+
+    REQUIRE(authenticate_admin(&dev, admin_PIN, dev.admin_temporary_password) == RET_NO_ERROR);
+    REQUIRE(device_get_status(&dev, &status) == RET_NO_ERROR);
+    REQUIRE(status.retry_admin == MAX_PIN_ATTEMPT_COUNTER_HID);
+    REQUIRE(device_disconnect(&dev) == RET_NO_ERROR);
+}
+
+TEST_CASE("Emulated AES key regeneration", "[emulator]") {
+    const char model = GENERATE('P', 'S');
+    connect_emulator(model);
+    REQUIRE(regenerate_AES_key(&dev, admin_PIN) == RET_NO_ERROR);
+    if (model == 'S') {
+        REQUIRE(emu.storage_device_status == EMULATOR_STORAGE_OK);
+        REQUIRE(emu.reports_read > emu.config.storage_busy_reads);
+        REQUIRE(regenerate_AES_key(&dev, "wrong_PIN") == RET_COMM_ERROR);
+    }
+    REQUIRE(device_disconnect(&dev) == RET_NO_ERROR);
+}
+
+TEST_CASE("Emulated device rejects corrupted reports", "[emulator]") {
+    connect_emulator('P');
+    REQUIRE(device_send_buf(&dev, GET_STATUS) == RET_NO_ERROR);
+    REQUIRE(device_receive_buf(&dev) == RET_NO_ERROR);
+
+    dev.packet_query.command_id = GET_STATUS;
+    dev.packet_query.crc = 0xDEADBEEF;
+    REQUIRE(dev.transport->send(&dev, dev.packet_query.as_data, HID_REPORT_SIZE) == RET_NO_ERROR);
+    REQUIRE(emu.crc_errors == 1);
+    REQUIRE(emu.response.response_st.last_command_status == wrong_CRC);
+    REQUIRE(device_disconnect(&dev) == RET_NO_ERROR);
+}
+
+TEST_CASE("Emulated device processing time", "[emulator]") {
+    EmulatorHidConfig config = {};
+    config.model = 'P';
+    config.processing_time_us = 20 * 1000;
+    emulator_hid_init(&emu, &config);
+    dev = {};
+    REQUIRE(emulator_hid_connect(&dev, &loopback, &emu) == RET_NO_ERROR);
+
+    const int64_t start = micros();
+    struct ResponseStatus status = {};
+    REQUIRE(device_get_status(&dev, &status) == RET_NO_ERROR);
+    // three commands, each one waiting for the emulated processing
+    REQUIRE(micros() - start >= 3 * 20 * 1000);
+    REQUIRE(device_disconnect(&dev) == RET_NO_ERROR);
+}
+
+TEST_CASE("Response polling adapts to the device model", "[emulator]") {
+    const char model = GENERATE('P', 'S');
+    EmulatorHidConfig config = {};
+    config.model = model;
+    config.processing_time_us = 3 * 1000;
+    config.realistic_polling = true;
+    emulator_hid_init(&emu, &config);
+    dev = {};
+    REQUIRE(emulator_hid_connect(&dev, &loopback, &emu) == RET_NO_ERROR);
+
+    const int64_t start = micros();
+    struct ResponseStatus status = {};
+    REQUIRE(device_get_status(&dev, &status) == RET_NO_ERROR);
+    const int64_t elapsed = micros() - start;
+    const int64_t responses = dev.timings.responses;
+    REQUIRE(responses >= 3);
+    REQUIRE(dev.timings.probes >= responses);
+    if (model == 'S') {
+        // Storage keeps the stabilization delay before each receive
+        REQUIRE(elapsed >= responses * 200 * 1000);
+    } else {
+        REQUIRE(elapsed < responses * 50 * 1000);
+        REQUIRE(dev.timings.learned_latency_ms >= 3);
+        REQUIRE(dev.timings.learned_latency_ms < 50);
+    }
+    REQUIRE(device_disconnect(&dev) == RET_NO_ERROR);
+}
+
+TEST_CASE("Emulated HID path throughput", "[.benchmark]") {
+    connect_emulator('P');
+    REQUIRE(set_secret_on_device(&dev, base32_secret, admin_PIN, 0) == RET_NO_ERROR);
+    const int operations = 1000;
+    const int64_t start = micros();
+    for (int i = 0; i < operations; ++i) {
+        REQUIRE(authenticate_admin(&dev, admin_PIN, dev.admin_temporary_password) == RET_NO_ERROR);
+    }
+    const int64_t elapsed = micros() - start;
+    WARN("authenticate_admin: " << operations * 1000000.0 / elapsed << " ops/s, " << elapsed / operations << " us/op");
+    REQUIRE(device_disconnect(&dev) == RET_NO_ERROR);
+}
@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "catch.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern "C" {
+#include "../src/return_codes.h"
+#include "../src/status_board.h"
+}
+
+static std::string use_status_file() {
+    const std::string path = "/tmp/test_status_board_" + std::to_string(getpid());
+    setenv("HOTP_VERIFICATION_STATUS_FILE", path.c_str(), 1);
+    return path;
+}
+
+// All the fields derived from one number, to tell a torn snapshot from a consistent one
+static StatusSnapshot make_snapshot(uint32_t n) {
+    StatusSnapshot snapshot = {};
+    snapshot.connected = true;
+    snprintf(snapshot.model, sizeof snapshot.model, "model %u", n);
+    snapshot.card_serial = n;
+    snapshot.firmware_major = (uint8_t) n;
+    snapshot.retry_admin = (uint8_t) (n >> 8);
+    snapshot.pin_set = true;
+    snapshot.status_time = n;
+    snapshot.check_result = (int32_t) n;
+    snapshot.check_time = n;
+    snapshot.update_time = n;
+    return snapshot;
+}
+
+static void require_consistent(const StatusSnapshot &snapshot) {
+    const uint32_t n = snapshot.card_serial;
+    const StatusSnapshot expected = make_snapshot(n);
+    REQUIRE(std::string(snapshot.model) == expected.model);
+    REQUIRE(snapshot.firmware_major == expected.firmware_major);
+    REQUIRE(snapshot.retry_admin == expected.retry_admin);
+    REQUIRE(snapshot.status_time == expected.status_time);
+    REQUIRE(snapshot.check_time == expected.check_time);
+    REQUIRE(snapshot.update_time == expected.update_time);
+}
+
+TEST_CASE("Published status is read from the mapping", "[status]") {
+    const std::string path = use_status_file();
+    StatusBoard writer;
+    REQUIRE(status_board_create(&writer) == RET_NO_ERROR);
+    StatusSnapshot first = make_snapshot(1);
+    status_board_publish(&writer, &first);
+
+    StatusBoard reader;
+    REQUIRE(status_board_open(&reader, nullptr) == RET_NO_ERROR);
+    StatusSnapshot read = {};
+    REQUIRE(status_board_read(&reader, &read));
+    require_consistent(read);
+    REQUIRE(read.card_serial == 1);
+
+    // the same mapping sees the next updates
+    StatusSnapshot second = make_snapshot(2);
+    status_board_publish(&writer, &second);
+    REQUIRE(status_board_read(&reader, &read));
+    REQUIRE(read.card_serial == 2);
+    status_board_close(&reader);
+
+    status_board_close(&writer);
+    REQUIRE(access(path.c_str(), F_OK) != 0);
+    REQUIRE(status_board_open(&reader, nullptr) == RET_NOT_FOUND);
+}
+
+TEST_CASE("Invalid status file is not read", "[status]") {
+    const std::string path = use_status_file();
+    FILE *f = fopen(path.c_str(), "wb");
+    REQUIRE(f != nullptr);
+    fputs("not a status file", f);
+    fclose(f);
+    StatusBoard reader;
+    REQUIRE(status_board_open(&reader, nullptr) == RET_NOT_FOUND);
+    unlink(path.c_str());
+
+    setenv("HOTP_VERIFICATION_STATUS_FILE", "", 1);
+    StatusBoard writer;
+    REQUIRE(status_board_create(&writer) == RET_NOT_FOUND);
+}
+
+TEST_CASE("Reader never sees a torn snapshot", "[status]") {
+    const std::string path = use_status_file();
+    StatusBoard writer;
+    REQUIRE(status_board_create(&writer) == RET_NO_ERROR);
+    StatusSnapshot first = make_snapshot(0);
+    status_board_publish(&writer, &first);
+
+    const pid_t child = fork();
+    REQUIRE(child >= 0);
+    if (child == 0) {
+        for (uint32_t n = 1; n <= 200000; ++n) {
+            const StatusSnapshot snapshot = make_snapshot(n);
+            status_board_publish(&writer, &snapshot);
+        }
+        _exit(0);
+    }
+
+    StatusBoard reader;
+    REQUIRE(status_board_open(&reader, nullptr) == RET_NO_ERROR);
+    uint32_t last = 0;
+    int status = 0;
+    while (waitpid(child, &status, WNOHANG) == 0) {
+        StatusSnapshot read = {};
+        if (!status_board_read(&reader, &read)) {
+            continue;
+        }
+        require_consistent(read);
+        REQUIRE(read.card_serial >= last);
+        last = read.card_serial;
+    }
+    StatusSnapshot read = {};
+    REQUIRE(status_board_read(&reader, &read));
+    REQUIRE(read.card_serial == 200000);
+    status_board_close(&reader);
+    status_board_close(&writer);
+}